@@ -29,6 +29,7 @@ def check_array_result(object_array, to_match, expected):
         raise AssertionError("No objects matched %s"%(str(to_match)))
 
 import threading
+import time
 
 class LongpollThread(threading.Thread):
     def __init__(self, node):
@@ -70,6 +71,18 @@ class GetBlockTemplateLPTest(BitcoinTestFramework):
         thr.join(5)  # wait 5 seconds or until thread exits
         assert(not thr.is_alive())
 
+        # Test 2b: test that a new block ends a long poll within a few seconds, even
+        # while it is still inside the transaction delay
+        thr = LongpollThread(self.nodes[0])
+        thr.start()
+        thr.join(2)
+        assert(thr.is_alive())
+        start = time.time()
+        self.nodes[1].generate(1)
+        thr.join(10)
+        assert(not thr.is_alive())
+        assert(time.time() - start < 5)
+
         # Test 3: test that longpoll will terminate if we generate a block ourselves
         thr = LongpollThread(self.nodes[0])
         thr.start()
@@ -86,6 +99,22 @@ class GetBlockTemplateLPTest(BitcoinTestFramework):
         thr.join(60 + 20)
         assert(not thr.is_alive())
 
+        # Test 5: test that a delta against an earlier template sends only the new transactions
+        templat = self.nodes[0].getblocktemplate()
+        (txid, txhex, fee) = random_transaction(self.nodes, Decimal("1.1"), Decimal("0.0"), Decimal("0.001"), 20)
+        time.sleep(6)  # templates are rebuilt for new transactions at most every 5 seconds
+        delta = self.nodes[0].getblocktemplate({'workid':templat['workid']})
+        assert_equal(delta['deltafrom'], templat['workid'])
+        assert_equal(delta['removed'], [])
+        assert_equal([tx['hash'] for tx in delta['transactions']], [txid])
+        full = self.nodes[0].getblocktemplate()
+        assert_equal(full['workid'], delta['workid'])
+        assert_equal(len(full['transactions']), len(templat['transactions']) + 1)
+        # an unknown workid gets the whole template
+        templat = self.nodes[0].getblocktemplate({'workid':'unknown'})
+        assert('deltafrom' not in templat)
+        assert_equal(templat['transactions'], full['transactions'])
+
 if __name__ == '__main__':
     GetBlockTemplateLPTest().main()
 
@@ -21,8 +21,163 @@
 
 #include <boost/optional.hpp>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
 EhSolverCancelledException solver_cancelled;
 
+static size_t GetPeakRSS()
+{
+#ifdef WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef MAC_OSX
+    return usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+#ifndef WIN32
+/**
+ * Open an unlinked temporary file to back a table, so that the kernel can
+ * page it out to disk instead of holding it all in RAM.
+ */
+static int OpenTemporaryFile()
+{
+    const char* tmpdir = getenv("TMPDIR");
+    std::string path = tmpdir ? tmpdir : "/tmp";
+    path += "/equihash-XXXXXX";
+    std::vector<char> tmpl(path.begin(), path.end());
+    tmpl.push_back('\0');
+
+    int fd = mkstemp(tmpl.data());
+    if (fd >= 0)
+        unlink(tmpl.data());
+    return fd;
+}
+#endif
+
+// Back region with len bytes of its temporary file, creating the file if
+// needed. Growing a mapped region keeps its contents, as they are in the file.
+bool EhSolverMemory::Map(Region& region, size_t len)
+{
+#ifdef WIN32
+    return false;
+#else
+    int fd = region.mapped ? region.fd : OpenTemporaryFile();
+    if (fd < 0)
+        return false;
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, len) == 0)
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        if (!region.mapped)
+            close(fd);
+        return false;
+    }
+    if (region.mapped) {
+        munmap(region.p, region.len);
+    } else if (region.p) {
+        memcpy(p, region.p, region.len);
+        free(region.p);
+    }
+    region.p = p;
+    region.len = len;
+    region.mapped = true;
+    region.fd = fd;
+    spilled = true;
+    return true;
+#endif
+}
+
+void* EhSolverMemory::Acquire(Region& region, size_t len, const Region& other)
+{
+    if (region.p && region.len >= len)
+        return region.p;
+
+    Free(region);
+    if (budget > 0 && len + other.len > budget && !Map(region, len)) {
+        LogPrintf("Equihash: could not back %d byte table with a file, exceeding memory budget of %d bytes\n",
+                  len, budget);
+    }
+    if (!region.p) {
+        region.p = malloc(len);
+        if (!region.p)
+            throw std::bad_alloc();
+        region.len = len;
+    }
+    spilled = table.mapped || leaves.mapped;
+    return region.p;
+}
+
+void EhSolverMemory::Free(Region& region)
+{
+    if (!region.p)
+        return;
+#ifndef WIN32
+    if (region.mapped) {
+        munmap(region.p, region.len);
+        close(region.fd);
+    } else
+#endif
+        free(region.p);
+    region.p = nullptr;
+    region.len = 0;
+    region.mapped = false;
+    region.fd = -1;
+}
+
+void* EhSolverMemory::Table(size_t len)
+{
+    void* p = Acquire(table, len, leaves);
+    peakTableBytes = std::max(peakTableBytes, len);
+    return p;
+}
+
+void* EhSolverMemory::GrowTable(size_t len)
+{
+    if (table.len < len) {
+        bool fits = budget == 0 || len + leaves.len <= budget;
+        if (table.mapped || !fits) {
+            if (!Map(table, len)) {
+                if (table.mapped)
+                    return nullptr;
+                LogPrintf("Equihash: could not back %d byte table with a file, exceeding memory budget of %d bytes\n",
+                          len, budget);
+            }
+        }
+        if (table.len < len) {
+            void* p = realloc(table.p, len);
+            if (!p)
+                return nullptr;
+            table.p = p;
+            table.len = len;
+        }
+    }
+    peakTableBytes = std::max(peakTableBytes, len);
+    return table.p;
+}
+
+void* EhSolverMemory::Leaves(size_t len)
+{
+    return Acquire(leaves, len, table);
+}
+
+void EhSolverMemory::Release()
+{
+    Free(table);
+    Free(leaves);
+}
+
 template<unsigned int N, unsigned int K>
 int Equihash<N,K>::InitialiseState(eh_HashState& base_state)
 {
@@ -490,13 +645,75 @@ void CollideBranches(std::vector<FullStepRow<WIDTH>>& X, const size_t hlen, cons
     }
 }
 
+// Collides two sorted lists of possibilities for a pair of partial indices.
+// Every row of L is a valid left branch and every row of R a valid right
+// branch, so no branch checks are needed, and the pairs are found by merging
+// the lists instead of sorting their concatenation.
+template<size_t WIDTH, size_t W>
+void CollideLeaves(const FullStepRow<W>* L, const FullStepRow<W>* R, const size_t len, std::vector<FullStepRow<WIDTH>>& Xc, const size_t hlen, const size_t lenIndices, const unsigned int clen)
+{
+    CompareSR cmp(clen);
+    bool same = L == R;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < len && j < len) {
+        if (cmp(L[i], R[j])) {
+            i++;
+        } else if (cmp(R[j], L[i])) {
+            j++;
+        } else {
+            // Find the sets of rows colliding on the next n/(k+1) bits
+            size_t ie = i + 1;
+            while (ie < len && !cmp(L[i], L[ie]))
+                ie++;
+            size_t je = j + 1;
+            while (je < len && !cmp(R[j], R[je]))
+                je++;
+
+            // When both indices have the same truncated value, only take
+            // each unordered pair once
+            for (size_t l = i; l < ie; l++) {
+                for (size_t m = same ? l + 1 : j; m < je; m++) {
+                    if (DistinctIndices(L[l], R[m], hlen, lenIndices)) {
+                        Xc.emplace_back(L[l], R[m], hlen, lenIndices, clen);
+                    }
+                }
+            }
+
+            i = ie;
+            j = je;
+        }
+    }
+}
+
 template<unsigned int N, unsigned int K>
 bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
                                    const std::function<bool(std::vector<unsigned char>)> validBlock,
                                    const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    EhSolverMemory memory;
+    return OptimisedSolve(base_state, validBlock, cancelled, memory);
+}
+
+template<unsigned int N, unsigned int K>
+size_t Equihash<N,K>::TableCapacity()
+{
+    // Each round produces about as many collisions as there are rows, so
+    // leave some slack for rounds that produce a few more.
+    size_t init_size { (size_t)1 << (CollisionBitLength + 1) };
+    return init_size + max(init_size/8, 1024);
+}
+
+template<unsigned int N, unsigned int K>
+bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
+                                   const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                   const std::function<bool(EhSolverCancelCheck)> cancelled,
+                                   EhSolverMemory& memory)
 {
     eh_index init_size { 1 << (CollisionBitLength + 1) };
     eh_index recreate_size { UntruncateIndex(1, 0, CollisionBitLength + 1) };
+    int64_t nStart = GetTimeMicros();
+    memory.droppedRows = 0;
 
     // First run the algorithm with truncated indices
 
@@ -509,8 +726,9 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
         LogPrint("pow", "Generating first list\n");
         size_t hashLen = HashLength;
         size_t lenIndices = sizeof(eh_trunc);
-        std::vector<TruncatedStepRow<TruncatedWidth>> Xt;
-        Xt.reserve(init_size);
+        EhRowTable<TruncatedStepRow<TruncatedWidth>> Xt(memory.initialRows ? memory.initialRows : TableCapacity(), memory);
+        if (!Xt.reserve(init_size))
+            throw std::bad_alloc();
         unsigned char tmpHash[HashOutput];
         for (eh_index g = 0; Xt.size() < init_size; g++) {
             GenerateHash(base_state, g, tmpHash, HashOutput);
@@ -574,12 +792,20 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
             }
 
             if (Xc.size() > 0) {
-                // 2f) Add overflow to end of table
-                Xt.insert(Xt.end(), Xc.begin(), Xc.end());
+                // 2f) Add overflow to end of table, growing it as needed; rows
+                // are only dropped if no more memory can be had
+                size_t dropped = 0;
+                if (!Xt.reserve(Xt.size() + Xc.size()))
+                    dropped = Xt.size() + Xc.size() - Xt.capacity();
+                for (size_t l = 0; l < Xc.size() - dropped; l++)
+                    Xt.emplace_back(Xc[l]);
+                if (dropped > 0) {
+                    LogPrint("pow", "- Dropped %d rows that did not fit in the table\n", dropped);
+                    memory.droppedRows += dropped;
+                }
             } else if (posFree < Xt.size()) {
                 // 2g) Remove empty space at the end
-                Xt.erase(Xt.begin()+posFree, Xt.end());
-                Xt.shrink_to_fit();
+                Xt.truncate(posFree);
             }
 
             hashLen -= CollisionByteLength;
@@ -619,42 +845,133 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
         } else
             LogPrint("pow", "- List is empty\n");
 
-    } // Ensure Xt goes out of scope and is destroyed
+    } // Xt's storage is kept by memory for the next run
 
-    LogPrint("pow", "Found %d partial solutions\n", partialSolns.size());
+    // Partial solutions sharing a prefix of truncated indices are recreated
+    // consecutively, so sort them and drop exact duplicates.
+    size_t partialCount = partialSolns.size();
+    std::sort(partialSolns.begin(), partialSolns.end(),
+              [](const std::shared_ptr<eh_trunc>& a, const std::shared_ptr<eh_trunc>& b) {
+        return memcmp(a.get(), b.get(), soln_size*sizeof(eh_trunc)) < 0;
+    });
+    partialSolns.erase(std::unique(partialSolns.begin(), partialSolns.end(),
+                                   [](const std::shared_ptr<eh_trunc>& a, const std::shared_ptr<eh_trunc>& b) {
+        return memcmp(a.get(), b.get(), soln_size*sizeof(eh_trunc)) == 0;
+    }), partialSolns.end());
+    int64_t nCollideTime = GetTimeMicros() - nStart;
+
+    LogPrint("pow", "Found %d partial solutions (%d duplicates)\n",
+             partialSolns.size(), partialCount - partialSolns.size());
 
     // Now for each solution run the algorithm again to recreate the indices
     LogPrint("pow", "Culling solutions\n");
+    // The list of possibilities for a partial index depends only on its
+    // truncated value, so each list is generated at most once per nonce.
+    // The lists live in one block from memory, list t at t*recreate_size.
+    FullStepRow<LeafWidth>* leaves = static_cast<FullStepRow<LeafWidth>*>(memory.Leaves(LeafBytes()));
+    std::vector<bool> haveLeaves(1 << (8*sizeof(eh_trunc)));
+    // Leftmost subtrees of the previous partial solution, which can be reused
+    // by the next one if they share the same truncated indices.
+    std::vector<boost::optional<std::vector<FullStepRow<FinalFullWidth>>>> prefixTrees(K);
+    std::shared_ptr<eh_trunc> prevSoln;
+    // Number of indices after which the previous partial solution was found
+    // to be invalid; any partial solution sharing them is invalid as well.
+    eh_index prevInvalidAt = soln_size + 1;
+    int prunedCount = 0;
+    int reusedCount = 0;
+    int leafCount = 0;
+    auto logStats = [&]() {
+        LogPrint("pow", "- Number of invalid solutions found: %d (%d pruned by shared prefix)\n",
+                 invalidCount, prunedCount);
+        LogPrint("pow", "- Generated %d index lists, reused %d subtrees\n", leafCount, reusedCount);
+        LogPrint("pow", "- Collision rounds took %dus, recreation took %dus\n",
+                 nCollideTime, GetTimeMicros() - nStart - nCollideTime);
+        memory.peakLeafBytes = std::max(memory.peakLeafBytes,
+                                        leafCount*recreate_size*sizeof(FullStepRow<LeafWidth>));
+        memory.peakRSS = GetPeakRSS();
+        LogPrint("pow", "- Table used %d bytes, index lists %d bytes%s, dropped %d rows, peak RSS %d bytes\n",
+                 memory.peakTableBytes, memory.peakLeafBytes, memory.spilled ? " (spilled to disk)" : "",
+                 memory.droppedRows, memory.peakRSS);
+    };
     for (std::shared_ptr<eh_trunc> partialSoln : partialSolns) {
         std::set<std::vector<unsigned char>> solns;
         size_t hashLen;
         size_t lenIndices;
+        size_t r;
         unsigned char tmpHash[HashOutput];
         std::vector<boost::optional<std::vector<FullStepRow<FinalFullWidth>>>> X;
         X.reserve(K+1);
+        // Lists are collided in pairs as they are generated, so level 0 stays empty
+        X.push_back(boost::none);
+
+        eh_index shared = 0;
+        if (prevSoln) {
+            while (shared < soln_size && partialSoln.get()[shared] == prevSoln.get()[shared])
+                shared++;
+        }
+        prevSoln = partialSoln;
+        if (shared >= prevInvalidAt) {
+            prunedCount++;
+            invalidCount++;
+            continue;
+        }
+        prevInvalidAt = soln_size + 1;
+
+        // Resume from the largest leftmost subtree shared with the previous
+        // partial solution, and forget the ones that are no longer shared.
+        eh_index start = 0;
+        for (r = K-1; r > 0; r--) {
+            if ((1 << r) <= shared && prefixTrees[r]) {
+                X.resize(r);
+                X.push_back(prefixTrees[r]);
+                start = 1 << r;
+                reusedCount++;
+                break;
+            }
+        }
+        for (r = 1; r < K; r++) {
+            if ((1 << r) > start)
+                prefixTrees[r] = boost::none;
+        }
 
-        // 3) Repeat steps 1 and 2 for each partial index
-        for (eh_index i = 0; i < soln_size; i++) {
-            // 1) Generate first list of possibilities
-            std::vector<FullStepRow<FinalFullWidth>> icv;
-            icv.reserve(recreate_size);
-            for (eh_index j = 0; j < recreate_size; j++) {
-                eh_index newIndex { UntruncateIndex(partialSoln.get()[i], j, CollisionBitLength + 1) };
-                if (j == 0 || newIndex % IndicesPerHashOutput == 0) {
-                    GenerateHash(base_state, newIndex/IndicesPerHashOutput,
-                                 tmpHash, HashOutput);
+        // 3) Repeat steps 1 and 2 for each pair of partial indices
+        for (eh_index i = start; i < soln_size; i += 2) {
+            // 1) Generate first lists of possibilities
+            const eh_trunc lt = partialSoln.get()[i];
+            const eh_trunc rt = partialSoln.get()[i+1];
+            for (eh_trunc t : {lt, rt}) {
+                if (haveLeaves[t])
+                    continue;
+                FullStepRow<LeafWidth>* list = leaves + t*recreate_size;
+                for (eh_index j = 0; j < recreate_size; j++) {
+                    eh_index newIndex { UntruncateIndex(t, j, CollisionBitLength + 1) };
+                    if (j == 0 || newIndex % IndicesPerHashOutput == 0) {
+                        GenerateHash(base_state, newIndex/IndicesPerHashOutput,
+                                     tmpHash, HashOutput);
+                    }
+                    new (list+j) FullStepRow<LeafWidth>(tmpHash+((newIndex % IndicesPerHashOutput) * N/8),
+                                                        N/8, HashLength, CollisionBitLength, newIndex);
+                    if (cancelled(PartialGeneration)) throw solver_cancelled;
                 }
-                icv.emplace_back(tmpHash+((newIndex % IndicesPerHashOutput) * N/8),
-                                 N/8, HashLength, CollisionBitLength, newIndex);
-                if (cancelled(PartialGeneration)) throw solver_cancelled;
+                std::sort(list, list+recreate_size, CompareSR(CollisionByteLength));
+                if (cancelled(PartialSorting)) throw solver_cancelled;
+                haveLeaves[t] = true;
+                leafCount++;
             }
-            boost::optional<std::vector<FullStepRow<FinalFullWidth>>> ic = icv;
 
-            // 2a) For each pair of lists:
-            hashLen = HashLength;
-            lenIndices = sizeof(eh_index);
+            // 2a) Collide the pair of lists directly
+            boost::optional<std::vector<FullStepRow<FinalFullWidth>>> ic = std::vector<FullStepRow<FinalFullWidth>>();
+            CollideLeaves(leaves + lt*recreate_size, leaves + rt*recreate_size, recreate_size,
+                          *ic, HashLength, sizeof(eh_index), CollisionByteLength);
+            if (ic->size() == 0) {
+                prevInvalidAt = i + 2;
+                goto invalidsolution;
+            }
+
+            hashLen = HashLength - CollisionByteLength;
+            lenIndices = 2*sizeof(eh_index);
             size_t rti = i;
-            for (size_t r = 0; r <= K; r++) {
+            for (r = 1; r <= K; r++) {
                 // 2b) Until we are at the top of a subtree:
                 if (r < X.size()) {
                     if (X[r]) {
@@ -670,8 +987,10 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
                                         partialSoln.get()[lti], partialSoln.get()[rti]);
 
                         // 2d) Check if this has become an invalid solution
-                        if (ic->size() == 0)
+                        if (ic->size() == 0) {
+                            prevInvalidAt = i + 2;
                             goto invalidsolution;
+                        }
 
                         X[r] = boost::none;
                         hashLen -= CollisionByteLength;
@@ -687,6 +1006,9 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
                 }
                 if (cancelled(PartialSubtreeEnd)) throw solver_cancelled;
             }
+            // Remember completed leftmost subtrees for the next partial solution
+            if (r < K && i + 2 == (eh_index)(1 << r))
+                prefixTrees[r] = X[r];
             if (cancelled(PartialIndexEnd)) throw solver_cancelled;
         }
 
@@ -698,8 +1020,10 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
             solns.insert(soln);
         }
         for (auto soln : solns) {
-            if (validBlock(soln))
+            if (validBlock(soln)) {
+                logStats();
                 return true;
+            }
         }
         if (cancelled(PartialEnd)) throw solver_cancelled;
         continue;
@@ -707,7 +1031,7 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
 invalidsolution:
         invalidCount++;
     }
-    LogPrint("pow", "- Number of invalid solutions found: %d\n", invalidCount);
+    logStats();
 
     return false;
 }
@@ -720,42 +1044,58 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
         return false;
     }
 
-    std::vector<FullStepRow<FinalFullWidth>> X;
-    X.reserve(1 << K);
-    unsigned char tmpHash[HashOutput];
-    for (eh_index i : GetIndicesFromMinimal(soln, CollisionBitLength)) {
-        GenerateHash(base_state, i/IndicesPerHashOutput, tmpHash, HashOutput);
-        X.emplace_back(tmpHash+((i % IndicesPerHashOutput) * N/8),
-                       N/8, HashLength, CollisionBitLength, i);
+    // The indices of every subtree can be read straight from the solution, so
+    // only the hashes are carried up the tree, in place and on the stack.
+    const size_t soln_size { 1 << K };
+    unsigned char indices[soln_size*sizeof(eh_index)];
+    ExpandArray(soln.data(), soln.size(), indices, sizeof(indices),
+                CollisionBitLength+1, sizeof(eh_index) - ((CollisionBitLength+1)+7)/8);
+
+    // Every pair of indices meets in exactly one subtree, so checking the
+    // indices of each pair of subtrees for duplicates is the same as checking
+    // the whole solution.
+    eh_index sorted[soln_size];
+    for (size_t i = 0; i < soln_size; i++) {
+        sorted[i] = ArrayToEhIndex(indices+(i*sizeof(eh_index)));
+    }
+    std::sort(sorted, sorted+soln_size);
+    if (std::adjacent_find(sorted, sorted+soln_size) != sorted+soln_size) {
+        printf("Invalid solution: duplicate indices\n");
+        return false;
     }
 
-    size_t hashLen = HashLength;
-    size_t lenIndices = sizeof(eh_index);
-    while (X.size() > 1) {
-        std::vector<FullStepRow<FinalFullWidth>> Xc;
+    unsigned char X[soln_size][HashLength];
+    unsigned char tmpHash[HashOutput];
+    for (size_t i = 0; i < soln_size; i++) {
+        eh_index index = ArrayToEhIndex(indices+(i*sizeof(eh_index)));
+        GenerateHash(base_state, index/IndicesPerHashOutput, tmpHash, HashOutput);
+        ExpandArray(tmpHash+((index % IndicesPerHashOutput) * N/8), N/8,
+                    X[i], HashLength, CollisionBitLength);
+    }
 
-        for (int i = 0; i < X.size(); i += 2) {
-            if (!HasCollision(X[i], X[i+1], CollisionByteLength)) {
+    // Subtrees of width w are merged into the row of their leftmost leaf
+    for (size_t w = 1, pos = 0; w < soln_size; w *= 2, pos += CollisionByteLength) {
+        for (size_t i = 0; i < soln_size; i += 2*w) {
+            if (memcmp(X[i]+pos, X[i+w]+pos, CollisionByteLength) != 0) {
                 printf("Invalid solution: invalid collision length between StepRows\n");
                 return false;
             }
-            if (X[i+1].IndicesBefore(X[i], hashLen, lenIndices)) {
+            if (memcmp(indices+((i+w)*sizeof(eh_index)), indices+(i*sizeof(eh_index)),
+                       w*sizeof(eh_index)) < 0) {
                 printf("Invalid solution: Index tree incorrectly ordered\n");
                 return false;
             }
-            if (!DistinctIndices(X[i], X[i+1], hashLen, lenIndices)) {
-                printf("Invalid solution: duplicate indices\n");
-                return false;
+            for (size_t j = pos+CollisionByteLength; j < HashLength; j++) {
+                X[i][j] ^= X[i+w][j];
             }
-            Xc.emplace_back(X[i], X[i+1], hashLen, lenIndices, CollisionByteLength);
         }
-        X = Xc;
-        hashLen -= CollisionByteLength;
-        lenIndices *= 2;
     }
 
-    assert(X.size() == 1);
-    return X[0].IsZero(hashLen);
+    for (size_t j = K*CollisionByteLength; j < HashLength; j++) {
+        if (X[0][j] != 0)
+            return false;
+    }
+    return true;
 }
 
 // Explicit instantiations for Equihash<96,3>
@@ -766,6 +1106,11 @@ template bool Equihash<96,3>::BasicSolve(const eh_HashState& base_state,
 template bool Equihash<96,3>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
+template bool Equihash<96,3>::OptimisedSolve(const eh_HashState& base_state,
+                                             const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                             const std::function<bool(EhSolverCancelCheck)> cancelled,
+                                             EhSolverMemory& memory);
+template size_t Equihash<96,3>::TableCapacity();
 template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<200,9>
@@ -776,6 +1121,11 @@ template bool Equihash<200,9>::BasicSolve(const eh_HashState& base_state,
 template bool Equihash<200,9>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(std::vector<unsigned char>)> validBlock,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
+template bool Equihash<200,9>::OptimisedSolve(const eh_HashState& base_state,
+                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                              const std::function<bool(EhSolverCancelCheck)> cancelled,
+                                              EhSolverMemory& memory);
+template size_t Equihash<200,9>::TableCapacity();
 template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<96,5>
@@ -786,6 +1136,11 @@ template bool Equihash<96,5>::BasicSolve(const eh_HashState& base_state,
 template bool Equihash<96,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
+template bool Equihash<96,5>::OptimisedSolve(const eh_HashState& base_state,
+                                             const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                             const std::function<bool(EhSolverCancelCheck)> cancelled,
+                                             EhSolverMemory& memory);
+template size_t Equihash<96,5>::TableCapacity();
 template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<48,5>
@@ -796,4 +1151,9 @@ template bool Equihash<48,5>::BasicSolve(const eh_HashState& base_state,
 template bool Equihash<48,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(std::vector<unsigned char>)> validBlock,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
+template bool Equihash<48,5>::OptimisedSolve(const eh_HashState& base_state,
+                                             const std::function<bool(std::vector<unsigned char>)> validBlock,
+                                             const std::function<bool(EhSolverCancelCheck)> cancelled,
+                                             EhSolverMemory& memory);
+template size_t Equihash<48,5>::TableCapacity();
 template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
@@ -11,6 +11,8 @@
 
 #include "sodium.h"
 
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <exception>
 #include <functional>
@@ -153,6 +155,124 @@ class EhSolverCancelledException : public std::exception
     }
 };
 
+/**
+ * Memory budget of the solver, and what its last run actually used. The table
+ * and the index lists cached while recreating solutions are owned by this
+ * object, so a caller that keeps it between runs only allocates (and
+ * page-faults) them once. Both are resident at the same time, so they share
+ * the budget.
+ */
+class EhSolverMemory
+{
+private:
+    struct Region
+    {
+        void* p = nullptr;
+        size_t len = 0;
+        bool mapped = false;
+        // Backing file of a mapped region, kept open so it can grow
+        int fd = -1;
+    };
+    Region table;
+    Region leaves;
+
+    void* Acquire(Region& region, size_t len, const Region& other);
+    bool Map(Region& region, size_t len);
+    static void Free(Region& region);
+
+    EhSolverMemory(const EhSolverMemory&) = delete;
+    EhSolverMemory& operator=(const EhSolverMemory&) = delete;
+
+public:
+    /** Bytes the solver tables may occupy in RAM, or 0 for no limit */
+    size_t budget;
+    /** Rows to start the table with, or 0 for the solver's default (for tests) */
+    size_t initialRows;
+
+    /** Bytes held by the solver tables at their peak */
+    size_t peakTableBytes;
+    /** Bytes of index lists generated while recreating solutions, at their peak */
+    size_t peakLeafBytes;
+    /** Whether the tables were backed by a temporary file to fit the budget */
+    bool spilled;
+    /** Rows dropped because no memory was left to grow the table */
+    size_t droppedRows;
+    /** Peak resident set size of the whole process, as reported by the OS */
+    size_t peakRSS;
+
+    EhSolverMemory(size_t b = 0) : budget {b}, initialRows {0}, peakTableBytes {0}, peakLeafBytes {0},
+                                   spilled {false}, droppedRows {0}, peakRSS {0} { }
+    ~EhSolverMemory() { Release(); }
+
+    /** Return storage for a table of len bytes, reusing the previous one if it is large enough */
+    void* Table(size_t len);
+    /**
+     * Grow the table storage to len bytes, keeping its contents. It stays on
+     * the heap while it fits in the budget and moves to (or extends) its
+     * temporary file past it. Returns nullptr only if no memory is left.
+     */
+    void* GrowTable(size_t len);
+    /** Return storage for the index lists of len bytes, reusing the previous one if it is large enough */
+    void* Leaves(size_t len);
+    /** Free the table and index list storage */
+    void Release();
+};
+
+/**
+ * Table of solver rows. The storage is taken from an EhSolverMemory, either
+ * on the heap or, when it does not fit in the memory budget, in a temporary
+ * file mapped into memory. It grows when a round overflows it, so rows are
+ * only dropped if no more memory can be had at all.
+ */
+template<typename T>
+class EhRowTable
+{
+private:
+    EhSolverMemory& memory;
+    T* rows;
+    size_t count;
+    size_t cap;
+
+    EhRowTable(const EhRowTable&) = delete;
+    EhRowTable& operator=(const EhRowTable&) = delete;
+
+public:
+    EhRowTable(size_t capacity, EhSolverMemory& memory)
+        : memory(memory), rows {static_cast<T*>(memory.Table(capacity*sizeof(T)))},
+          count {0}, cap {capacity} { }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return cap; }
+    bool full() const { return count == cap; }
+    T* begin() { return rows; }
+    T* end() { return rows+count; }
+    T& operator[](size_t i) { return rows[i]; }
+
+    /** Make room for n rows; returns false if no more memory is available */
+    bool reserve(size_t n)
+    {
+        if (n <= cap)
+            return true;
+        // Grow by at least an eighth, so overflowing rounds rarely remap
+        n = std::max(n, cap + cap/8);
+        void* p = memory.GrowTable(n*sizeof(T));
+        if (!p)
+            return false;
+        rows = static_cast<T*>(p);
+        cap = n;
+        return true;
+    }
+    template<typename... Args>
+    void emplace_back(Args&&... args)
+    {
+        assert(count < cap);
+        new (rows+count) T(std::forward<Args>(args)...);
+        count++;
+    }
+    void truncate(size_t n) { assert(n <= count); count = n; }
+    void clear() { count = 0; }
+};
+
 inline constexpr const size_t max(const size_t A, const size_t B) { return A > B ? A : B; }
 
 inline constexpr size_t equihash_solution_size(unsigned int N, unsigned int K) {
@@ -173,6 +293,7 @@ public:
     enum : size_t { CollisionBitLength=N/(K+1) };
     enum : size_t { CollisionByteLength=(CollisionBitLength+7)/8 };
     enum : size_t { HashLength=(K+1)*CollisionByteLength };
+    enum : size_t { LeafWidth=HashLength+sizeof(eh_index) };
     enum : size_t { FullWidth=2*CollisionByteLength+sizeof(eh_index)*(1 << (K-1)) };
     enum : size_t { FinalFullWidth=2*CollisionByteLength+sizeof(eh_index)*(1 << (K)) };
     enum : size_t { TruncatedWidth=max(HashLength+sizeof(eh_trunc), 2*CollisionByteLength+sizeof(eh_trunc)*(1 << (K-1))) };
@@ -181,6 +302,13 @@ public:
 
     Equihash() { }
 
+    /** Number of rows in the table used by OptimisedSolve */
+    static size_t TableCapacity();
+    /** Bytes of the table used by OptimisedSolve */
+    static size_t TableBytes() { return TableCapacity()*sizeof(TruncatedStepRow<TruncatedWidth>); }
+    /** Bytes of the index lists OptimisedSolve caches while recreating solutions, at most */
+    static size_t LeafBytes() { return ((size_t)1 << (CollisionBitLength + 1))*sizeof(FullStepRow<LeafWidth>); }
+
     int InitialiseState(eh_HashState& base_state);
     bool BasicSolve(const eh_HashState& base_state,
                     const std::function<bool(std::vector<unsigned char>)> validBlock,
@@ -188,6 +316,10 @@ public:
     bool OptimisedSolve(const eh_HashState& base_state,
                         const std::function<bool(std::vector<unsigned char>)> validBlock,
                         const std::function<bool(EhSolverCancelCheck)> cancelled);
+    bool OptimisedSolve(const eh_HashState& base_state,
+                        const std::function<bool(std::vector<unsigned char>)> validBlock,
+                        const std::function<bool(EhSolverCancelCheck)> cancelled,
+                        EhSolverMemory& memory);
     bool IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 };
 
@@ -252,6 +384,39 @@ inline bool EhOptimisedSolve(unsigned int n, unsigned int k, const eh_HashState&
     }
 }
 
+inline bool EhOptimisedSolve(unsigned int n, unsigned int k, const eh_HashState& base_state,
+                    const std::function<bool(std::vector<unsigned char>)> validBlock,
+                    const std::function<bool(EhSolverCancelCheck)> cancelled,
+                    EhSolverMemory& memory)
+{
+    if (n == 96 && k == 3) {
+        return Eh96_3.OptimisedSolve(base_state, validBlock, cancelled, memory);
+    } else if (n == 200 && k == 9) {
+        return Eh200_9.OptimisedSolve(base_state, validBlock, cancelled, memory);
+    } else if (n == 96 && k == 5) {
+        return Eh96_5.OptimisedSolve(base_state, validBlock, cancelled, memory);
+    } else if (n == 48 && k == 5) {
+        return Eh48_5.OptimisedSolve(base_state, validBlock, cancelled, memory);
+    } else {
+        throw std::invalid_argument("Unsupported Equihash parameters");
+    }
+}
+
+inline size_t EhOptimisedSolveMemoryBytes(unsigned int n, unsigned int k)
+{
+    if (n == 96 && k == 3) {
+        return Eh96_3.TableBytes() + Eh96_3.LeafBytes();
+    } else if (n == 200 && k == 9) {
+        return Eh200_9.TableBytes() + Eh200_9.LeafBytes();
+    } else if (n == 96 && k == 5) {
+        return Eh96_5.TableBytes() + Eh96_5.LeafBytes();
+    } else if (n == 48 && k == 5) {
+        return Eh48_5.TableBytes() + Eh48_5.LeafBytes();
+    } else {
+        throw std::invalid_argument("Unsupported Equihash parameters");
+    }
+}
+
 inline bool EhOptimisedSolveUncancellable(unsigned int n, unsigned int k, const eh_HashState& base_state,
                     const std::function<bool(std::vector<unsigned char>)> validBlock)
 {
@@ -0,0 +1,145 @@
+#include <gtest/gtest.h>
+
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "crypto/equihash.h"
+#include "main.h"
+#include "pow.h"
+#include "streams.h"
+#include "version.h"
+
+// Mines a regtest header on top of hashPrev
+static CBlockHeader MineHeader(const uint256& hashPrev, uint32_t nTime)
+{
+    const CChainParams& params = Params();
+    unsigned int n = params.EquihashN();
+    unsigned int k = params.EquihashK();
+
+    CBlockHeader header;
+    header.nVersion = CBlockHeader::CURRENT_VERSION;
+    header.hashPrevBlock = hashPrev;
+    header.nTime = nTime;
+    header.nBits = params.GenesisBlock().nBits;
+    for (;;) {
+        header.nNonce = ArithToUint256(UintToArith256(header.nNonce) + 1);
+
+        crypto_generichash_blake2b_state state;
+        EhInitialiseState(n, k, state);
+        CEquihashInput I{header};
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << I;
+        ss << header.nNonce;
+        crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
+
+        bool found = false;
+        EhBasicSolveUncancellable(n, k, state, [&header, &params, &found](std::vector<unsigned char> soln) {
+            header.nSolution = soln;
+            found = CheckProofOfWork(header.GetHash(), header.nBits, params.GetConsensus());
+            return found;
+        });
+        if (found)
+            return header;
+    }
+}
+
+// Breaks the Equihash solution of a header, keeping its proof of work valid
+static void BreakSolution(CBlockHeader& header)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<unsigned char> soln = header.nSolution;
+    for (size_t i = 0; ; i++) {
+        header.nSolution = soln;
+        header.nSolution[i % soln.size()] ^= 1 << (i / soln.size());
+        if (CheckProofOfWork(header.GetHash(), header.nBits, params))
+            return;
+    }
+}
+
+// Mines a chain of headers, breaking the solution of header nBroken
+static std::vector<CBlockHeader> MineHeaders(size_t nCount, size_t nBroken = (size_t)-1)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    std::vector<CBlockHeader> headers;
+    uint256 hashPrev = genesis.GetHash();
+    for (size_t i = 0; i < nCount; i++) {
+        headers.push_back(MineHeader(hashPrev, genesis.nTime + (i+1) * 150));
+        if (i == nBroken)
+            BreakSolution(headers.back());
+        hashPrev = headers.back().GetHash();
+    }
+    return headers;
+}
+
+class CheckHeadersTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        SelectParams(CBaseChainParams::REGTEST);
+        nScriptCheckThreadsSaved = nScriptCheckThreads;
+        nScriptCheckThreads = 2;
+    }
+
+    virtual void TearDown() {
+        nScriptCheckThreads = nScriptCheckThreadsSaved;
+    }
+
+    int nScriptCheckThreadsSaved;
+};
+
+TEST_F(CheckHeadersTest, AllValid) {
+    std::vector<CBlockHeader> headers = MineHeaders(5);
+    std::vector<signed char> vSolution;
+    CheckHeaderSolutions(headers, vSolution);
+    EXPECT_EQ(std::vector<signed char>(5, 1), vSolution);
+}
+
+TEST_F(CheckHeadersTest, InvalidSolutionInMiddleOfBatch) {
+    std::vector<CBlockHeader> headers = MineHeaders(5, 2);
+    ASSERT_FALSE(CheckEquihashSolution(&headers[2], Params()));
+
+    // Only the broken header is marked; the rest are still checked
+    std::vector<signed char> vSolution;
+    CheckHeaderSolutions(headers, vSolution);
+    std::vector<signed char> expected(5, 1);
+    expected[2] = 0;
+    EXPECT_EQ(expected, vSolution);
+
+    // The full header check still rejects it with the same DoS score
+    CValidationState state;
+    int nDoS = 0;
+    EXPECT_FALSE(CheckBlockHeader(headers[2], state));
+    EXPECT_TRUE(state.IsInvalid(nDoS));
+    EXPECT_EQ(100, nDoS);
+    EXPECT_EQ("invalid-solution", state.GetRejectReason());
+}
+
+TEST_F(CheckHeadersTest, StopsAtDiscontinuity) {
+    std::vector<CBlockHeader> headers = MineHeaders(4);
+    headers.erase(headers.begin() + 1);
+
+    std::vector<signed char> vSolution;
+    CheckHeaderSolutions(headers, vSolution);
+    std::vector<signed char> expected(3, -1);
+    expected[0] = 1;
+    EXPECT_EQ(expected, vSolution);
+}
+
+TEST_F(CheckHeadersTest, StopsAtCheapCheckFailure) {
+    std::vector<CBlockHeader> headers = MineHeaders(3);
+    headers[1].nBits = 0x1d00ffff;
+
+    std::vector<signed char> vSolution;
+    CheckHeaderSolutions(headers, vSolution);
+    std::vector<signed char> expected(3, -1);
+    expected[0] = 1;
+    EXPECT_EQ(expected, vSolution);
+}
+
+TEST_F(CheckHeadersTest, SerialWithPar1) {
+    // -par=1 leaves every solution to be checked as its header is accepted
+    nScriptCheckThreads = 0;
+    std::vector<CBlockHeader> headers = MineHeaders(3, 1);
+    std::vector<signed char> vSolution;
+    CheckHeaderSolutions(headers, vSolution);
+    EXPECT_EQ(std::vector<signed char>(3, -1), vSolution);
+}
@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include "arith_uint256.h"
+#include "crypto/equihash.h"
+#include "libzogminer/benchmark.h"
+#include "libzogminer/cpusolver.h"
+#include "uint256.h"
+
+#include <set>
+
+#include "json/json_spirit_utils.h"
+
+TEST(cpusolver_tests, matches_stateless_solver) {
+    unsigned char header[] = "Equihash is an asymmetric PoW based on the Generalised Birthday problem.";
+    EquihashSolver solver(48, 5);
+    solver.setHeader(header, sizeof(header));
+
+    size_t found = 0;
+    for (uint32_t n = 0; n < 16; n++) {
+        SCOPED_TRACE(n);
+        uint256 nonce = ArithToUint256(n);
+
+        crypto_generichash_blake2b_state state;
+        EhInitialiseState(48, 5, state);
+        crypto_generichash_blake2b_update(&state, header, sizeof(header));
+        crypto_generichash_blake2b_update(&state, nonce.begin(), nonce.size());
+        std::set<std::vector<unsigned char>> expected;
+        EhOptimisedSolveUncancellable(48, 5, state, [&expected](std::vector<unsigned char> soln) {
+            expected.insert(soln);
+            return false;
+        });
+
+        std::set<std::vector<unsigned char>> solns;
+        EXPECT_FALSE(solver.solve(nonce, [&solns](std::vector<unsigned char> soln) {
+            solns.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        }));
+        EXPECT_EQ(expected, solns);
+        found += solns.size();
+    }
+
+    EXPECT_EQ(16, solver.stats().solves);
+    EXPECT_EQ(0, solver.stats().cancelled);
+    EXPECT_EQ(found, solver.stats().solutions);
+    EXPECT_EQ((Equihash<48,5>::TableBytes()), solver.stats().tableBytes);
+    EXPECT_LE(solver.stats().leafBytes, (Equihash<48,5>::LeafBytes()));
+}
+
+TEST(cpusolver_tests, cancelled) {
+    unsigned char header[] = "Equihash";
+    EquihashSolver solver(48, 5);
+    solver.setHeader(header, sizeof(header));
+    EXPECT_THROW(solver.solve(uint256(), [](std::vector<unsigned char> soln) {
+        return false;
+    }, [](EhSolverCancelCheck pos) {
+        return pos == ListSorting;
+    }), EhSolverCancelledException);
+    EXPECT_EQ(1, solver.stats().solves);
+    EXPECT_EQ(1, solver.stats().cancelled);
+}
+
+TEST(cpusolver_tests, benchmark_vectors) {
+    std::vector<BenchmarkVector> vectors = GetBenchmarkVectors(8);
+    ASSERT_EQ(8, vectors.size());
+    std::set<std::vector<unsigned char>> headers;
+    for (const BenchmarkVector& vector : vectors) {
+        ASSERT_EQ(140, vector.header.size());
+        EXPECT_TRUE(std::equal(vector.nonce.begin(), vector.nonce.end(), vector.header.end() - 32));
+        headers.insert(vector.header);
+    }
+    EXPECT_EQ(8, headers.size());
+
+    // The set is fixed, so a longer run starts with the same vectors
+    std::vector<BenchmarkVector> more = GetBenchmarkVectors(16);
+    for (size_t i = 0; i < vectors.size(); i++) {
+        EXPECT_EQ(vectors[i].header, more[i].header);
+    }
+}
+
+TEST(cpusolver_tests, benchmark) {
+    GPUConfig conf;
+    conf.useGPU = false;
+    conf.platformId = 0;
+    conf.selGPU = 0;
+    conf.memoryBudget = 0;
+    json_spirit::Object report = RunSolverBenchmark(48, 5, 8, {"optimised", "basic", "gpu", "none"}, conf);
+
+    const json_spirit::Array& reference = find_value(report, "reference").get_array();
+    ASSERT_EQ(8, reference.size());
+    uint64_t total = find_value(report, "referencesolutions").get_uint64();
+    EXPECT_GT(total, 0);
+
+    const json_spirit::Array& engines = find_value(report, "engines").get_array();
+    ASSERT_EQ(4, engines.size());
+    for (size_t i = 0; i < 2; i++) {
+        const json_spirit::Object& engine = engines[i].get_obj();
+        SCOPED_TRACE(find_value(engine, "engine").get_str());
+        EXPECT_EQ(json_spirit::null_type, find_value(engine, "error").type());
+        EXPECT_EQ(8, find_value(engine, "runs").get_int());
+        EXPECT_EQ(0, find_value(engine, "invalid").get_int());
+
+        // No engine finds more than all of them together
+        const json_spirit::Array& found = find_value(engine, "found").get_array();
+        ASSERT_EQ(8, found.size());
+        for (size_t j = 0; j < found.size(); j++) {
+            EXPECT_LE(found[j].get_int(), reference[j].get_int());
+        }
+        EXPECT_GE(find_value(engine, "droprate").get_real(), 0);
+        EXPECT_LT(find_value(engine, "droprate").get_real(), 0.1);
+
+        const json_spirit::Object& latency = find_value(engine, "latency").get_obj();
+        EXPECT_LE(find_value(latency, "min").get_real(), find_value(latency, "p50").get_real());
+        EXPECT_LE(find_value(latency, "p50").get_real(), find_value(latency, "p99").get_real());
+        EXPECT_LE(find_value(latency, "p99").get_real(), find_value(latency, "max").get_real());
+    }
+
+    // Engines that can't run are reported, not fatal
+    EXPECT_EQ(json_spirit::str_type, find_value(engines[2].get_obj(), "error").type());
+    EXPECT_EQ(json_spirit::str_type, find_value(engines[3].get_obj(), "error").type());
+}
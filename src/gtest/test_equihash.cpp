@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include "arith_uint256.h"
 #include "crypto/equihash.h"
 #include "uint256.h"
 
@@ -283,3 +284,145 @@ TEST(equihash_tests, check_optimised_solver_cancelled) {
         }), EhSolverCancelledException);
     }
 }
+
+TEST(equihash_tests, optimised_solver_matches_basic_solver) {
+    Equihash<48,5> Eh48_5;
+    for (uint32_t n = 0; n < 64; n++) {
+        SCOPED_TRACE(n);
+        crypto_generichash_blake2b_state state;
+        Eh48_5.InitialiseState(state);
+        uint256 V = ArithToUint256(n);
+        crypto_generichash_blake2b_update(&state, V.begin(), V.size());
+
+        std::set<std::vector<unsigned char>> basic;
+        std::set<std::vector<unsigned char>> optimised;
+        Eh48_5.BasicSolve(state, [&basic](std::vector<unsigned char> soln) {
+            basic.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        });
+        Eh48_5.OptimisedSolve(state, [&optimised](std::vector<unsigned char> soln) {
+            optimised.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        });
+        EXPECT_EQ(basic, optimised);
+        for (auto soln : optimised) {
+            EXPECT_TRUE(Eh48_5.IsValidSolution(state, soln));
+        }
+    }
+}
+
+TEST(equihash_tests, optimised_solver_within_memory_budget) {
+    Equihash<48,5> Eh48_5;
+    for (uint32_t n = 0; n < 16; n++) {
+        SCOPED_TRACE(n);
+        crypto_generichash_blake2b_state state;
+        Eh48_5.InitialiseState(state);
+        uint256 V = ArithToUint256(n);
+        crypto_generichash_blake2b_update(&state, V.begin(), V.size());
+
+        std::set<std::vector<unsigned char>> unlimited;
+        std::set<std::vector<unsigned char>> budgeted;
+        EhSolverMemory unlimitedMemory;
+        Eh48_5.OptimisedSolve(state, [&unlimited](std::vector<unsigned char> soln) {
+            unlimited.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        }, unlimitedMemory);
+        EhSolverMemory budgetedMemory(1024);
+        Eh48_5.OptimisedSolve(state, [&budgeted](std::vector<unsigned char> soln) {
+            budgeted.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        }, budgetedMemory);
+        EXPECT_EQ(unlimited, budgeted);
+
+        EXPECT_FALSE(unlimitedMemory.spilled);
+        EXPECT_EQ(Eh48_5.TableBytes(), unlimitedMemory.peakTableBytes);
+        if (!unlimited.empty())
+            EXPECT_GT(unlimitedMemory.peakLeafBytes, 0);
+        EXPECT_LE(unlimitedMemory.peakLeafBytes, Eh48_5.LeafBytes());
+        EXPECT_EQ(0, unlimitedMemory.droppedRows);
+#ifndef WIN32
+        EXPECT_TRUE(budgetedMemory.spilled);
+#endif
+    }
+}
+
+TEST(equihash_tests, row_table_grows) {
+    EhSolverMemory unlimited;
+    EhRowTable<uint64_t> table(4, unlimited);
+    for (uint64_t i = 0; i < 4; i++)
+        table.emplace_back(i);
+    EXPECT_TRUE(table.full());
+    ASSERT_TRUE(table.reserve(1000));
+    EXPECT_EQ(1000, table.capacity());
+    for (uint64_t i = 0; i < 4; i++)
+        EXPECT_EQ(i, table[i]);
+    EXPECT_EQ(1000*sizeof(uint64_t), unlimited.peakTableBytes);
+    EXPECT_FALSE(unlimited.spilled);
+
+    // With a budget the table stays in RAM while it fits, then moves to a
+    // file, which keeps growing; the rows survive every move
+    EhSolverMemory budgeted(64);
+    EhRowTable<uint64_t> spilling(4, budgeted);
+    for (uint64_t i = 0; i < 4; i++)
+        spilling.emplace_back(i);
+    ASSERT_TRUE(spilling.reserve(6));
+    EXPECT_FALSE(budgeted.spilled);
+    for (size_t n : {100, 1000, 100000}) {
+        ASSERT_TRUE(spilling.reserve(n));
+        EXPECT_EQ(n, spilling.capacity());
+        while (spilling.size() < n)
+            spilling.emplace_back(spilling.size());
+        for (uint64_t i = 0; i < n; i++)
+            ASSERT_EQ(i, spilling[i]);
+    }
+#ifndef WIN32
+    EXPECT_TRUE(budgeted.spilled);
+#endif
+}
+
+TEST(equihash_tests, optimised_solver_grows_table_within_budget) {
+    Equihash<48,5> Eh48_5;
+    for (uint32_t n = 0; n < 16; n++) {
+        SCOPED_TRACE(n);
+        crypto_generichash_blake2b_state state;
+        Eh48_5.InitialiseState(state);
+        uint256 V = ArithToUint256(n);
+        crypto_generichash_blake2b_update(&state, V.begin(), V.size());
+
+        std::set<std::vector<unsigned char>> unlimited;
+        EhSolverMemory unlimitedMemory;
+        Eh48_5.OptimisedSolve(state, [&unlimited](std::vector<unsigned char> soln) {
+            unlimited.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        }, unlimitedMemory);
+
+        // Start with a table too small for the first list, and a budget
+        // smaller than what it grows to, so it overflows into a file
+        std::set<std::vector<unsigned char>> budgeted;
+        EhSolverMemory budgetedMemory(4*1024);
+        budgetedMemory.initialRows = 16;
+        Eh48_5.OptimisedSolve(state, [&budgeted](std::vector<unsigned char> soln) {
+            budgeted.insert(soln);
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        }, budgetedMemory);
+
+        EXPECT_EQ(unlimited, budgeted);
+        EXPECT_EQ(0, budgetedMemory.droppedRows);
+        EXPECT_GT(budgetedMemory.peakTableBytes, 16*sizeof(TruncatedStepRow<Equihash<48,5>::TruncatedWidth>));
+#ifndef WIN32
+        EXPECT_TRUE(budgetedMemory.spilled);
+#endif
+    }
+}
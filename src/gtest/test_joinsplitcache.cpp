@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+
+#include "arith_uint256.h"
+#include "joinsplitcache.h"
+#include "primitives/transaction.h"
+
+TEST(joinsplitcache_tests, keyed_by_contents_and_pubkey) {
+    CJoinSplitCache cache(10);
+    JSDescription joinsplit;
+    uint256 pubKey = uint256S("0000000000000000000000000000000000000000000000000000000000000001");
+
+    uint256 key = CJoinSplitCache::Key(joinsplit, pubKey);
+    EXPECT_FALSE(cache.Get(key));
+    cache.Set(key);
+    EXPECT_TRUE(cache.Get(key));
+    EXPECT_EQ(key, CJoinSplitCache::Key(joinsplit, pubKey));
+
+    // Any change to what the proof commits to is a different entry
+    JSDescription otherCommitment = joinsplit;
+    otherCommitment.commitments[0] = pubKey;
+    EXPECT_FALSE(cache.Get(CJoinSplitCache::Key(otherCommitment, pubKey)));
+
+    JSDescription otherValue = joinsplit;
+    otherValue.vpub_old = 1;
+    EXPECT_FALSE(cache.Get(CJoinSplitCache::Key(otherValue, pubKey)));
+
+    uint256 otherPubKey = uint256S("0000000000000000000000000000000000000000000000000000000000000002");
+    EXPECT_FALSE(cache.Get(CJoinSplitCache::Key(joinsplit, otherPubKey)));
+}
+
+TEST(joinsplitcache_tests, evicts_at_max_size) {
+    CJoinSplitCache cache(4);
+    JSDescription joinsplit;
+    for (int i = 0; i < 10; i++) {
+        cache.Set(CJoinSplitCache::Key(joinsplit, ArithToUint256(arith_uint256(i))));
+        EXPECT_LE(cache.Size(), 4);
+    }
+    EXPECT_EQ(4, cache.Size());
+    // The newest entry is never the one evicted
+    EXPECT_TRUE(cache.Get(CJoinSplitCache::Key(joinsplit, ArithToUint256(arith_uint256(9)))));
+
+    CJoinSplitCache disabled(0);
+    disabled.Set(CJoinSplitCache::Key(joinsplit, uint256()));
+    EXPECT_EQ(0, disabled.Size());
+}
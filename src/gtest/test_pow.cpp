@@ -68,3 +68,30 @@ TEST(PoW, DifficultyAveraging) {
                                         params),
               GetNextWorkRequired(&blocks[lastBlk], nullptr, params));
 }
+
+TEST(PoW, CheckEquihashSolutions) {
+    SelectParams(CBaseChainParams::MAIN);
+    const CChainParams& params = Params();
+    CBlockHeader genesis = params.GenesisBlock().GetBlockHeader();
+
+    std::vector<CBlockHeader> headers(9, genesis);
+    std::vector<bool> valid;
+    EXPECT_TRUE(CheckEquihashSolutions(headers, params, valid, 4));
+    EXPECT_EQ(std::vector<bool>(9, true), valid);
+
+    headers[5].nNonce = ArithToUint256(UintToArith256(headers[5].nNonce) + 1);
+    headers[8].nSolution[0] ^= 1;
+    EXPECT_FALSE(CheckEquihashSolutions(headers, params, valid, 4));
+    std::vector<bool> expected(9, true);
+    expected[5] = false;
+    expected[8] = false;
+    EXPECT_EQ(expected, valid);
+
+    // Serial checking gives the same results
+    EXPECT_FALSE(CheckEquihashSolutions(headers, params, valid, 1));
+    EXPECT_EQ(expected, valid);
+
+    std::vector<CBlockHeader> none;
+    EXPECT_TRUE(CheckEquihashSolutions(none, params, valid));
+    EXPECT_TRUE(valid.empty());
+}
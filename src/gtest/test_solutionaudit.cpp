@@ -0,0 +1,146 @@
+#include <gtest/gtest.h>
+
+#include "crypto/equihash.h"
+#include "libzogminer/audit.h"
+#include "libzogminer/benchmark.h"
+#include "libzogminer/cl_zogminer.h"
+#include "libzogminer/gpusolver.h"
+
+#include <iostream>
+
+static eh_HashState AuditState(unsigned int n, unsigned int k, const BenchmarkVector& vector)
+{
+    eh_HashState state;
+    EhInitialiseState(n, k, state);
+    crypto_generichash_blake2b_update(&state, vector.header.data(), vector.header.size());
+    return state;
+}
+
+static std::vector<std::vector<unsigned char>> OptimisedSolutions(const eh_HashState& state)
+{
+    std::vector<std::vector<unsigned char>> solns;
+    EhOptimisedSolveUncancellable(48, 5, state, [&solns](std::vector<unsigned char> soln) {
+        solns.push_back(soln);
+        return false;
+    });
+    return solns;
+}
+
+TEST(solutionaudit_tests, samples) {
+    SolutionAuditor auditor(48, 5, 4, false);
+    int sampled = 0;
+    for (int i = 0; i < 16; i++) {
+        sampled += auditor.sample();
+    }
+    EXPECT_EQ(4, sampled);
+
+    SolutionAuditor never(48, 5, 0, false);
+    EXPECT_FALSE(never.sample());
+}
+
+TEST(solutionaudit_tests, counts_losses) {
+    SolutionAuditor auditor(48, 5, 1, false);
+    std::vector<BenchmarkVector> vectors = GetBenchmarkVectors(64);
+
+    // Find a nonce with a few solutions to tamper with
+    eh_HashState state;
+    std::vector<std::vector<unsigned char>> solns;
+    for (const BenchmarkVector& vector : vectors) {
+        state = AuditState(48, 5, vector);
+        solns = OptimisedSolutions(state);
+        if (solns.size() >= 3) {
+            break;
+        }
+    }
+    ASSERT_GE(solns.size(), 3);
+
+    auditor.audit("complete", state, solns);
+
+    std::vector<std::vector<unsigned char>> tampered(solns.begin() + 1, solns.end());
+    tampered.push_back(solns[1]);
+    tampered[1][0] ^= 1;
+    auditor.audit("tampered", state, tampered);
+
+    std::map<std::string, SolutionAuditStats> stats = auditor.stats();
+    ASSERT_EQ(2, stats.size());
+
+    const SolutionAuditStats& complete = stats["complete"];
+    EXPECT_EQ(1, complete.audited);
+    EXPECT_GE(complete.reference, solns.size());
+    EXPECT_EQ(solns.size(), complete.found);
+    EXPECT_EQ(complete.reference - complete.found, complete.missed);
+    EXPECT_EQ(0, complete.invalid);
+    EXPECT_EQ(0, complete.duplicates);
+    EXPECT_EQ(0, complete.extra);
+
+    // First solution dropped, second given twice, third corrupted
+    const SolutionAuditStats& damaged = stats["tampered"];
+    EXPECT_EQ(1, damaged.audited);
+    EXPECT_EQ(complete.reference, damaged.reference);
+    EXPECT_EQ(complete.found - 2, damaged.found);
+    EXPECT_EQ(complete.missed + 2, damaged.missed);
+    EXPECT_EQ(1, damaged.invalid);
+    EXPECT_EQ(1, damaged.duplicates);
+    EXPECT_EQ(0, damaged.extra);
+}
+
+TEST(solutionaudit_tests, background) {
+    SolutionAuditor auditor(48, 5, 1);
+    std::vector<BenchmarkVector> vectors = GetBenchmarkVectors(4);
+    for (const BenchmarkVector& vector : vectors) {
+        eh_HashState state = AuditState(48, 5, vector);
+        auditor.audit("cpu", state, OptimisedSolutions(state));
+    }
+    auditor.wait();
+
+    // Samples that arrived while a check was running were skipped
+    SolutionAuditStats stats = auditor.stats()["cpu"];
+    EXPECT_GE(stats.audited, 1);
+    EXPECT_EQ(4, stats.audited + stats.skipped);
+    EXPECT_EQ(0, stats.invalid);
+    EXPECT_EQ(0, stats.extra);
+}
+
+// Runs the OpenCL kernel on a CPU runtime over a few nonces, when there is one
+TEST(solutionaudit_tests, opencl_cpu_runtime) {
+    unsigned platformId, deviceId;
+    cl_zogminer::allowCPU(true);
+    if (!cl_zogminer::findDevice(CL_DEVICE_TYPE_CPU, platformId, deviceId)) {
+        cl_zogminer::allowCPU(false);
+        std::cout << "No OpenCL CPU runtime, skipping" << std::endl;
+        return;
+    }
+
+    SolutionAuditor auditor(200, 9, 1, false);
+    std::string geometry;
+    {
+        GPUSolver solver(platformId, deviceId);
+        geometry = solver.geometry();
+        std::vector<BenchmarkVector> vectors = GetBenchmarkVectors(2);
+        for (size_t i = 0; i < vectors.size(); i++) {
+            std::vector<unsigned char> header = vectors[i].header;
+            eh_HashState midstate;
+            EhInitialiseState(200, 9, midstate);
+            crypto_generichash_blake2b_update(&midstate, header.data(), header.size() - ZCASH_NONCE_LEN);
+
+            std::vector<std::vector<unsigned char>> candidates;
+            solver.run(200, 9, header.data(), header.size(), i,
+                       [&candidates](std::vector<unsigned char> soln) {
+                candidates.push_back(soln);
+                return false;
+            }, [](GPUSolverCancelCheck pos) {
+                return false;
+            }, midstate);
+            auditor.audit(geometry, AuditState(200, 9, vectors[i]), candidates);
+        }
+    }
+    cl_zogminer::allowCPU(false);
+
+    SolutionAuditStats stats = auditor.stats()[geometry];
+    EXPECT_EQ(2, stats.audited);
+    EXPECT_EQ(0, stats.invalid);
+    EXPECT_EQ(0, stats.duplicates);
+    EXPECT_EQ(0, stats.extra);
+    // The kernel is known to lose a few percent of solutions at most
+    EXPECT_LE(stats.missed * 10, stats.reference);
+}
@@ -0,0 +1,453 @@
+#include <gtest/gtest.h>
+
+#include "chainparams.h"
+#include "crypto/equihash.h"
+#include "libstratum/MinerApi.h"
+#include "libstratum/MockPool.h"
+#include "libstratum/StratumClient.h"
+#include "rpcprotocol.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <functional>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+
+static bool WaitFor(std::function<bool()> condition, int64_t timeout = 5000)
+{
+    int64_t nStart = GetTimeMillis();
+    while (!condition()) {
+        if (GetTimeMillis() - nStart > timeout) {
+            return false;
+        }
+        MilliSleep(10);
+    }
+    return true;
+}
+
+static GPUConfig NoGPU()
+{
+    GPUConfig conf;
+    conf.useGPU = false;
+    conf.selGPU = 0;
+    conf.platformId = 0;
+    conf.globalWorkSize = 0;
+    conf.workgroupSize = 0;
+    conf.memoryBudget = 0;
+    return conf;
+}
+
+static std::string CurrentJob(ZcashMiner& miner)
+{
+    // Only returns the latest work, never waits for newer work
+    uint64_t generation = 0;
+    return miner.waitForWork(generation)->job;
+}
+
+// Solves the current work the way a miner thread would
+static EquihashSolution SolveWork(const ZcashWork& work)
+{
+    unsigned int n = Params().EquihashN();
+    unsigned int k = Params().EquihashK();
+    for (uint64_t counter = 0; ; counter++) {
+        uint256 nonce = work.nonceAt(counter);
+        eh_HashState state = work.midstate;
+        crypto_generichash_blake2b_update(&state, nonce.begin(), nonce.size());
+        std::vector<unsigned char> found;
+        EhBasicSolveUncancellable(n, k, state, [&found](std::vector<unsigned char> soln) {
+            found = soln;
+            return true;
+        });
+        if (!found.empty()) {
+            return EquihashSolution(nonce, found, work.job);
+        }
+    }
+}
+
+class StratumTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        SelectParams(CBaseChainParams::REGTEST);
+    }
+};
+
+TEST_F(StratumTest, SubscribesAndReceivesJob) {
+    MockStratumPool pool;
+    std::string job = pool.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && sc.current(); }));
+
+    EXPECT_EQ(job, CurrentJob(miner));
+    EXPECT_EQ(1u, pool.stats().subscribes);
+    EXPECT_EQ(1u, pool.stats().authorizes);
+
+    // A new job reaches the miner
+    std::string job2 = pool.notify();
+    EXPECT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job2; }));
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, RecordsSubmissions) {
+    MockStratumPool pool;
+    pool.setValidate(true);
+    pool.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    sc.setShareCheck(1, 0);
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && sc.current(); }));
+
+    uint64_t generation = 0;
+    ZcashWorkPtr work = miner.waitForWork(generation);
+    EquihashSolution solution = SolveWork(*work);
+    EXPECT_TRUE(sc.submit(&solution));
+    ASSERT_TRUE(WaitFor([&]() { return miner.shareStats().accepted == 1; }));
+
+    // The pool checks what it is sent
+    EquihashSolution invalid = solution;
+    invalid.solution[0] ^= 1;
+    EXPECT_TRUE(sc.submit(&invalid));
+    ASSERT_TRUE(WaitFor([&]() { return miner.shareStats().rejected == 1; }));
+
+    MockPoolStats stats = pool.stats();
+    EXPECT_EQ(2u, stats.submits);
+    EXPECT_EQ(1u, stats.accepted);
+    EXPECT_EQ(1u, stats.rejected);
+    EXPECT_EQ(0u, stats.stale);
+    EXPECT_EQ(1u, stats.firstShares);
+    ASSERT_EQ(2u, pool.submissions().size());
+    EXPECT_EQ(work->job, pool.submissions()[0].job);
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, FollowsReconnect) {
+    MockStratumPool pool, other;
+    pool.notify();
+    std::string job = other.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && sc.current(); }));
+
+    pool.requestReconnect("127.0.0.1", other.port());
+    ASSERT_TRUE(WaitFor([&]() { return other.clients() == 1 && pool.clients() == 0; }));
+    ASSERT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job; }));
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, FollowsReconnectFromActivePool) {
+    MockStratumPool primary, standby, other;
+    primary.notify();
+    standby.notify();
+    // Job ids are per pool; give this one a different id from the others
+    other.notify();
+    std::string job = other.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(primary.port()), "x", "x", 0, 0};
+    sc.addPool("127.0.0.1", std::to_string(standby.port()), "x", "x");
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && standby.clients() == 1; }));
+
+    // The redirect is followed instead of switching to the standby
+    primary.requestReconnect("127.0.0.1", other.port());
+    ASSERT_TRUE(WaitFor([&]() { return other.clients() == 1 && primary.clients() == 0; }));
+    ASSERT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job; }));
+    EXPECT_EQ(1u, standby.clients());
+
+    // Empty params reconnect to the same pool
+    other.requestReconnect();
+    ASSERT_TRUE(WaitFor([&]() { return other.stats().subscribes == 2 && sc.isConnected(); }));
+    EXPECT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job; }));
+    EXPECT_EQ(1u, other.clients());
+    EXPECT_EQ(1u, primary.stats().subscribes);
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, FailsOverToStandby) {
+    MockStratumPool primary, standby;
+    primary.notify();
+    std::string job = standby.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(primary.port()), "x", "x", 0, 0};
+    sc.addPool("127.0.0.1", std::to_string(standby.port()), "x", "x");
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && standby.clients() == 1; }));
+
+    primary.dropClients();
+    ASSERT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job; }));
+    EXPECT_TRUE(sc.isConnected());
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, ReplaysTrace) {
+    std::string path = (GetTempPath() / "stratum_trace_test.log").string();
+    boost::filesystem::remove(path);
+    {
+        MockStratumPool pool;
+        pool.notify();
+        ZcashMiner miner(0, NoGPU());
+        ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+        sc.setTrace(path);
+        ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && sc.current(); }));
+        std::string job = pool.notify();
+        ASSERT_TRUE(WaitFor([&]() { return CurrentJob(miner) == job; }));
+        sc.disconnect();
+    }
+
+    MockStratumPool replay;
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(replay.port()), "x", "x", 0, 0};
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected(); }));
+    ASSERT_TRUE(replay.replay(path, 10.0));
+    EXPECT_TRUE(WaitFor([&]() { return replay.stats().notifies == 2 && sc.current(); }));
+
+    sc.disconnect();
+    boost::filesystem::remove(path);
+}
+
+TEST_F(StratumTest, RejectsMalformedTrace) {
+    std::string path = (GetTempPath() / "stratum_trace_bad.log").string();
+    MockStratumPool pool;
+    std::vector<std::string> messages {
+        "{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"1\",\"04000000\"]}",
+        "{\"id\":null,\"method\":\"mining.notify\",\"params\":[1,2,3,4,5,6,7,true]}",
+        "{\"id\":null,\"method\":\"mining.set_target\",\"params\":[]}",
+        "{\"id\":null,\"method\":\"mining.set_target\",\"params\":\"00ff\"}",
+        "{\"id\":null,\"method\":\"mining.set_extranonce\",\"params\":[1]}",
+    };
+    for (const std::string& message : messages) {
+        {
+            std::ofstream trace(path);
+            trace << "1000 < " << message << "\n";
+        }
+        EXPECT_FALSE(pool.replay(path)) << message;
+    }
+    EXPECT_EQ(0u, pool.stats().notifies);
+    boost::filesystem::remove(path);
+}
+
+TEST_F(StratumTest, CapsShareRate) {
+    MockStratumPool pool;
+    pool.notify();
+    pool.notifyEvery(500);
+
+    ZcashMiner miner(1, NoGPU());
+    miner.setMaxShareRate(6);
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    sc.setShareCheck(1, 0);
+    miner.onSolutionFound([&](const EquihashSolution& solution) {
+        return sc.submit(&solution);
+    });
+
+    // Every regtest solution meets the initial target, so once the rate is
+    // known the miner asks for a stricter one, and withholds shares until
+    // the pool applies it
+    ASSERT_TRUE(WaitFor([&]() { return pool.stats().suggestedTargets > 0; }, 60000));
+    EXPECT_GT(miner.solutionRate(), 6.0 / 60);
+    arith_uint256 easiest = UintToArith256(uint256S(std::string(64, 'f')));
+    EXPECT_LT(miner.localTarget(easiest), easiest);
+    EXPECT_GT(miner.expectedShareRate(easiest), 6);
+
+    ASSERT_EQ(1u, miner.deviceStats(easiest).size());
+    EXPECT_GT(miner.deviceStats(easiest)[0].solps, 0);
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, AddsCPUWorkersToGPUs) {
+    GPUConfig conf = NoGPU();
+    conf.cpuThreads = 2;
+
+    // Only used next to GPUs
+    ZcashMiner cpuOnly(1, conf);
+    EXPECT_EQ(0, cpuOnly.cpuWorkers());
+    EXPECT_EQ(1u, cpuOnly.deviceStats(arith_uint256()).size());
+
+    conf.useGPU = true;
+    ZcashMiner hybrid(1, conf);
+    EXPECT_EQ(1, hybrid.threads());
+    EXPECT_EQ(2, hybrid.cpuWorkers());
+    std::vector<ZcashDeviceStats> devices = hybrid.deviceStats(arith_uint256());
+    ASSERT_EQ(3u, devices.size());
+    EXPECT_TRUE(devices[0].gpu);
+    EXPECT_FALSE(devices[1].gpu);
+    EXPECT_FALSE(devices[2].gpu);
+
+    conf.cpuThreads = 0;
+    hybrid.setDevices(1, conf);
+    EXPECT_EQ(0, hybrid.cpuWorkers());
+    EXPECT_EQ(1u, hybrid.deviceStats(arith_uint256()).size());
+}
+
+TEST_F(StratumTest, AuditsSolutions) {
+    MockStratumPool pool;
+    pool.notify();
+
+    ZcashMiner miner(1, NoGPU());
+    miner.setSolutionAudit(1);
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    miner.onSolutionFound([&](const EquihashSolution& solution) {
+        return sc.submit(&solution);
+    });
+    ASSERT_TRUE(WaitFor([&]() {
+        return miner.solutionAudit()->stats()["cpu"].audited >= 2;
+    }, 30000));
+
+    SolutionAuditStats stats = miner.solutionAudit()->stats()["cpu"];
+    EXPECT_GT(stats.reference, 0);
+    EXPECT_EQ(0, stats.invalid);
+    EXPECT_EQ(0, stats.duplicates);
+    EXPECT_EQ(0, stats.extra);
+    EXPECT_LE(stats.missed * 10, stats.reference);
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, MeasuresThroughputPerIntensity) {
+    MockStratumPool pool;
+    pool.notify();
+
+    ZcashMiner miner(1, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    miner.onSolutionFound([&](const EquihashSolution& solution) {
+        return sc.submit(&solution);
+    });
+    auto solutionsAt = [&miner](int intensity) -> uint64_t {
+        for (const ZcashIntensityStats& stats : miner.intensityStats()) {
+            if (stats.intensity == intensity) {
+                return stats.solutions;
+            }
+        }
+        return 0;
+    };
+    ASSERT_TRUE(WaitFor([&]() { return solutionsAt(100) >= 100; }, 30000));
+
+    miner.setIntensity(25);
+    EXPECT_EQ(25, miner.intensity());
+    ASSERT_TRUE(WaitFor([&]() { return solutionsAt(25) >= 100; }, 60000));
+    sc.disconnect();
+    miner.stop();
+
+    std::vector<ZcashIntensityStats> stats = miner.intensityStats();
+    ASSERT_EQ(2u, stats.size());
+    EXPECT_EQ(25, stats[0].intensity);
+    EXPECT_EQ(100, stats[1].intensity);
+    EXPECT_GT(stats[0].time, 0);
+    EXPECT_GT(stats[1].time, 0);
+    // Idling three quarters of the time costs most of the throughput
+    EXPECT_LT(stats[0].solps(), stats[1].solps() * 0.6);
+
+    // Stopped, so no time accrues until the threads run again
+    int64_t time = stats[0].time;
+    MilliSleep(50);
+    EXPECT_EQ(time, miner.intensityStats()[0].time);
+
+    miner.setIntensity(0);
+    EXPECT_EQ(1, miner.intensity());
+    miner.setIntensity(1000);
+    EXPECT_EQ(100, miner.intensity());
+}
+
+static Value HttpRequest(unsigned short port, const std::string& method,
+                         const std::string& uri, const std::string& body = "",
+                         const std::string& requestHeaders = "Host: 127.0.0.1\r\n")
+{
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", std::to_string(port));
+    stream << method << " " << uri << " HTTP/1.1\r\n"
+           << requestHeaders
+           << "Content-Length: " << body.size() << "\r\n"
+           << "\r\n" << body << std::flush;
+    int proto;
+    int status = ReadHTTPStatus(stream, proto);
+    std::map<std::string, std::string> headers;
+    std::string reply;
+    ReadHTTPMessage(stream, headers, reply, proto, 1 << 20);
+    Value val;
+    if (status != HTTP_OK || !read_string(reply, val)) {
+        return Value();
+    }
+    return val;
+}
+
+TEST_F(StratumTest, ReportsStatsOverApi) {
+    MockStratumPool pool, other;
+    pool.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected() && sc.current(); }));
+
+    MinerApiServer api(&miner, &sc, 0, true);
+    Value stats = HttpRequest(api.port(), "GET", "/stats");
+    ASSERT_EQ(obj_type, stats.type());
+    EXPECT_TRUE(find_value(stats.get_obj(), "connected").get_bool());
+    EXPECT_EQ("127.0.0.1:" + std::to_string(pool.port()),
+              find_value(stats.get_obj(), "pool").get_str());
+    EXPECT_EQ(0, find_value(find_value(stats.get_obj(), "shares").get_obj(), "accepted").get_int());
+
+    // Pools can be added at runtime
+    Value reply = HttpRequest(api.port(), "POST", "/",
+        "{\"method\": \"addpool\", \"params\": [\"127.0.0.1\", " + std::to_string(other.port()) + "], \"id\": 1}");
+    ASSERT_EQ(obj_type, reply.type());
+    EXPECT_TRUE(find_value(reply.get_obj(), "result").get_bool());
+    EXPECT_TRUE(WaitFor([&]() { return other.clients() == 1; }));
+    Value pools = HttpRequest(api.port(), "GET", "/pools");
+    ASSERT_EQ(array_type, pools.type());
+    ASSERT_EQ(2u, pools.get_array().size());
+    EXPECT_TRUE(find_value(pools.get_array()[0].get_obj(), "active").get_bool());
+    EXPECT_TRUE(find_value(pools.get_array()[1].get_obj(), "standby").get_bool());
+
+    // Unless control is disabled
+    MinerApiServer readOnly(&miner, &sc, 0, false);
+    reply = HttpRequest(readOnly.port(), "POST", "/",
+        "{\"method\": \"reconnect\", \"params\": [], \"id\": 2}");
+    ASSERT_EQ(obj_type, reply.type());
+    EXPECT_EQ(null_type, find_value(reply.get_obj(), "result").type());
+    EXPECT_EQ(obj_type, find_value(reply.get_obj(), "error").type());
+    EXPECT_EQ(null_type, HttpRequest(readOnly.port(), "GET", "/nothing").type());
+
+    sc.disconnect();
+}
+
+TEST_F(StratumTest, RefusesBrowserRequestsOverApi) {
+    MockStratumPool pool, other;
+    pool.notify();
+
+    ZcashMiner miner(0, NoGPU());
+    ZcashStratumClient sc {&miner, "127.0.0.1", std::to_string(pool.port()), "x", "x", 0, 0};
+    ASSERT_TRUE(WaitFor([&]() { return sc.isConnected(); }));
+    MinerApiServer api(&miner, &sc, 0, true);
+    std::string port = std::to_string(api.port());
+    std::string addpool = "{\"method\": \"addpool\", \"params\": [\"127.0.0.1\", " +
+                          std::to_string(other.port()) + "], \"id\": 1}";
+
+    // A cross-site form POST, and a page whose DNS name was rebound to 127.0.0.1
+    EXPECT_EQ(null_type, HttpRequest(api.port(), "POST", "/", addpool,
+        "Host: 127.0.0.1:" + port + "\r\nOrigin: http://example.com\r\n").type());
+    EXPECT_EQ(null_type, HttpRequest(api.port(), "POST", "/", addpool,
+        "Host: example.com:" + port + "\r\n").type());
+    EXPECT_EQ(null_type, HttpRequest(api.port(), "GET", "/stats", "",
+        "Host: example.com\r\n").type());
+    MilliSleep(200);
+    EXPECT_EQ(0u, other.clients());
+
+    // Local clients may name the loopback address in any form
+    std::vector<std::string> hosts {"localhost:" + port, "[::1]:" + port, "LOCALHOST", "[::1]"};
+    for (const std::string& host : hosts) {
+        EXPECT_EQ(obj_type, HttpRequest(api.port(), "GET", "/stats", "",
+            "Host: " + host + "\r\n").type()) << host;
+    }
+    EXPECT_EQ(obj_type, HttpRequest(api.port(), "GET", "/stats", "", "").type());
+
+    sc.disconnect();
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "joinsplitcache.h"
+
+#include "hash.h"
+#include "init.h"
+#include "random.h"
+#include "util.h"
+
+uint256 CJoinSplitCache::Key(const JSDescription& joinsplit, const uint256& joinSplitPubKey)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << joinsplit << joinSplitPubKey;
+    return ss.GetHash();
+}
+
+bool CJoinSplitCache::Get(const uint256& key)
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_proofcache);
+    return setValid.count(key) != 0;
+}
+
+void CJoinSplitCache::Set(const uint256& key)
+{
+    if (nMaxSize == 0)
+        return;
+
+    boost::unique_lock<boost::shared_mutex> lock(cs_proofcache);
+
+    while (setValid.size() >= nMaxSize)
+    {
+        // Evict a random entry, as the signature cache does
+        std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+        if (it == setValid.end())
+            it = setValid.begin();
+        setValid.erase(it);
+    }
+    setValid.insert(key);
+}
+
+size_t CJoinSplitCache::Size()
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_proofcache);
+    return setValid.size();
+}
+
+bool VerifyJoinSplitCached(const JSDescription& joinsplit, const uint256& joinSplitPubKey)
+{
+    // At ~100 bytes an entry, 20,000 entries take about 2MB, and cover
+    // several blocks full of JoinSplits
+    static CJoinSplitCache proofCache(std::max<int64_t>(0, GetArg("-maxproofcachesize", 20000)));
+
+    uint256 key = CJoinSplitCache::Key(joinsplit, joinSplitPubKey);
+    if (proofCache.Get(key))
+        return true;
+
+    if (!joinsplit.Verify(*pzcashParams, joinSplitPubKey))
+        return false;
+
+    proofCache.Set(key);
+    return true;
+}
@@ -0,0 +1,42 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_JOINSPLITCACHE_H
+#define BITCOIN_JOINSPLITCACHE_H
+
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <set>
+
+#include <boost/thread.hpp>
+
+/**
+ * Valid JoinSplit cache, to avoid verifying the same zk-SNARK on mempool
+ * acceptance, for every block template built on it, and again for each
+ * check of the block it is mined in. Like the signature cache it only holds
+ * successes. Entries are keyed by a hash of the whole JoinSplit and the
+ * joinSplitPubKey its proof was verified against.
+ */
+class CJoinSplitCache
+{
+private:
+    std::set<uint256> setValid;
+    size_t nMaxSize;
+    boost::shared_mutex cs_proofcache;
+
+public:
+    CJoinSplitCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    static uint256 Key(const JSDescription& joinsplit, const uint256& joinSplitPubKey);
+
+    bool Get(const uint256& key);
+    void Set(const uint256& key);
+    size_t Size();
+};
+
+/** Verifies the proof of a JoinSplit unless the cache knows it to be valid */
+bool VerifyJoinSplitCached(const JSDescription& joinsplit, const uint256& joinSplitPubKey);
+
+#endif // BITCOIN_JOINSPLITCACHE_H
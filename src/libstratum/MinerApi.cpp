@@ -0,0 +1,373 @@
+// Copyright (c) 2016 Jack Grigg <jack@z.cash>
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "MinerApi.h"
+
+#include "rpcprotocol.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <map>
+
+#include <boost/algorithm/string.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using boost::asio::ip::tcp;
+using namespace json_spirit;
+
+// Largest request accepted, headers and body together
+static const size_t MAX_REQUEST_SIZE = 65536;
+
+struct MinerApiServer::Session
+{
+    Session(boost::asio::io_service& io) : socket(io), buffer(MAX_REQUEST_SIZE) { }
+
+    tcp::socket socket;
+    boost::asio::streambuf buffer;
+    std::string method;
+    std::string uri;
+    std::string body;
+    std::string response;
+};
+
+
+// Whether a Host header names this machine, with or without a port
+static bool IsLoopbackHost(std::string host)
+{
+    boost::to_lower(host);
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+        host.erase(colon);
+    }
+    return host == "127.0.0.1" || host == "localhost" || host == "[::1]";
+}
+
+// Web pages can reach a loopback server through the browser, by a form
+// POST or by rebinding a DNS name to 127.0.0.1. Browsers always send the
+// page's Host, and an Origin on cross-site POSTs; other clients don't.
+static bool IsBrowserRequest(const std::map<std::string, std::string>& headers)
+{
+    if (headers.count("origin")) return true;
+    auto host = headers.find("host");
+    return host != headers.end() && !IsLoopbackHost(host->second);
+}
+
+MinerApiServer::MinerApiServer(ZcashMiner* miner, ZcashStratumClient* client,
+                               unsigned short port, bool allowControl)
+    : p_miner(miner),
+      p_client(client),
+      m_allowControl(allowControl),
+      m_started(GetTime()),
+      m_acceptor(m_io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+{
+    m_port = m_acceptor.local_endpoint().port();
+    startAccept();
+    m_thread = std::thread([this]() {
+        RenameThread("miner-api");
+        m_io_service.run();
+    });
+    LogPrintf("Miner API listening on 127.0.0.1:%d%s\n", m_port,
+              m_allowControl ? ", control enabled" : "");
+}
+
+MinerApiServer::~MinerApiServer()
+{
+    m_io_service.stop();
+    m_thread.join();
+}
+
+void MinerApiServer::startAccept()
+{
+    session_ptr session = std::make_shared<Session>(m_io_service);
+    m_acceptor.async_accept(session->socket, [this, session](const boost::system::error_code& ec) {
+        if (ec) return;
+        startAccept();
+
+        boost::asio::async_read_until(session->socket, session->buffer, "\r\n\r\n",
+            [this, session](const boost::system::error_code& ecRead, std::size_t bytes) {
+                if (ecRead) return;
+                std::istream is(&session->buffer);
+                int proto;
+                if (!ReadHTTPRequestLine(is, proto, session->method, session->uri)) {
+                    reply(session, HTTP_BAD_REQUEST, "");
+                    return;
+                }
+                std::map<std::string, std::string> headers;
+                int length = ReadHTTPHeaders(is, headers);
+                if (length < 0 || (size_t)length > MAX_REQUEST_SIZE) {
+                    reply(session, HTTP_BAD_REQUEST, "");
+                    return;
+                }
+                if (IsBrowserRequest(headers)) {
+                    reply(session, HTTP_FORBIDDEN, "");
+                    return;
+                }
+                readBody(session, length);
+            });
+    });
+}
+
+void MinerApiServer::readBody(session_ptr session, size_t length)
+{
+    // Part of the body may already have come in with the headers
+    size_t buffered = std::min(session->buffer.size(), length);
+    if (buffered == length) {
+        std::istream is(&session->buffer);
+        session->body.resize(length);
+        is.read(&session->body[0], length);
+        handleRequest(session);
+        return;
+    }
+    boost::asio::async_read(session->socket, session->buffer,
+        boost::asio::transfer_exactly(length - buffered),
+        [this, session, length](const boost::system::error_code& ec, std::size_t bytes) {
+            if (ec) return;
+            readBody(session, length);
+        });
+}
+
+void MinerApiServer::handleRequest(session_ptr session)
+{
+    if (session->method == "GET") {
+        std::string call;
+        if (session->uri == "/stats") {
+            call = "getstats";
+        } else if (session->uri == "/pools") {
+            call = "getpools";
+        } else {
+            reply(session, HTTP_NOT_FOUND, "");
+            return;
+        }
+        try {
+            reply(session, HTTP_OK, write_string(this->call(call, Array()), false) + "\n");
+        } catch (const Object& err) {
+            reply(session, HTTP_INTERNAL_SERVER_ERROR, write_string(Value(err), false) + "\n");
+        } catch (const std::exception& e) {
+            reply(session, HTTP_INTERNAL_SERVER_ERROR, "");
+        }
+    } else if (session->uri == "/") {
+        reply(session, HTTP_OK, handleRPC(session->body));
+    } else {
+        reply(session, HTTP_NOT_FOUND, "");
+    }
+}
+
+std::string MinerApiServer::handleRPC(const std::string& body)
+{
+    Value id;
+    try {
+        Value valRequest;
+        if (!read_string(body, valRequest) || valRequest.type() != obj_type) {
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+        }
+        const Object& request = valRequest.get_obj();
+        id = find_value(request, "id");
+        const Value& valMethod = find_value(request, "method");
+        if (valMethod.type() != str_type) {
+            throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
+        }
+        const Value& valParams = find_value(request, "params");
+        Array params;
+        if (valParams.type() == array_type) {
+            params = valParams.get_array();
+        } else if (valParams.type() != null_type) {
+            throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
+        }
+        return JSONRPCReply(call(valMethod.get_str(), params), Value(), id);
+    } catch (const Object& err) {
+        return JSONRPCReply(Value(), err, id);
+    } catch (const std::exception& e) {
+        return JSONRPCReply(Value(), JSONRPCError(RPC_MISC_ERROR, e.what()), id);
+    }
+}
+
+void MinerApiServer::reply(session_ptr session, int status, const std::string& body)
+{
+    session->response = body.empty() ? HTTPError(status, false)
+                                     : HTTPReply(status, body, false);
+    boost::asio::async_write(session->socket, boost::asio::buffer(session->response),
+        [session](const boost::system::error_code& ec, std::size_t bytes) {
+            boost::system::error_code ignored;
+            session->socket.shutdown(tcp::socket::shutdown_both, ignored);
+            session->socket.close(ignored);
+        });
+}
+
+Value MinerApiServer::call(const std::string& method, const Array& params)
+{
+    if (method == "getstats") {
+        return getStats();
+    } else if (method == "getpools") {
+        return getPools();
+    }
+
+    if (method != "addpool" && method != "reconnect" &&
+        method != "setdevices" && method != "setmaxsharerate" && method != "setintensity") {
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    }
+    if (!m_allowControl) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Control calls are disabled, restart the miner with -apicontrol");
+    }
+
+    if (method == "addpool") {
+        if (params.size() < 2 || params.size() > 4) {
+            throw JSONRPCError(RPC_INVALID_PARAMS, "addpool host port [user] [pass]");
+        }
+        std::string port = params[1].type() == str_type ? params[1].get_str()
+                                                        : std::to_string(params[1].get_int());
+        p_client->addPool(params[0].get_str(), port,
+                          params.size() > 2 ? params[2].get_str() : "x",
+                          params.size() > 3 ? params[3].get_str() : "x");
+        return true;
+    } else if (method == "reconnect") {
+        p_client->reconnect();
+        return true;
+    } else if (method == "setdevices") {
+        if (params.size() != 1 && params.size() != 4 && params.size() != 5) {
+            throw JSONRPCError(RPC_INVALID_PARAMS, "setdevices threads [gpu platform device [cputhreads]]");
+        }
+        GPUConfig conf = p_miner->config();
+        if (params.size() >= 4) {
+            conf.useGPU = params[1].get_bool();
+            conf.platformId = params[2].get_int();
+            conf.selGPU = params[3].get_int();
+        }
+        if (params.size() == 5) {
+            conf.cpuThreads = params[4].get_int();
+        }
+        p_miner->setDevices(params[0].get_int(), conf);
+        return true;
+    } else if (method == "setintensity") {
+        if (params.size() != 1) {
+            throw JSONRPCError(RPC_INVALID_PARAMS, "setintensity percent");
+        }
+        int percent = params[0].get_int();
+        if (percent < 1 || percent > 100) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Intensity must be between 1 and 100");
+        }
+        p_miner->setIntensity(percent);
+        return true;
+    } else {
+        if (params.size() != 1) {
+            throw JSONRPCError(RPC_INVALID_PARAMS, "setmaxsharerate rate");
+        }
+        double rate = params[0].get_real();
+        if (rate < 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Rate must not be negative");
+        }
+        p_miner->setMaxShareRate(rate);
+        return true;
+    }
+}
+
+Value MinerApiServer::getStats()
+{
+    Object ret;
+    int64_t now = GetTimeMillis();
+    ret.push_back(Pair("uptime", GetTime() - m_started));
+    int64_t since = p_miner->miningSince();
+    ret.push_back(Pair("mining", p_miner->isMining() && since ? (now - since) / 1000 : 0));
+    ret.push_back(Pair("connected", p_client->isConnected()));
+
+    GPUConfig conf = p_miner->config();
+    ret.push_back(Pair("gpu", conf.useGPU));
+    ret.push_back(Pair("threads", p_miner->threads()));
+    ret.push_back(Pair("cputhreads", p_miner->cpuWorkers()));
+
+    arith_uint256 target = p_miner->serverTarget();
+    double solps = 0, sharesPerMinute = 0;
+    Array devices;
+    std::vector<ZcashDeviceStats> deviceStats = p_miner->deviceStats(target);
+    for (size_t i = 0; i < deviceStats.size(); i++) {
+        Object device;
+        device.push_back(Pair("id", (int)i));
+        device.push_back(Pair("type", deviceStats[i].gpu ? "gpu" : "cpu"));
+        device.push_back(Pair("solps", deviceStats[i].solps));
+        device.push_back(Pair("sharespermin", deviceStats[i].sharesPerMinute));
+        devices.push_back(device);
+        solps += deviceStats[i].solps;
+        sharesPerMinute += deviceStats[i].sharesPerMinute;
+    }
+    ret.push_back(Pair("solps", solps));
+    ret.push_back(Pair("sharespermin", sharesPerMinute));
+    ret.push_back(Pair("devices", devices));
+    ret.push_back(Pair("target", target.GetHex()));
+
+    ret.push_back(Pair("intensity", p_miner->intensity()));
+    Array intensities;
+    for (const ZcashIntensityStats& intensity : p_miner->intensityStats()) {
+        Object level;
+        level.push_back(Pair("intensity", intensity.intensity));
+        level.push_back(Pair("time", intensity.time / 1000.0));
+        level.push_back(Pair("solutions", intensity.solutions));
+        level.push_back(Pair("solps", intensity.solps()));
+        intensities.push_back(level);
+    }
+    ret.push_back(Pair("intensities", intensities));
+
+    ZcashShareStats shareStats = p_miner->shareStats();
+    Object shares;
+    shares.push_back(Pair("accepted", shareStats.accepted));
+    shares.push_back(Pair("rejected", shareStats.rejected));
+    shares.push_back(Pair("acceptedstale", shareStats.acceptedStale));
+    shares.push_back(Pair("rejectedstale", shareStats.rejectedStale));
+    shares.push_back(Pair("failed", shareStats.failed));
+    shares.push_back(Pair("withheld", shareStats.withheld));
+    uint64_t answered = shareStats.accepted + shareStats.rejected;
+    shares.push_back(Pair("avglatency", answered ? shareStats.totalLatency / (int64_t)answered : 0));
+    shares.push_back(Pair("maxlatency", shareStats.maxLatency));
+    ret.push_back(Pair("shares", shares));
+
+    std::shared_ptr<SolutionAuditor> auditor = p_miner->solutionAudit();
+    if (auditor) {
+        Object audit;
+        for (const std::pair<const std::string, SolutionAuditStats>& entry : auditor->stats()) {
+            const SolutionAuditStats& auditStats = entry.second;
+            Object geometry;
+            geometry.push_back(Pair("audited", auditStats.audited));
+            geometry.push_back(Pair("skipped", auditStats.skipped));
+            geometry.push_back(Pair("reference", auditStats.reference));
+            geometry.push_back(Pair("found", auditStats.found));
+            geometry.push_back(Pair("missed", auditStats.missed));
+            geometry.push_back(Pair("invalid", auditStats.invalid));
+            geometry.push_back(Pair("duplicates", auditStats.duplicates));
+            geometry.push_back(Pair("extra", auditStats.extra));
+            geometry.push_back(Pair("yield", auditStats.reference ? (double)(auditStats.reference - auditStats.missed) / auditStats.reference : 1.0));
+            audit.push_back(Pair(entry.first, geometry));
+        }
+        ret.push_back(Pair("audit", audit));
+    }
+
+    for (const pool_status_t& pool : p_client->poolStatus()) {
+        if (pool.active) {
+            ret.push_back(Pair("pool", pool.host + ":" + pool.port));
+        }
+    }
+    return ret;
+}
+
+Value MinerApiServer::getPools()
+{
+    int64_t now = GetTimeMillis();
+    Array ret;
+    for (const pool_status_t& pool : p_client->poolStatus()) {
+        Object obj;
+        obj.push_back(Pair("host", pool.host));
+        obj.push_back(Pair("port", pool.port));
+        obj.push_back(Pair("user", pool.user));
+        obj.push_back(Pair("active", pool.active));
+        obj.push_back(Pair("standby", pool.standby));
+        obj.push_back(Pair("authorized", pool.authorized));
+        obj.push_back(Pair("latency", pool.latency));
+        obj.push_back(Pair("rejectrate", pool.rejectRate));
+        obj.push_back(Pair("lastnotify", pool.lastNotify ? (now - pool.lastNotify) / 1000 : -1));
+        obj.push_back(Pair("failures", pool.failures));
+        obj.push_back(Pair("score", pool.score));
+        ret.push_back(obj);
+    }
+    return ret;
+}
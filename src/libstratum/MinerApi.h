@@ -0,0 +1,79 @@
+// Copyright (c) 2016 Jack Grigg <jack@z.cash>
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZCASH_LIBSTRATUM_MINERAPI_H
+#define ZCASH_LIBSTRATUM_MINERAPI_H
+
+#include "libstratum/StratumClient.h"
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "json/json_spirit_value.h"
+
+/**
+ * Loopback-only HTTP server reporting the state of a miner as JSON, so that
+ * rigs can be monitored without scraping their output. Requests carrying
+ * an Origin header or a Host other than the loopback address are refused,
+ * so that web pages can't use it through the browser.
+ *
+ *   GET /stats   same as the getstats call
+ *   GET /pools   same as the getpools call
+ *   POST /       JSON-RPC: {"method": "...", "params": [...], "id": ...}
+ *
+ * Calls:
+ *   getstats                            Sol/s per device and per intensity,
+ *                                       shares, uptime and solution audits
+ *   getpools                            State of every pool
+ * and, if control is allowed:
+ *   addpool host port [user] [pass]     Add a pool at the lowest priority
+ *   reconnect                           Drop the active pool connection
+ *   setdevices threads [gpu platform device [cputhreads]]
+ *                                       Restart the miner on other devices
+ *   setmaxsharerate rate                See ZcashMiner::setMaxShareRate()
+ *   setintensity percent                See ZcashMiner::setIntensity()
+ */
+class MinerApiServer
+{
+public:
+    /**
+     * Listens on 127.0.0.1:port, or on a free port if port is 0. Throws
+     * boost::system::system_error if the port can't be bound.
+     */
+    MinerApiServer(ZcashMiner* miner, ZcashStratumClient* client,
+                   unsigned short port, bool allowControl);
+    ~MinerApiServer();
+
+    unsigned short port() const { return m_port; }
+
+    /** Runs one call; throws a JSON-RPC error object on failure */
+    json_spirit::Value call(const std::string& method, const json_spirit::Array& params);
+
+private:
+    struct Session;
+    typedef std::shared_ptr<Session> session_ptr;
+
+    void startAccept();
+    void readBody(session_ptr session, size_t length);
+    void handleRequest(session_ptr session);
+    std::string handleRPC(const std::string& body);
+    void reply(session_ptr session, int status, const std::string& body);
+
+    json_spirit::Value getStats();
+    json_spirit::Value getPools();
+
+    ZcashMiner* p_miner;
+    ZcashStratumClient* p_client;
+    bool m_allowControl;
+    int64_t m_started;
+
+    boost::asio::io_service m_io_service;
+    boost::asio::ip::tcp::acceptor m_acceptor;
+    unsigned short m_port;
+    std::thread m_thread;
+};
+
+#endif // ZCASH_LIBSTRATUM_MINERAPI_H
@@ -0,0 +1,555 @@
+// Copyright (c) 2016 Jack Grigg <jack@z.cash>
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "MockPool.h"
+
+#include "chainparams.h"
+#include "compat/endian.h"
+#include "crypto/equihash.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <sstream>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using boost::asio::ip::tcp;
+using namespace json_spirit;
+
+#define LogS(...) LogPrint("stratum", __VA_ARGS__)
+
+// Jobs kept for late and stale shares
+static const size_t MAX_JOBS = 16;
+
+
+MockStratumPool::MockStratumPool(unsigned short port, const std::string& nonce1)
+    : m_acceptor(m_io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+      m_notifytimer(m_io_service),
+      m_replaytimer(m_io_service),
+      m_nonce1(nonce1),
+      m_target(64, 'f')
+{
+    m_port = m_acceptor.local_endpoint().port();
+    p_idle.reset(new boost::asio::io_service::work(m_io_service));
+    startAccept();
+    m_thread = std::thread([this]() {
+        RenameThread("mock-pool");
+        m_io_service.run();
+    });
+}
+
+MockStratumPool::~MockStratumPool()
+{
+    m_io_service.stop();
+    m_thread.join();
+}
+
+size_t MockStratumPool::clients()
+{
+    std::promise<size_t> count;
+    m_io_service.post([this, &count]() { count.set_value(m_sessions.size()); });
+    return count.get_future().get();
+}
+
+void MockStratumPool::setValidate(bool validate)
+{
+    m_io_service.post([this, validate]() { m_validate = validate; });
+}
+
+void MockStratumPool::setResponseDelay(int64_t delay)
+{
+    m_io_service.post([this, delay]() { m_responseDelay = delay; });
+}
+
+void MockStratumPool::setTarget(const std::string& target)
+{
+    m_io_service.post([this, target]() {
+        m_target = target;
+        broadcast("{\"id\": null, \"method\": \"mining.set_target\", \"params\": [\"" + target + "\"]}\n");
+    });
+}
+
+void MockStratumPool::setExtranonce(const std::string& nonce1)
+{
+    m_io_service.post([this, nonce1]() {
+        m_nonce1 = nonce1;
+        broadcast("{\"id\": null, \"method\": \"mining.set_extranonce\", \"params\": [\"" + nonce1 + "\"]}\n");
+    });
+}
+
+std::string MockStratumPool::notify(bool clean)
+{
+    std::promise<std::string> id;
+    m_io_service.post([this, clean, &id]() { id.set_value(sendJob(clean)); });
+    return id.get_future().get();
+}
+
+void MockStratumPool::notifyEvery(int64_t interval)
+{
+    m_io_service.post([this, interval]() {
+        m_notifyInterval = interval;
+        scheduleNotify();
+    });
+}
+
+void MockStratumPool::requestReconnect(const std::string& host, unsigned short port)
+{
+    m_io_service.post([this, host, port]() {
+        broadcast(strprintf("{\"id\": null, \"method\": \"client.reconnect\", \"params\": [\"%s\", \"%d\", 0]}\n",
+                            host, port));
+    });
+}
+
+void MockStratumPool::requestReconnect()
+{
+    m_io_service.post([this]() {
+        broadcast("{\"id\": null, \"method\": \"client.reconnect\", \"params\": []}\n");
+    });
+}
+
+void MockStratumPool::dropClients()
+{
+    m_io_service.post([this]() {
+        std::vector<session_ptr> sessions = m_sessions;
+        for (session_ptr session : sessions) {
+            close(session);
+        }
+    });
+}
+
+// Whether the params of a pool message have the shape replayNext() reads
+static bool ReplayParamsValid(const Object& msg)
+{
+    const std::string& method = find_value(msg, "method").get_str();
+    if (method != "mining.notify" && method != "mining.set_target" &&
+            method != "mining.set_extranonce") {
+        return true;
+    }
+    const Value& params = find_value(msg, "params");
+    if (params.type() != array_type) return false;
+    const Array& array = params.get_array();
+    return array.size() >= (method == "mining.notify" ? 8 : 1) &&
+           array[0].type() == str_type;
+}
+
+bool MockStratumPool::replay(const std::string& path, double speed)
+{
+    std::ifstream trace(path);
+    if (!trace) {
+        return false;
+    }
+
+    // Lines are "<milliseconds> <direction> <message>", see
+    // StratumClient::setTrace(). Keep what the pool sent without being asked.
+    auto messages = std::make_shared<std::vector<std::pair<int64_t, std::string>>>();
+    std::string line;
+    size_t lineNo = 0;
+    while (std::getline(trace, line)) {
+        lineNo++;
+        std::istringstream is(line);
+        int64_t time;
+        char direction;
+        std::string message;
+        if (!(is >> time >> direction) || direction != '<') continue;
+        std::getline(is >> std::ws, message);
+        Value val;
+        if (read_string(message, val) && val.type() == obj_type &&
+            find_value(val.get_obj(), "method").type() == str_type) {
+            if (!ReplayParamsValid(val.get_obj())) {
+                LogS("Mock pool: malformed params on line %d of %s\n", lineNo, path);
+                return false;
+            }
+            messages->push_back(std::make_pair(time, message));
+        }
+    }
+
+    if (messages->empty()) return true;
+    m_io_service.post([this, messages, speed]() {
+        replayNext(messages, 0, speed, GetTimeMillis());
+    });
+    return true;
+}
+
+MockPoolStats MockStratumPool::stats()
+{
+    std::lock_guard<std::mutex> lock(x_stats);
+    return m_stats;
+}
+
+std::vector<MockPoolSubmission> MockStratumPool::submissions()
+{
+    std::lock_guard<std::mutex> lock(x_stats);
+    return m_submissions;
+}
+
+void MockStratumPool::startAccept()
+{
+    session_ptr session = std::make_shared<Session>(m_io_service);
+    m_acceptor.async_accept(session->socket, [this, session](const boost::system::error_code& ec) {
+        if (ec) return;
+        LogS("Mock pool: new connection\n");
+        m_sessions.push_back(session);
+        {
+            std::lock_guard<std::mutex> lock(x_stats);
+            m_stats.connections++;
+        }
+        startRead(session);
+        startAccept();
+    });
+}
+
+void MockStratumPool::startRead(session_ptr session)
+{
+    boost::asio::async_read_until(session->socket, session->buffer, "\n",
+        [this, session](const boost::system::error_code& ec, std::size_t bytes) {
+            if (ec) {
+                close(session);
+                return;
+            }
+            std::istream is(&session->buffer);
+            std::string line;
+            std::getline(is, line);
+            handleRequest(session, line);
+            if (session->socket.is_open()) {
+                startRead(session);
+            }
+        });
+}
+
+void MockStratumPool::handleRequest(session_ptr session, const std::string& line)
+{
+    Value val;
+    if (!read_string(line, val) || val.type() != obj_type) {
+        LogS("Mock pool: discarding %s\n", line);
+        return;
+    }
+    const Object& request = val.get_obj();
+    const Value& id = find_value(request, "id");
+    const Value& valMethod = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    std::string method = valMethod.type() == str_type ? valMethod.get_str() : "";
+    Array params = valParams.type() == array_type ? valParams.get_array() : Array();
+
+    Object reply;
+    reply.push_back(Pair("id", id));
+    if (method == "mining.subscribe") {
+        session->subscribed = true;
+        std::string sessionId;
+        {
+            std::lock_guard<std::mutex> lock(x_stats);
+            sessionId = strprintf("mock-%d", ++m_stats.subscribes);
+        }
+        Array result;
+        result.push_back(sessionId);
+        result.push_back(m_nonce1);
+        reply.push_back(Pair("result", result));
+        reply.push_back(Pair("error", Value()));
+        send(session, write_string(Value(reply), false) + "\n");
+    } else if (method == "mining.authorize") {
+        {
+            std::lock_guard<std::mutex> lock(x_stats);
+            m_stats.authorizes++;
+        }
+        reply.push_back(Pair("result", true));
+        reply.push_back(Pair("error", Value()));
+        send(session, write_string(Value(reply), false) + "\n");
+        send(session, "{\"id\": null, \"method\": \"mining.set_target\", \"params\": [\"" + m_target + "\"]}\n");
+        if (!m_latestJob.empty()) {
+            Array params = m_jobs[m_latestJob].params;
+            params[7] = true;
+            Object msg;
+            msg.push_back(Pair("id", Value()));
+            msg.push_back(Pair("method", "mining.notify"));
+            msg.push_back(Pair("params", params));
+            send(session, write_string(Value(msg), false) + "\n");
+        }
+    } else if (method == "mining.suggest_target" && !params.empty() &&
+               params[0].type() == str_type) {
+        {
+            std::lock_guard<std::mutex> lock(x_stats);
+            m_stats.suggestedTargets++;
+        }
+        reply.push_back(Pair("result", true));
+        reply.push_back(Pair("error", Value()));
+        send(session, write_string(Value(reply), false) + "\n");
+        m_target = params[0].get_str();
+        broadcast("{\"id\": null, \"method\": \"mining.set_target\", \"params\": [\"" + m_target + "\"]}\n");
+    } else if (method == "mining.extranonce.subscribe") {
+        reply.push_back(Pair("result", true));
+        reply.push_back(Pair("error", Value()));
+        send(session, write_string(Value(reply), false) + "\n");
+    } else if (method == "mining.submit") {
+        handleSubmit(session, id, params);
+    } else {
+        Array error;
+        error.push_back(20);
+        error.push_back("Unknown method");
+        error.push_back(Value());
+        reply.push_back(Pair("result", Value()));
+        reply.push_back(Pair("error", error));
+        send(session, write_string(Value(reply), false) + "\n");
+    }
+}
+
+void MockStratumPool::handleSubmit(session_ptr session, const Value& id, const Array& params)
+{
+    MockPoolSubmission submission;
+    submission.received = GetTimeMillis();
+    submission.worker = params.size() > 0 && params[0].type() == str_type ? params[0].get_str() : "";
+    submission.job = params.size() > 1 && params[1].type() == str_type ? params[1].get_str() : "";
+    submission.nonce2 = params.size() > 3 && params[3].type() == str_type ? params[3].get_str() : "";
+    submission.stale = submission.job != m_latestJob;
+
+    auto it = m_jobs.find(submission.job);
+    std::string error;
+    if (it == m_jobs.end()) {
+        error = "Job not found";
+    } else if (m_validate && !checkShare(it->second, params)) {
+        error = "Invalid share";
+    }
+    submission.accepted = error.empty();
+
+    {
+        std::lock_guard<std::mutex> lock(x_stats);
+        m_stats.submits++;
+        if (submission.accepted) {
+            m_stats.accepted++;
+        } else {
+            m_stats.rejected++;
+        }
+        if (submission.stale) {
+            m_stats.stale++;
+        }
+        if (it != m_jobs.end() && !it->second.shared) {
+            int64_t latency = submission.received - it->second.notified;
+            m_stats.firstShares++;
+            m_stats.totalFirstShareLatency += latency;
+            m_stats.maxFirstShareLatency = std::max(m_stats.maxFirstShareLatency, latency);
+        }
+        m_submissions.push_back(submission);
+    }
+    if (it != m_jobs.end()) {
+        it->second.shared = true;
+    }
+
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", submission.accepted));
+    if (submission.accepted) {
+        reply.push_back(Pair("error", Value()));
+    } else {
+        Array err;
+        err.push_back(21);
+        err.push_back(error);
+        err.push_back(Value());
+        reply.push_back(Pair("error", err));
+    }
+    std::string message = write_string(Value(reply), false) + "\n";
+
+    if (m_responseDelay > 0) {
+        auto timer = std::make_shared<boost::asio::deadline_timer>(
+            m_io_service, boost::posix_time::milliseconds(m_responseDelay));
+        timer->async_wait([this, timer, session, message](const boost::system::error_code& ec) {
+            if (!ec && session->socket.is_open()) {
+                send(session, message);
+            }
+        });
+    } else {
+        send(session, message);
+    }
+}
+
+bool MockStratumPool::checkShare(const MockJob& job, const Array& params)
+{
+    if (params.size() < 5) return false;
+
+    // Rebuild the header from the job, the submitted time and the nonce
+    std::string strHex;
+    try {
+        strHex = job.params[1].get_str() + job.params[2].get_str() +
+                 job.params[3].get_str() + job.params[4].get_str() +
+                 params[2].get_str() + job.params[6].get_str() +
+                 job.nonce1 + params[3].get_str() + params[4].get_str();
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+
+    CBlockHeader header;
+    try {
+        CDataStream ss(ParseHex(strHex), SER_NETWORK, PROTOCOL_VERSION);
+        ss >> header;
+    } catch (const std::ios_base::failure&) {
+        return false;
+    }
+
+    unsigned int n = Params().EquihashN();
+    unsigned int k = Params().EquihashK();
+    crypto_generichash_blake2b_state state;
+    EhInitialiseState(n, k, state);
+    CEquihashInput I{header};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    ss << header.nNonce;
+    crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
+
+    bool isValid;
+    EhIsValidSolution(n, k, state, header.nSolution, isValid);
+    return isValid && UintToArith256(header.GetHash()) <= job.target;
+}
+
+void MockStratumPool::send(session_ptr session, const std::string& message)
+{
+    bool idle = session->writes.empty();
+    session->writes.push_back(message);
+    if (!idle) return;
+
+    // Write the queue out one message at a time
+    std::shared_ptr<std::function<void()>> next = std::make_shared<std::function<void()>>();
+    *next = [this, session, next]() {
+        boost::asio::async_write(session->socket, boost::asio::buffer(session->writes.front()),
+            [this, session, next](const boost::system::error_code& ec, std::size_t bytes) {
+                if (ec) {
+                    session->writes.clear();
+                    close(session);
+                    return;
+                }
+                session->writes.pop_front();
+                if (!session->writes.empty()) {
+                    (*next)();
+                } else {
+                    // Break the reference cycle
+                    *next = nullptr;
+                }
+            });
+    };
+    (*next)();
+}
+
+void MockStratumPool::broadcast(const std::string& message)
+{
+    for (session_ptr session : m_sessions) {
+        if (session->subscribed) {
+            send(session, message);
+        }
+    }
+}
+
+std::string MockStratumPool::sendJob(bool clean)
+{
+    uint64_t n = m_nextJob++;
+    // Any header will do, as long as each job's is different
+    uint32_t nTime = htole32(GetTime());
+    uint32_t nBits = htole32(0x200f0f0f);
+    uint256 hashPrevBlock = ArithToUint256(arith_uint256(n));
+    uint256 hashMerkleRoot = ArithToUint256(arith_uint256(n) << 128);
+    Array params;
+    params.push_back(strprintf("%x", n));
+    params.push_back("04000000");
+    params.push_back(HexStr(hashPrevBlock.begin(), hashPrevBlock.end()));
+    params.push_back(HexStr(hashMerkleRoot.begin(), hashMerkleRoot.end()));
+    params.push_back(std::string(64, '0'));
+    params.push_back(HexStr((unsigned char*)&nTime, (unsigned char*)&nTime + 4));
+    params.push_back(HexStr((unsigned char*)&nBits, (unsigned char*)&nBits + 4));
+    params.push_back(clean);
+    addJob(params);
+
+    Object msg;
+    msg.push_back(Pair("id", Value()));
+    msg.push_back(Pair("method", "mining.notify"));
+    msg.push_back(Pair("params", params));
+    broadcast(write_string(Value(msg), false) + "\n");
+    return params[0].get_str();
+}
+
+void MockStratumPool::addJob(const Array& params)
+{
+    MockJob job;
+    job.params = params;
+    job.target = UintToArith256(uint256S(m_target));
+    job.nonce1 = m_nonce1;
+    job.notified = GetTimeMillis();
+    job.shared = false;
+    m_jobs[params[0].get_str()] = job;
+    m_latestJob = params[0].get_str();
+
+    if (m_jobs.size() > MAX_JOBS) {
+        auto oldest = m_jobs.begin();
+        for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+            if (it->second.notified < oldest->second.notified) {
+                oldest = it;
+            }
+        }
+        m_jobs.erase(oldest);
+    }
+
+    std::lock_guard<std::mutex> lock(x_stats);
+    m_stats.notifies++;
+}
+
+void MockStratumPool::close(session_ptr session)
+{
+    boost::system::error_code ec;
+    session->socket.close(ec);
+    m_sessions.erase(std::remove(m_sessions.begin(), m_sessions.end(), session), m_sessions.end());
+}
+
+void MockStratumPool::scheduleNotify()
+{
+    if (m_notifyInterval <= 0) {
+        boost::system::error_code ec;
+        m_notifytimer.cancel(ec);
+        return;
+    }
+    m_notifytimer.expires_from_now(boost::posix_time::milliseconds(m_notifyInterval));
+    m_notifytimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        sendJob(true);
+        scheduleNotify();
+    });
+}
+
+void MockStratumPool::replayNext(
+        std::shared_ptr<std::vector<std::pair<int64_t, std::string>>> messages,
+        size_t pos, double speed, int64_t start)
+{
+    if (pos >= messages->size()) return;
+
+    int64_t due = start + ((*messages)[pos].first - (*messages)[0].first) / speed;
+    m_replaytimer.expires_from_now(boost::posix_time::milliseconds(
+        std::max(due - GetTimeMillis(), (int64_t)0)));
+    m_replaytimer.async_wait([this, messages, pos, speed, start](const boost::system::error_code& ec) {
+        if (ec) return;
+        const std::string& message = (*messages)[pos].second;
+        Value val;
+        read_string(message, val);
+        const Object& msg = val.get_obj();
+        const std::string& method = find_value(msg, "method").get_str();
+        const Value& valParams = find_value(msg, "params");
+        if (valParams.type() == array_type && !valParams.get_array().empty()) {
+            const Array& params = valParams.get_array();
+            // Keep track of what the replayed messages change, so that
+            // shares for replayed jobs are recorded properly. replay() has
+            // checked the params of these.
+            if (method == "mining.notify") {
+                addJob(params);
+            } else if (method == "mining.set_target") {
+                m_target = params[0].get_str();
+            } else if (method == "mining.set_extranonce") {
+                m_nonce1 = params[0].get_str();
+            }
+        }
+        broadcast(message + "\n");
+        replayNext(messages, pos + 1, speed, start);
+    });
+}
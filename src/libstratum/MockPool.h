@@ -0,0 +1,170 @@
+// Copyright (c) 2016 Jack Grigg <jack@z.cash>
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZCASH_LIBSTRATUM_MOCKPOOL_H
+#define ZCASH_LIBSTRATUM_MOCKPOOL_H
+
+#include "arith_uint256.h"
+
+#include <boost/asio.hpp>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+
+struct MockPoolStats
+{
+    uint64_t connections;
+    uint64_t subscribes;
+    uint64_t authorizes;
+    uint64_t suggestedTargets;
+    uint64_t notifies;
+    uint64_t submits;
+    uint64_t accepted;
+    uint64_t rejected;
+    // Shares for a job other than the latest one
+    uint64_t stale;
+    // Time from a job's mining.notify to its first share, in milliseconds
+    uint64_t firstShares;
+    int64_t totalFirstShareLatency;
+    int64_t maxFirstShareLatency;
+
+    MockPoolStats() : connections {0}, subscribes {0}, authorizes {0},
+                      suggestedTargets {0}, notifies {0}, submits {0}, accepted {0}, rejected {0},
+                      stale {0}, firstShares {0}, totalFirstShareLatency {0},
+                      maxFirstShareLatency {0} { }
+};
+
+struct MockPoolSubmission
+{
+    int64_t received;
+    std::string worker;
+    std::string job;
+    std::string nonce2;
+    bool stale;
+    bool accepted;
+};
+
+/**
+ * Local Stratum server for testing and benchmarking miners offline.
+ *
+ * It answers mining.subscribe, mining.authorize, mining.suggest_target
+ * (by switching to the suggested target) and mining.submit, and
+ * sends mining.notify, mining.set_target, mining.set_extranonce and
+ * client.reconnect when scripted to, either through the methods below or by
+ * replaying a trace written by StratumClient::setTrace(). Every submission
+ * is recorded; with validation on, shares are only accepted if they solve
+ * the job's header for the current target.
+ *
+ * All network I/O happens on an internal thread; the methods below may be
+ * called from any thread.
+ */
+class MockStratumPool
+{
+public:
+    /** Listens on 127.0.0.1:port, or on a free port if port is 0 */
+    MockStratumPool(unsigned short port = 0, const std::string& nonce1 = "00000000");
+    ~MockStratumPool();
+
+    unsigned short port() const { return m_port; }
+    size_t clients();
+
+    /** Check shares against the job and target before accepting them */
+    void setValidate(bool validate);
+    /** Delay answers to mining.submit by the given number of milliseconds */
+    void setResponseDelay(int64_t delay);
+
+    /** Sends mining.set_target; it applies to the next job */
+    void setTarget(const std::string& target);
+    /** Sends mining.set_extranonce; it applies to the next job */
+    void setExtranonce(const std::string& nonce1);
+    /** Sends a new job to every client and returns its id */
+    std::string notify(bool clean = true);
+    /** Sends a new job every interval milliseconds; 0 stops */
+    void notifyEvery(int64_t interval);
+    /** Asks every client to reconnect to host:port */
+    void requestReconnect(const std::string& host, unsigned short port);
+    /** Asks every client to reconnect to this pool, with empty params */
+    void requestReconnect();
+    /** Closes every client connection */
+    void dropClients();
+
+    /**
+     * Replays the messages a pool sent in a StratumClient trace, keeping
+     * their original spacing divided by speed. Requests from the client are
+     * still answered by this pool. Returns false if the file can't be read
+     * or a job, target or extranonce message in it has malformed params.
+     */
+    bool replay(const std::string& path, double speed = 1.0);
+
+    MockPoolStats stats();
+    std::vector<MockPoolSubmission> submissions();
+
+private:
+    struct Session
+    {
+        Session(boost::asio::io_service& io) : socket(io) { }
+
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::streambuf buffer;
+        std::deque<std::string> writes;
+        bool subscribed = false;
+    };
+    typedef std::shared_ptr<Session> session_ptr;
+
+    struct MockJob
+    {
+        json_spirit::Array params;
+        arith_uint256 target;
+        std::string nonce1;
+        int64_t notified;
+        bool shared;
+    };
+
+    void startAccept();
+    void startRead(session_ptr session);
+    void handleRequest(session_ptr session, const std::string& line);
+    void handleSubmit(session_ptr session, const json_spirit::Value& id,
+                      const json_spirit::Array& params);
+    bool checkShare(const MockJob& job, const json_spirit::Array& params);
+    void send(session_ptr session, const std::string& message);
+    void broadcast(const std::string& message);
+    std::string sendJob(bool clean);
+    void addJob(const json_spirit::Array& params);
+    void close(session_ptr session);
+    void scheduleNotify();
+    void replayNext(std::shared_ptr<std::vector<std::pair<int64_t, std::string>>> messages,
+                    size_t pos, double speed, int64_t start);
+
+    boost::asio::io_service m_io_service;
+    std::unique_ptr<boost::asio::io_service::work> p_idle;
+    boost::asio::ip::tcp::acceptor m_acceptor;
+    boost::asio::deadline_timer m_notifytimer;
+    boost::asio::deadline_timer m_replaytimer;
+    unsigned short m_port;
+    std::thread m_thread;
+
+    // Everything below is only touched on m_thread, except where guarded
+    // by x_stats
+    std::vector<session_ptr> m_sessions;
+    std::map<std::string, MockJob> m_jobs;
+    std::string m_latestJob;
+    uint64_t m_nextJob = 1;
+    std::string m_nonce1;
+    std::string m_target;
+    bool m_validate = false;
+    int64_t m_responseDelay = 0;
+    int64_t m_notifyInterval = 0;
+
+    std::mutex x_stats;
+    MockPoolStats m_stats;
+    std::vector<MockPoolSubmission> m_submissions;
+};
+
+#endif // ZCASH_LIBSTRATUM_MOCKPOOL_H
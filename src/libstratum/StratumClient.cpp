@@ -14,6 +14,28 @@ using namespace json_spirit;
 
 #define LogS(...) LogPrint("stratum", __VA_ARGS__)
 
+// Delay before reconnecting to a pool, multiplied by its consecutive
+// failures up to RETRY_MAX_FACTOR
+static const int64_t RETRY_DELAY = 3000;
+static const int RETRY_MAX_FACTOR = 20;
+// Cost of a pool's position in the list, in milliseconds of latency
+static const double PRIORITY_COST = 500;
+// Cost of a pool whose shares are all rejected or stale
+static const double REJECT_COST = 2000;
+// Cost of a pool that is behind the other one by NOTIFY_LAG in job notifies
+static const double NOTIFY_LAG_COST = 2000;
+static const int64_t NOTIFY_LAG = 10000;
+// A standby only takes over from a working pool if it scores this much
+// better, and at most every SWITCH_INTERVAL
+static const double SWITCH_MARGIN = 100;
+static const int64_t SWITCH_INTERVAL = 30000;
+static const int HEALTH_CHECK_INTERVAL = 5;
+// Shares that may wait for a verifier thread
+static const size_t MAX_QUEUED_CHECKS = 256;
+// Expected shares per minute outside which a pool's target is reported
+static const double MIN_SHARE_RATE = 0.1;
+static const double MAX_SHARE_RATE = 60;
+
 
 template <typename Miner, typename Job, typename Solution>
 StratumClient<Miner, Job, Solution>::StratumClient(
@@ -21,14 +43,12 @@ StratumClient<Miner, Job, Solution>::StratumClient(
         string const & host, string const & port,
         string const & user, string const & pass,
         int const & retries, int const & worktimeout)
-    : m_socket(m_io_service)
+    : m_strand(m_io_service),
+      m_healthtimer(m_io_service),
+      m_reconnecttimer(m_io_service),
+      m_standbytimer(m_io_service)
 {
-    m_primary.host = host;
-    m_primary.port = port;
-    m_primary.user = user;
-    m_primary.pass = pass;
-
-    p_active = &m_primary;
+    addPool(host, port, user, pass);
 
     m_authorized = false;
     m_connected = false;
@@ -36,17 +56,52 @@ StratumClient<Miner, Job, Solution>::StratumClient(
     m_worktimeout = worktimeout;
 
     p_miner = m;
-    p_current = nullptr;
-    p_previous = nullptr;
-    p_worktimer = nullptr;
+    m_jobs = std::make_shared<const JobSnapshot>();
     startWorking();
 }
 
+template <typename Miner, typename Job, typename Solution>
+StratumClient<Miner, Job, Solution>::~StratumClient()
+{
+    disconnect();
+    // disconnect() cannot join the network thread from inside one of its own
+    // handlers (e.g. after a failed authorization), so make sure it is done.
+    if (m_work) {
+        m_work->join();
+        m_work.reset();
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::addPool(
+        string const & host, string const & port,
+        string const & user, string const & pass)
+{
+    pool_t pool;
+    pool.cred.host = host;
+    pool.cred.port = port;
+    pool.cred.user = user;
+    pool.cred.pass = pass;
+    pool.latency = 0;
+    pool.rejectRate = 0;
+    pool.lastNotify = 0;
+    pool.failures = 0;
+    pool.retryAt = 0;
+    pool.session = "";
+    m_strand.dispatch([this, pool]() {
+        m_pools.push_back(pool);
+        // A second pool can now serve as a standby
+        if (m_active && m_active->authorized) {
+            connectStandby();
+        }
+    });
+}
+
 template <typename Miner, typename Job, typename Solution>
 void StratumClient<Miner, Job, Solution>::setFailover(
         string const & host, string const & port)
 {
-    setFailover(host, port, p_active->user, p_active->pass);
+    setFailover(host, port, "", "");
 }
 
 template <typename Miner, typename Job, typename Solution>
@@ -54,15 +109,32 @@ void StratumClient<Miner, Job, Solution>::setFailover(
         string const & host, string const & port,
         string const & user, string const & pass)
 {
-    m_failover.host = host;
-    m_failover.port = port;
-    m_failover.user = user;
-    m_failover.pass = pass;
+    if (host == "exit") {
+        // Stop once every pool has failed more than m_maxRetries times
+        m_strand.dispatch([this]() { m_exitOnFailure = true; });
+        return;
+    }
+    if (user.empty()) {
+        m_strand.dispatch([this, host, port]() {
+            const cred_t& primary = m_pools.front().cred;
+            addPool(host, port, primary.user, primary.pass);
+        });
+    } else {
+        addPool(host, port, user, pass);
+    }
 }
 
 template <typename Miner, typename Job, typename Solution>
 void StratumClient<Miner, Job, Solution>::startWorking()
 {
+    p_idle.reset(new boost::asio::io_service::work(m_io_service));
+    m_strand.post([this]() {
+        connectActive();
+        m_healthtimer.expires_from_now(boost::posix_time::seconds(HEALTH_CHECK_INTERVAL));
+        m_healthtimer.async_wait(m_strand.wrap(boost::bind(
+            &StratumClient::health_check_handler, this,
+            boost::asio::placeholders::error)));
+    });
     m_work.reset(new std::thread([&]() {
         workLoop();
     }));
@@ -71,134 +143,465 @@ void StratumClient<Miner, Job, Solution>::startWorking()
 template <typename Miner, typename Job, typename Solution>
 void StratumClient<Miner, Job, Solution>::workLoop()
 {
-    while (m_running) {
+    // All socket I/O happens on this thread, in handlers serialised by
+    // m_strand. Miner threads only ever post to the strand, so they never
+    // block on the network.
+    while (true) {
         try {
-            if (!m_connected) {
-                //m_io_service.run();
-                //boost::thread t(boost::bind(&boost::asio::io_service::run, &m_io_service));
-                connect();
-
-            }
-            read_until(m_socket, m_responseBuffer, "\n");
-            std::istream is(&m_responseBuffer);
-            std::string response;
-            getline(is, response);
-
-            if (!response.empty() && response.front() == '{' && response.back() == '}') {
-                Value valResponse;
-                if (read_string(response, valResponse) && valResponse.type() == obj_type) {
-                    const Object& responseObject = valResponse.get_obj();
-                    if (!responseObject.empty()) {
-                        processReponse(responseObject);
-                        m_response = response;
-                    } else {
-                        LogS("[WARN] Response was empty\n");
-                    }
-                } else {
-                    LogS("[WARN] Parse response failed\n");
-                }
-            } else {
-                LogS("[WARN] Discarding incomplete response\n");
-            }
+            m_io_service.run();
+            break;
         } catch (std::exception const& _e) {
             LogS("[WARN] %s\n", _e.what());
-            reconnect();
+            if (m_running) {
+                reconnect();
+            }
+        }
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+double StratumClient<Miner, Job, Solution>::poolScore(size_t i, int64_t now)
+{
+    // Lower is better. Pools that failed more than m_maxRetries times in a
+    // row are only considered once nothing else is left.
+    const pool_t& pool = m_pools[i];
+    double score = i * PRIORITY_COST + pool.latency + pool.rejectRate * REJECT_COST;
+    if (pool.failures > m_maxRetries && now < pool.retryAt) {
+        score += 1e9;
+    }
+    return score;
+}
+
+template <typename Miner, typename Job, typename Solution>
+std::vector<pool_status_t> StratumClient<Miner, Job, Solution>::poolStatus()
+{
+    auto status = std::make_shared<std::promise<std::vector<pool_status_t>>>();
+    std::future<std::vector<pool_status_t>> ret = status->get_future();
+    m_strand.post([this, status]() {
+        int64_t now = GetTimeMillis();
+        std::vector<pool_status_t> pools;
+        for (size_t i = 0; i < m_pools.size(); i++) {
+            const pool_t& pool = m_pools[i];
+            pool_status_t p;
+            p.host = pool.cred.host;
+            p.port = pool.cred.port;
+            p.user = pool.cred.user;
+            p.active = m_active && m_active->pool == i;
+            p.standby = m_standby && m_standby->pool == i;
+            p.authorized = (p.active && m_active->authorized) ||
+                           (p.standby && m_standby->authorized);
+            p.latency = pool.latency;
+            p.rejectRate = pool.rejectRate;
+            p.lastNotify = pool.lastNotify;
+            p.failures = pool.failures;
+            p.score = poolScore(i, now);
+            pools.push_back(p);
+        }
+        status->set_value(pools);
+    });
+    // The io thread is gone once the client has stopped
+    if (!m_running || ret.wait_for(std::chrono::seconds(2)) != std::future_status::ready) {
+        return std::vector<pool_status_t>();
+    }
+    return ret.get();
+}
+
+template <typename Miner, typename Job, typename Solution>
+int StratumClient<Miner, Job, Solution>::selectPool(int exclude)
+{
+    int64_t now = GetTimeMillis();
+    int best = -1;
+    double bestScore = 0;
+    for (size_t i = 0; i < m_pools.size(); i++) {
+        if ((int)i == exclude) continue;
+        double score = poolScore(i, now);
+        if (best < 0 || score < bestScore) {
+            best = i;
+            bestScore = score;
         }
     }
+    return best;
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::connectActive()
+{
+    if (!m_running || m_active) return;
+
+    if (m_standby) {
+        LogS("Switching to standby pool %s:%s\n",
+             m_pools[m_standby->pool].cred.host, m_pools[m_standby->pool].cred.port);
+        activate(m_standby);
+        connectStandby();
+        return;
+    }
+
+    size_t i = selectPool(-1);
+    int64_t delay = m_pools[i].retryAt - GetTimeMillis();
+    if (delay > 0) {
+        LogS("Reconnecting in %d seconds...\n", (delay + 999) / 1000);
+        m_reconnecttimer.expires_from_now(boost::posix_time::milliseconds(delay));
+        m_reconnecttimer.async_wait(m_strand.wrap(
+            [this](const boost::system::error_code& ec) {
+                if (!ec) connectActive();
+            }));
+        return;
+    }
+    activate(open(i));
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::connectStandby()
+{
+    if (!m_running || !m_active || m_standby) return;
+
+    int i = selectPool(m_active->pool);
+    if (i < 0) return;
+    int64_t delay = std::max(m_pools[i].retryAt - GetTimeMillis(), (int64_t)0);
+    m_standbytimer.expires_from_now(boost::posix_time::milliseconds(delay));
+    m_standbytimer.async_wait(m_strand.wrap(
+        [this, i](const boost::system::error_code& ec) {
+            if (!ec && m_running && m_active && !m_standby && m_active->pool != (size_t)i) {
+                m_standby = open(i);
+            }
+        }));
 }
 
+template <typename Miner, typename Job, typename Solution>
+typename StratumClient<Miner, Job, Solution>::conn_ptr
+StratumClient<Miner, Job, Solution>::open(size_t i)
+{
+    const cred_t& cred = m_pools[i].cred;
+    LogS("Connecting to stratum server %s:%s\n", cred.host, cred.port);
+
+    conn_ptr conn = std::make_shared<Connection>(m_io_service, i);
+    tcp::resolver::query q(cred.host, cred.port);
+    conn->resolver.async_resolve(q, m_strand.wrap(boost::bind(
+        &StratumClient::handleResolve, this, conn,
+        boost::asio::placeholders::error,
+        boost::asio::placeholders::iterator)));
+    return conn;
+}
 
 template <typename Miner, typename Job, typename Solution>
-void StratumClient<Miner, Job, Solution>::connect()
+void StratumClient<Miner, Job, Solution>::activate(conn_ptr conn)
 {
-    LogS("Connecting to stratum server %s:%s\n", p_active->host, p_active->port);
+    m_active = conn;
+    if (m_standby == conn) {
+        m_standby.reset();
+    }
+    m_connected = conn->connected;
+    m_authorized = conn->authorized;
 
-    tcp::resolver r(m_io_service);
-    tcp::resolver::query q(p_active->host, p_active->port);
-    tcp::resolver::iterator endpoint_iterator = r.resolve(q);
-    tcp::resolver::iterator end;
+    // Jobs from the previous pool cannot be submitted here
+    std::atomic_store(&m_jobs, std::make_shared<const JobSnapshot>());
 
-    boost::system::error_code error = boost::asio::error::host_not_found;
-    while (error && endpoint_iterator != end) {
-        m_socket.close();
-        m_socket.connect(*endpoint_iterator++, error);
+    if (conn->connected && !p_miner->isMining()) {
+        LogS("Starting miner\n");
+        p_miner->start();
+    }
+    if (!conn->subscription.empty()) {
+        p_miner->setServerNonce(conn->subscription);
     }
-    if (error) {
-        LogS("[ERROR] Could not connect to stratum server %s:%s, %s\n",
-             p_active->host, p_active->port, error.message());
-        reconnect();
+    if (!conn->jobParams.empty()) {
+        // Make the miner threads drop their work for the previous pool
+        Array params = conn->jobParams;
+        if (params.size() > 7) {
+            params[7] = true;
+        }
+        newJob(conn, params);
     } else {
-        LogS("Connected!\n");
-        m_connected = true;
-        if (!p_miner->isMining()) {
-            LogS("Starting miner\n");
-            p_miner->start();
+        p_miner->setJob(nullptr);
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::failover()
+{
+    if (m_exitOnFailure) {
+        bool allFailed = true;
+        for (const pool_t& pool : m_pools) {
+            allFailed &= pool.failures > m_maxRetries;
+        }
+        if (allFailed) {
+            LogS("[ERROR] All stratum servers failed, exiting\n");
+            disconnect();
+            return;
         }
-        std::ostream os(&m_requestBuffer);
-        os << "{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\""
-           << p_active->host << "\",\""
-           << p_active->port << "\",\""
-           << p_miner->userAgent() << "\", null]}\n";
-        write(m_socket, m_requestBuffer);
     }
+    connectActive();
 }
 
 template <typename Miner, typename Job, typename Solution>
-void StratumClient<Miner, Job, Solution>::reconnect()
+void StratumClient<Miner, Job, Solution>::dropConnection(conn_ptr conn)
+{
+    boost::system::error_code ec;
+    conn->resolver.cancel();
+    conn->socket.close(ec);
+    conn->connected = false;
+    conn->authorized = false;
+    conn->requests.clear();
+    if (!conn->pending.empty()) {
+        LogS("[WARN] Lost %d unanswered submissions\n", conn->pending.size());
+        conn->pending.clear();
+    }
+
+    if (conn == m_standby) {
+        m_standby.reset();
+        connectStandby();
+    } else if (conn == m_active) {
+        m_active.reset();
+        m_authorized = false;
+        m_connected = false;
+        failover();
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::reconnectPool(conn_ptr conn, int64_t delay)
 {
-    if (p_worktimer) {
-        p_worktimer->cancel();
-        p_worktimer = nullptr;
+    if (conn != m_active) {
+        // The standby is reopened with the new address as usual
+        dropConnection(conn);
+        return;
     }
 
-    //m_io_service.reset();
-    //m_socket.close(); // leads to crashes on Linux
+    // Stay on this pool rather than switching to the standby
+    size_t i = conn->pool;
+    m_active.reset();
     m_authorized = false;
     m_connected = false;
+    dropConnection(conn);
+    std::atomic_store(&m_jobs, std::make_shared<const JobSnapshot>());
+    p_miner->setJob(nullptr);
+
+    m_reconnecttimer.expires_from_now(boost::posix_time::milliseconds(delay));
+    m_reconnecttimer.async_wait(m_strand.wrap(
+        [this, i](const boost::system::error_code& ec) {
+            if (!ec && m_running && !m_active) activate(open(i));
+        }));
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::connectionFailed(
+        conn_ptr conn, const string& reason)
+{
+    pool_t& pool = m_pools[conn->pool];
+    LogS("[WARN] %s:%s: %s\n", pool.cred.host, pool.cred.port, reason);
+    pool.failures++;
+    pool.retryAt = GetTimeMillis() +
+        RETRY_DELAY * std::min(pool.failures, RETRY_MAX_FACTOR);
+    dropConnection(conn);
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::handleResolve(
+        conn_ptr conn, const boost::system::error_code& ec,
+        tcp::resolver::iterator endpoint_iterator)
+{
+    if (!isCurrent(conn)) return;
+    if (ec) {
+        connectionFailed(conn, "Could not resolve stratum server, " + ec.message());
+        return;
+    }
 
-    if (!m_failover.host.empty()) {
-        m_retries++;
+    boost::asio::async_connect(conn->socket, endpoint_iterator, m_strand.wrap(
+        boost::bind(&StratumClient::handleConnect, this, conn,
+                    boost::asio::placeholders::error)));
+}
 
-        if (m_retries > m_maxRetries) {
-            if (m_failover.host == "exit") {
-                disconnect();
-                return;
-            } else if (p_active == &m_primary) {
-                p_active = &m_failover;
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::handleConnect(
+        conn_ptr conn, const boost::system::error_code& ec)
+{
+    if (!isCurrent(conn)) return;
+    if (ec) {
+        connectionFailed(conn, "Could not connect to stratum server, " + ec.message());
+        return;
+    }
+
+    const pool_t& pool = m_pools[conn->pool];
+    const cred_t& cred = pool.cred;
+    LogS("Connected to %s:%s!\n", cred.host, cred.port);
+    conn->connected = true;
+    if (conn == m_active) {
+        m_connected = true;
+        if (!p_miner->isMining()) {
+            LogS("Starting miner\n");
+            p_miner->start();
+        }
+    }
+    conn->subscribeSent = GetTimeMillis();
+    send(conn, "{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\"" +
+               cred.host + "\",\"" +
+               cred.port + "\",\"" +
+               p_miner->userAgent() + "\", " +
+               (pool.session.empty() ? "null" : "\"" + pool.session + "\"") + "]}\n");
+    startRead(conn);
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::startRead(conn_ptr conn)
+{
+    boost::asio::async_read_until(conn->socket, conn->responseBuffer, "\n",
+        m_strand.wrap(boost::bind(&StratumClient::handleRead, this, conn,
+                                  boost::asio::placeholders::error,
+                                  boost::asio::placeholders::bytes_transferred)));
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::handleRead(
+        conn_ptr conn, const boost::system::error_code& ec, std::size_t bytes)
+{
+    if (!isCurrent(conn)) return;
+    if (ec) {
+        connectionFailed(conn, ec.message());
+        return;
+    }
+
+    std::istream is(&conn->responseBuffer);
+    std::string response;
+    getline(is, response);
+    trace(conn, '<', response);
+
+    try {
+        if (!response.empty() && response.front() == '{' && response.back() == '}') {
+            Value valResponse;
+            if (read_string(response, valResponse) && valResponse.type() == obj_type) {
+                const Object& responseObject = valResponse.get_obj();
+                if (!responseObject.empty()) {
+                    processReponse(conn, responseObject);
+                    m_response = response;
+                } else {
+                    LogS("[WARN] Response was empty\n");
+                }
             } else {
-                p_active = &m_primary;
+                LogS("[WARN] Parse response failed\n");
             }
-            m_retries = 0;
+        } else {
+            LogS("[WARN] Discarding incomplete response\n");
         }
+    } catch (std::exception const& _e) {
+        connectionFailed(conn, _e.what());
+        return;
     }
 
-    LogS("Reconnecting in 3 seconds...\n");
-    boost::asio::deadline_timer timer(m_io_service, boost::posix_time::seconds(3));
-    timer.wait();
+    // processReponse() may have dropped the connection
+    if (isCurrent(conn)) {
+        startRead(conn);
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::send(conn_ptr conn, const string& request)
+{
+    if (!conn->connected) {
+        LogS("[WARN] Not connected, dropping request\n");
+        return;
+    }
+    trace(conn, '>', request.substr(0, request.find_last_not_of('\n') + 1));
+    bool idle = conn->requests.empty();
+    conn->requests.push_back(request);
+    if (idle) {
+        startWrite(conn);
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::trace(
+        conn_ptr conn, char direction, const string& message)
+{
+    if (!p_trace || conn != m_active) return;
+    *p_trace << strprintf("%d %c %s\n", GetTimeMillis() - m_traceStart, direction, message);
+    p_trace->flush();
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::startWrite(conn_ptr conn)
+{
+    boost::asio::async_write(conn->socket, boost::asio::buffer(conn->requests.front()),
+        m_strand.wrap(boost::bind(&StratumClient::handleWrite, this, conn,
+                                  boost::asio::placeholders::error,
+                                  boost::asio::placeholders::bytes_transferred)));
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::handleWrite(
+        conn_ptr conn, const boost::system::error_code& ec, std::size_t bytes)
+{
+    if (!isCurrent(conn)) return;
+    if (ec) {
+        connectionFailed(conn, ec.message());
+        return;
+    }
+
+    conn->requests.pop_front();
+    if (!conn->requests.empty()) {
+        startWrite(conn);
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::reconnect()
+{
+    m_strand.dispatch([this]() {
+        if (m_active) {
+            LogS("Reconnecting\n");
+            dropConnection(m_active);
+        }
+    });
 }
 
 template <typename Miner, typename Job, typename Solution>
 void StratumClient<Miner, Job, Solution>::disconnect()
 {
-    if (!m_connected) return;
+    if (!m_running.exchange(false)) return;
     LogS("Disconnecting\n");
+    std::unique_ptr<boost::thread_group> checkers;
+    {
+        boost::lock_guard<boost::mutex> lock(x_checks);
+        checkers.swap(p_checkers);
+        m_checks.clear();
+    }
+    // Interrupted waits retake x_checks, so join without holding it
+    if (checkers) {
+        checkers->interrupt_all();
+        checkers->join_all();
+    }
+    m_authorized = false;
     m_connected = false;
-    m_running = false;
     if (p_miner->isMining()) {
         LogS("Stopping miner\n");
         p_miner->stop();
     }
-    m_socket.close();
-    //m_io_service.stop();
-    if (m_work) {
+    // Cancel everything outstanding; run() then returns once the aborted
+    // handlers have drained.
+    m_strand.post([this]() {
+        boost::system::error_code ec;
+        m_healthtimer.cancel(ec);
+        m_reconnecttimer.cancel(ec);
+        m_standbytimer.cancel(ec);
+        for (conn_ptr conn : {m_active, m_standby}) {
+            if (conn) {
+                conn->resolver.cancel();
+                conn->socket.close(ec);
+            }
+        }
+        m_active.reset();
+        m_standby.reset();
+    });
+    p_idle.reset();
+    if (m_work && m_work->get_id() != std::this_thread::get_id()) {
         m_work->join();
         m_work.reset();
     }
 }
 
 template <typename Miner, typename Job, typename Solution>
-void StratumClient<Miner, Job, Solution>::processReponse(const Object& responseObject)
+void StratumClient<Miner, Job, Solution>::processReponse(
+        conn_ptr conn, const Object& responseObject)
 {
+    pool_t& pool = m_pools[conn->pool];
     const Value& valError = find_value(responseObject, "error");
     if (valError.type() == array_type) {
         const Array& error = valError.get_array();
@@ -208,58 +611,66 @@ void StratumClient<Miner, Job, Solution>::processReponse(const Object& responseO
         } else {
             msg = "Unknown error";
         }
-        LogS("%s\n", msg);
+        LogS("%s: %s\n", pool.cred.host, msg);
     }
-    std::ostream os(&m_requestBuffer);
     const Value& valId = find_value(responseObject, "id");
     int id = 0;
     if (valId.type() == int_type) {
         id = valId.get_int();
     }
+    if (conn->pending.count(id)) {
+        handleSubmitResponse(conn, id, responseObject);
+        return;
+    }
     Value valRes;
-    bool accepted = false;
     switch (id) {
     case 1:
         valRes = find_value(responseObject, "result");
         if (valRes.type() == array_type) {
-            LogS("Subscribed to stratum server\n");
-            const Array& result = valRes.get_array();
-            // Ignore session ID for now.
-            p_miner->setServerNonce(result);
-            os << "{\"id\": 2, \"method\": \"mining.authorize\", \"params\": [\""
-               << p_active->user << "\",\"" << p_active->pass << "\"]}\n";
-            write(m_socket, m_requestBuffer);
+            LogS("Subscribed to stratum server %s\n", pool.cred.host);
+            int64_t latency = GetTimeMillis() - conn->subscribeSent;
+            pool.latency = pool.latency ? 0.8 * pool.latency + 0.2 * latency : latency;
+            conn->subscription = valRes.get_array();
+            if (!conn->subscription.empty() && conn->subscription[0].type() == str_type) {
+                pool.session = conn->subscription[0].get_str();
+            }
+            if (conn == m_active) {
+                p_miner->setServerNonce(conn->subscription);
+            }
+            send(conn, "{\"id\": 2, \"method\": \"mining.authorize\", \"params\": [\"" +
+                       pool.cred.user + "\",\"" + pool.cred.pass + "\"]}\n");
         }
         break;
     case 2:
         valRes = find_value(responseObject, "result");
-        m_authorized = false;
+        conn->authorized = false;
         if (valRes.type() == bool_type) {
-            m_authorized = valRes.get_bool();
+            conn->authorized = valRes.get_bool();
         }
-        if (!m_authorized) {
-            LogS("Worker not authorized: %s\n", p_active->user);
-            disconnect();
+        if (!conn->authorized) {
+            LogS("Worker not authorized: %s\n", pool.cred.user);
+            if (m_pools.size() == 1) {
+                disconnect();
+            } else {
+                connectionFailed(conn, "Worker not authorized");
+            }
             return;
         }
-        LogS("Authorized worker %s\n", p_active->user);
+        LogS("Authorized worker %s on %s\n", pool.cred.user, pool.cred.host);
+        // Ask for mining.set_extranonce; pools that don't know it answer
+        // with an error, which is ignored below
+        send(conn, "{\"id\": 3, \"method\": \"mining.extranonce.subscribe\", \"params\": []}\n");
+        pool.failures = 0;
+        // Give the pool a full work timeout to send its first job
+        pool.lastNotify = GetTimeMillis();
+        if (conn == m_active) {
+            m_authorized = true;
+            connectStandby();
+        }
         break;
     case 3:
         // nothing to do...
         break;
-    case 4:
-        valRes = find_value(responseObject, "result");
-        if (valRes.type() == bool_type) {
-            accepted = valRes.get_bool();
-        }
-        if (accepted) {
-            LogS("B-) Submitted and accepted.\n");
-            p_miner->acceptedSolution(m_stale);
-        } else {
-            LogS("[WARN] :-( Not accepted.\n");
-            p_miner->rejectedSolution(m_stale);
-        }
-        break;
     default:
         const Value& valMethod = find_value(responseObject, "method");
         string method = "";
@@ -270,105 +681,320 @@ void StratumClient<Miner, Job, Solution>::processReponse(const Object& responseO
         if (method == "mining.notify") {
             const Value& valParams = find_value(responseObject, "params");
             if (valParams.type() == array_type) {
-                const Array& params = valParams.get_array();
-                Job* workOrder = p_miner->parseJob(params);
-
-                if (workOrder) {
-                    LogS("Received new job #%s\n", workOrder->jobId());
-                    workOrder->setTarget(m_nextJobTarget);
-
-                    if (!(p_current && *workOrder == *p_current)) {
-                        //x_current.lock();
-                        //if (p_worktimer)
-                        //    p_worktimer->cancel();
-
-                        if (p_previous) {
-                            delete p_previous;
-                        }
-                        p_previous = p_current;
-                        p_current = workOrder;
-
-                        p_miner->setJob(p_current);
-                        //x_current.unlock();
-                        //p_worktimer = new boost::asio::deadline_timer(m_io_service, boost::posix_time::seconds(m_worktimeout));
-                        //p_worktimer->async_wait(boost::bind(&StratumClient::work_timeout_handler, this, boost::asio::placeholders::error));
-                    }
+                pool.lastNotify = GetTimeMillis();
+                conn->jobParams = valParams.get_array();
+                if (conn == m_active) {
+                    newJob(conn, conn->jobParams);
                 }
             }
         } else if (method == "mining.set_target") {
             const Value& valParams = find_value(responseObject, "params");
             if (valParams.type() == array_type) {
                 const Array& params = valParams.get_array();
-                m_nextJobTarget = params[0].get_str();
-                LogS("Target set to %s\n", m_nextJobTarget);
+                conn->nextJobTarget = params[0].get_str();
+                LogS("Target set to %s\n", conn->nextJobTarget);
+            }
+        } else if (method == "mining.set_extranonce") {
+            const Value& valParams = find_value(responseObject, "params");
+            if (valParams.type() == array_type && conn->subscription.size() > 1) {
+                // Applies from the next job on
+                const Array& params = valParams.get_array();
+                conn->subscription[1] = params[0].get_str();
+                LogS("Extranonce set to %s\n", conn->subscription[1].get_str());
+                if (conn == m_active) {
+                    p_miner->setServerNonce(conn->subscription);
+                }
             }
         } else if (method == "client.reconnect") {
+            // params are [host, port, wait], all optional; without a host
+            // the client reconnects to the same server
             const Value& valParams = find_value(responseObject, "params");
+            Array params;
             if (valParams.type() == array_type) {
-                const Array& params = valParams.get_array();
-                m_primary.host = params[0].get_str();
-                m_primary.port = params[1].get_str();
-                // TODO: Handle wait time
-                LogS("Reconnection requested\n");
-                reconnect();
+                params = valParams.get_array();
             }
+            if (params.size() > 0 && params[0].type() == str_type && !params[0].get_str().empty()) {
+                pool.cred.host = params[0].get_str();
+            }
+            if (params.size() > 1 && params[1].type() == str_type && !params[1].get_str().empty()) {
+                pool.cred.port = params[1].get_str();
+            } else if (params.size() > 1 && params[1].type() == int_type) {
+                pool.cred.port = std::to_string(params[1].get_int());
+            }
+            int wait = 0;
+            if (params.size() > 2 && params[2].type() == int_type) {
+                wait = std::max(0, params[2].get_int());
+            }
+            LogS("Reconnection to %s:%s requested\n", pool.cred.host, pool.cred.port);
+            reconnectPool(conn, wait * 1000LL);
         }
         break;
     }
 }
 
 template <typename Miner, typename Job, typename Solution>
-void StratumClient<Miner, Job, Solution>::work_timeout_handler(
+void StratumClient<Miner, Job, Solution>::newJob(conn_ptr conn, const Array& params)
+{
+    std::shared_ptr<Job> workOrder(p_miner->parseJob(params));
+    if (!workOrder) return;
+
+    LogS("Received new job #%s\n", workOrder->jobId());
+    workOrder->setTarget(conn->nextJobTarget);
+    checkShareRate(conn, *workOrder);
+
+    std::shared_ptr<const JobSnapshot> jobs = std::atomic_load(&m_jobs);
+    if (jobs->current && *workOrder == *jobs->current) {
+        return;
+    }
+
+    std::shared_ptr<JobSnapshot> next = std::make_shared<JobSnapshot>();
+    next->current = workOrder;
+    next->currentReceived = GetTimeMillis();
+    next->previous = jobs->current;
+    next->previousReceived = jobs->currentReceived;
+    std::atomic_store(&m_jobs, std::shared_ptr<const JobSnapshot>(next));
+
+    p_miner->setJob(workOrder.get());
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::checkShareRate(conn_ptr conn, const Job& job)
+{
+    const pool_t& pool = m_pools[conn->pool];
+    double rate = p_miner->expectedShareRate(job.serverTarget);
+    if (rate > 0) {
+        bool pathological = rate < MIN_SHARE_RATE || rate > MAX_SHARE_RATE;
+        if (pathological && !conn->shareRateWarned) {
+            LogS("[WARN] The target of %s gives %.2f shares per minute at %.1f Sol/s, "
+                 "its difficulty is too %s\n", pool.cred.host, rate,
+                 p_miner->solutionRate(), rate > MAX_SHARE_RATE ? "low" : "high");
+        }
+        conn->shareRateWarned = pathological;
+    }
+
+    // When mining to a stricter target than the pool's, ask it to raise its
+    // difficulty to match (ZIP 301); the shares it credits then cover all
+    // the work done
+    arith_uint256 local = p_miner->localTarget(job.serverTarget);
+    if (local != job.serverTarget) {
+        string target = ArithToUint256(local).GetHex();
+        if (target != conn->suggestedTarget) {
+            conn->suggestedTarget = target;
+            send(conn, "{\"id\": " + std::to_string(m_nextId++) +
+                       ", \"method\": \"mining.suggest_target\", \"params\": [\"" +
+                       target + "\"]}\n");
+        }
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::handleSubmitResponse(
+        conn_ptr conn, int id, const Object& responseObject)
+{
+    auto it = conn->pending.find(id);
+    submission_t submission = it->second;
+    conn->pending.erase(it);
+    bool stale = submission.stale;
+    int64_t latency = GetTimeMillis() - submission.sent;
+
+    bool accepted = false;
+    const Value& valRes = find_value(responseObject, "result");
+    if (valRes.type() == bool_type) {
+        accepted = valRes.get_bool();
+    }
+
+    pool_t& pool = m_pools[conn->pool];
+    pool.latency = pool.latency ? 0.8 * pool.latency + 0.2 * latency : latency;
+    pool.rejectRate = 0.9 * pool.rejectRate + ((!accepted || stale) ? 0.1 : 0);
+
+    if (accepted) {
+        LogS("B-) Submitted and accepted (#%d, %d ms, job age %d ms%s).\n",
+             id, latency, submission.jobAge, stale ? ", stale" : "");
+        p_miner->acceptedSolution(stale, latency);
+    } else {
+        LogS("[WARN] :-( Not accepted (#%d, %d ms, job age %d ms%s).\n",
+             id, latency, submission.jobAge, stale ? ", stale" : "");
+        p_miner->rejectedSolution(stale, latency);
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::health_check_handler(
         const boost::system::error_code& ec)
 {
-    if (!ec) {
-        LogS("No new work received in %d seconds.\n", m_worktimeout);
-        reconnect();
+    if (ec || !m_running) return;
+
+    int64_t now = GetTimeMillis();
+    if (m_active && m_active->authorized) {
+        const pool_t& active = m_pools[m_active->pool];
+        if (m_worktimeout > 0 && now - active.lastNotify > m_worktimeout * 1000) {
+            LogS("No new work received in %d seconds.\n", m_worktimeout);
+            connectionFailed(m_active, "Work timeout");
+        } else if (m_standby && m_standby->authorized && !m_standby->jobParams.empty() &&
+                   now - m_lastSwitch > SWITCH_INTERVAL) {
+            const pool_t& standby = m_pools[m_standby->pool];
+            double activeScore = poolScore(m_active->pool, now);
+            double standbyScore = poolScore(m_standby->pool, now);
+            if (standby.lastNotify - active.lastNotify > NOTIFY_LAG) {
+                activeScore += NOTIFY_LAG_COST;
+            }
+            if (standbyScore + SWITCH_MARGIN < activeScore) {
+                LogS("Switching to pool %s:%s (score %.0f vs %.0f)\n",
+                     standby.cred.host, standby.cred.port, standbyScore, activeScore);
+                // Keep the old connection subscribed as the new standby
+                conn_ptr previous = m_active;
+                activate(m_standby);
+                m_standby = previous;
+                m_lastSwitch = now;
+            }
+        }
     }
+
+    // Replace the standby with a better pool once one becomes available,
+    // e.g. when a higher priority pool that failed is due for a retry
+    if (m_active && m_standby) {
+        int best = selectPool(m_active->pool);
+        if (best >= 0 && (size_t)best != m_standby->pool &&
+            poolScore(best, now) + SWITCH_MARGIN < poolScore(m_standby->pool, now)) {
+            conn_ptr standby = m_standby;
+            m_standby.reset();
+            dropConnection(standby);
+            connectStandby();
+        }
+    }
+
+    m_healthtimer.expires_from_now(boost::posix_time::seconds(HEALTH_CHECK_INTERVAL));
+    m_healthtimer.async_wait(m_strand.wrap(boost::bind(
+        &StratumClient::health_check_handler, this,
+        boost::asio::placeholders::error)));
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::setShareCheck(int nThreads, int nSample)
+{
+    boost::lock_guard<boost::mutex> lock(x_checks);
+    m_checkThreads = std::max(nThreads, 1);
+    m_checkSample = std::max(nSample, 0);
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::setTrace(const string& path)
+{
+    m_strand.post([this, path]() {
+        p_trace.reset(new std::ofstream(path, std::ios::app));
+        if (!*p_trace) {
+            LogPrintf("Could not open stratum trace file %s\n", path);
+            p_trace.reset();
+            return;
+        }
+        m_traceStart = GetTimeMillis();
+    });
 }
 
 template <typename Miner, typename Job, typename Solution>
 bool StratumClient<Miner, Job, Solution>::submit(const Solution* solution)
 {
-    x_current.lock();
-    Job* tempJob = p_current->clone();
-    Job* tempPreviousJob;
-    if (p_previous) {
-        tempPreviousJob = p_previous->clone();
+    std::shared_ptr<const JobSnapshot> jobs = std::atomic_load(&m_jobs);
+    if (!jobs->current) {
+        LogS("[WARN] Solution found without a job, ignoring\n");
+        return false;
     }
-    x_current.unlock();
 
-    LogS("Solution found; Submitting to %s...\n", p_active->host);
+    LogS("Solution found; Submitting...\n");
 
     LogS("  %s\n", solution->toString());
 
-
-    if (tempJob->evalSolution(solution)) {
-        string json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" +
-                      p_active->user + "\"," +
-                      tempJob->getSubmission(solution) + "]}\n";
-        std::ostream os(&m_requestBuffer);
-        os << json;
-        m_stale = false;
-        write(m_socket, m_requestBuffer);
-        return true;
-    } else if (tempPreviousJob && tempPreviousJob->evalSolution(solution)) {
-        string json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" +
-                      p_active->user + "\"," +
-                      tempPreviousJob->getSubmission(solution) + "]}\n";
-        std::ostream os(&m_requestBuffer);
-        os << json;
-        m_stale = true;
+    // The solution names its job, so it only needs checking against one
+    ShareCheck check {nullptr, false, 0, *solution};
+    if (solution->jobId() == jobs->current->jobId()) {
+        check.job = jobs->current;
+        check.jobAge = GetTimeMillis() - jobs->currentReceived;
+    } else if (jobs->previous && solution->jobId() == jobs->previous->jobId()) {
+        check.job = jobs->previous;
+        check.stale = true;
+        check.jobAge = GetTimeMillis() - jobs->previousReceived;
         LogS("[WARN] Submitting stale solution.\n");
-        write(m_socket, m_requestBuffer);
-        return true;
     } else {
-        m_stale = false;
+        LogS("[WARN] Solution for job #%s is too old, dropping\n", solution->jobId());
+        return false;
+    }
+
+    int nSample = m_checkSample;
+    if (nSample == 0 || m_shareCount++ % nSample != 0) {
+        queueSubmission(check.job->getSubmission(solution), check.stale, check.jobAge);
+        return true;
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(x_checks);
+        if (m_running && m_checks.size() < MAX_QUEUED_CHECKS) {
+            if (!p_checkers) {
+                p_checkers.reset(new boost::thread_group());
+                for (int i = 0; i < m_checkThreads; i++) {
+                    p_checkers->create_thread(boost::bind(&StratumClient::checkLoop, this));
+                }
+            }
+            m_checks.push_back(check);
+            m_checkCond.notify_one();
+            return true;
+        }
+    }
+    checkShare(check);
+    return true;
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::checkLoop()
+{
+    RenameThread("stratum-check");
+    try {
+        while (true) {
+            boost::unique_lock<boost::mutex> lock(x_checks);
+            while (m_checks.empty()) {
+                m_checkCond.wait(lock);
+            }
+            ShareCheck check(std::move(m_checks.front()));
+            m_checks.pop_front();
+            lock.unlock();
+
+            checkShare(check);
+            boost::this_thread::interruption_point();
+        }
+    } catch (const boost::thread_interrupted&) {
+    }
+}
+
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::checkShare(const ShareCheck& check)
+{
+    if (!check.job->evalSolution(&check.solution)) {
         LogS("[WARN] FAILURE: Miner gave incorrect result!\n");
         p_miner->failedSolution();
+        return;
     }
+    queueSubmission(check.job->getSubmission(&check.solution), check.stale, check.jobAge);
+}
 
-    return false;
+template <typename Miner, typename Job, typename Solution>
+void StratumClient<Miner, Job, Solution>::queueSubmission(
+        const string& submission, bool stale, int64_t jobAge)
+{
+    // Queue the request on the network thread; never block the caller. The
+    // id is assigned there so that ids increase in the order sent.
+    m_strand.post([this, submission, stale, jobAge]() {
+        if (!m_active || !m_active->authorized) {
+            LogS("[WARN] Not connected, dropping solution\n");
+            return;
+        }
+        int id = m_nextId++;
+        submission_t& pending = m_active->pending[id];
+        pending.stale = stale;
+        pending.sent = GetTimeMillis();
+        pending.jobAge = jobAge;
+        send(m_active, "{\"id\": " + std::to_string(id) +
+                       ", \"method\": \"mining.submit\", \"params\": [\"" +
+                       m_pools[m_active->pool].cred.user + "\"," + submission + "]}\n");
+    });
 }
 
 template class StratumClient<ZcashMiner, ZcashJob, EquihashSolution>;
@@ -3,14 +3,25 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#ifndef ZCASH_LIBSTRATUM_STRATUMCLIENT_H
+#define ZCASH_LIBSTRATUM_STRATUMCLIENT_H
+
 #include "clientversion.h"
 #include "libstratum/ZcashStratum.h"
 
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <thread>
+#include <vector>
 
 #include "json/json_spirit_value.h"
 
@@ -27,6 +38,46 @@ typedef struct {
         string pass;
 } cred_t;
 
+typedef struct {
+        bool stale;
+        int64_t sent;
+        int64_t jobAge;      // Time from the job's notify to the submission, ms
+} submission_t;
+
+typedef struct {
+        cred_t cred;
+        // Session id from the last subscribe, to resume it on reconnect
+        string session;
+        // Health as measured by the client; see poolScore()
+        double latency;      // Moving average of request round-trips, ms
+        double rejectRate;   // Moving average of rejected and stale shares
+        int64_t lastNotify;  // Time of the last mining.notify, ms
+        int failures;        // Consecutive failed connections
+        int64_t retryAt;     // Earliest time for the next connection, ms
+} pool_t;
+
+typedef struct {
+        string host;
+        string port;
+        string user;
+        bool active;
+        bool standby;
+        bool authorized;
+        double latency;
+        double rejectRate;
+        int64_t lastNotify;
+        int failures;
+        double score;        // See poolScore(); lower is better
+} pool_status_t;
+
+/**
+ * Stratum client for a prioritised list of pools.
+ *
+ * The miner works for the active connection. Once it is authorized, a
+ * standby connection is opened to the next best pool and kept subscribed,
+ * so that it can take over without a reconnect when the active pool fails
+ * or falls behind.
+ */
 template <typename Miner, typename Job, typename Solution>
 class StratumClient
 {
@@ -35,60 +86,171 @@ public:
                   string const & host, string const & port,
                   string const & user, string const & pass,
                   int const & retries, int const & worktimeout);
-    ~StratumClient() { }
+    ~StratumClient();
 
+    /** Adds a pool with a lower priority than those already added. */
+    void addPool(string const & host, string const & port,
+                 string const & user, string const & pass);
     void setFailover(string const & host, string const & port);
     void setFailover(string const & host, string const & port,
                      string const & user, string const & pass);
 
     bool isRunning() { return m_running; }
     bool isConnected() { return m_connected && m_authorized; }
-    bool current() { return p_current; }
+    bool current() { return (bool)std::atomic_load(&m_jobs)->current; }
     bool submit(const Solution* solution);
+    /** Every pool in priority order; empty once the client has stopped */
+    std::vector<pool_status_t> poolStatus();
+    /**
+     * Check one in nSample shares against their job before submitting them
+     * (0 = never), using up to nThreads verifier threads.
+     */
+    void setShareCheck(int nThreads, int nSample);
+    /**
+     * Append every message exchanged with the active pool to path, one per
+     * line as "<milliseconds> <direction> <message>", where direction is '>'
+     * for sent and '<' for received. MockStratumPool::replay() reads these.
+     */
+    void setTrace(const string& path);
     void reconnect();
     void disconnect();
 
 private:
+    struct Connection
+    {
+        Connection(boost::asio::io_service& io, size_t i)
+            : pool(i), resolver(io), socket(io) { }
+
+        size_t pool;
+        tcp::resolver resolver;
+        tcp::socket socket;
+        boost::asio::streambuf responseBuffer;
+        // Requests waiting to be written; the front one is being written
+        std::deque<string> requests;
+        // Submissions awaiting a response, keyed by request id
+        std::map<int, submission_t> pending;
+        bool connected = false;
+        bool authorized = false;
+        int64_t subscribeSent = 0;
+        // mining.subscribe result and latest mining.notify params, applied
+        // to the miner when this connection becomes active
+        Array subscription;
+        Array jobParams;
+        string nextJobTarget;
+        // Latest mining.suggest_target sent, and whether the current target
+        // has been reported as giving a pathological share rate
+        string suggestedTarget;
+        bool shareRateWarned = false;
+    };
+    typedef std::shared_ptr<Connection> conn_ptr;
+
+    /**
+     * Jobs a solution can be submitted for. Snapshots are never modified
+     * once published, so submit() reads them without locking or copying.
+     */
+    struct JobSnapshot
+    {
+        std::shared_ptr<const Job> current;
+        std::shared_ptr<const Job> previous;
+        // Time each job was received, ms
+        int64_t currentReceived = 0;
+        int64_t previousReceived = 0;
+    };
+
     void startWorking();
     void workLoop();
-    void connect();
 
-    void work_timeout_handler(const boost::system::error_code& ec);
+    int selectPool(int exclude);
+    double poolScore(size_t i, int64_t now);
+    void connectActive();
+    void connectStandby();
+    conn_ptr open(size_t i);
+    void activate(conn_ptr conn);
+    void failover();
+    void dropConnection(conn_ptr conn);
+    /** Reopens conn's pool after delay ms, keeping it active if it was */
+    void reconnectPool(conn_ptr conn, int64_t delay);
+    void connectionFailed(conn_ptr conn, const string& reason);
+    bool isCurrent(const conn_ptr& conn) { return conn == m_active || conn == m_standby; }
+
+    void handleResolve(conn_ptr conn, const boost::system::error_code& ec,
+                       tcp::resolver::iterator endpoint_iterator);
+    void handleConnect(conn_ptr conn, const boost::system::error_code& ec);
+    void startRead(conn_ptr conn);
+    void handleRead(conn_ptr conn, const boost::system::error_code& ec, std::size_t bytes);
+    void send(conn_ptr conn, const string& request);
+    void trace(conn_ptr conn, char direction, const string& message);
+    void startWrite(conn_ptr conn);
+    void handleWrite(conn_ptr conn, const boost::system::error_code& ec, std::size_t bytes);
+
+    void health_check_handler(const boost::system::error_code& ec);
+
+    struct ShareCheck
+    {
+        std::shared_ptr<const Job> job;
+        bool stale;
+        int64_t jobAge;
+        Solution solution;
+    };
 
-    void processReponse(const Object& responseObject);
+    void checkLoop();
+    void checkShare(const ShareCheck& check);
+    void queueSubmission(const string& submission, bool stale, int64_t jobAge);
 
-    cred_t * p_active;
-    cred_t m_primary;
-    cred_t m_failover;
+    void processReponse(conn_ptr conn, const Object& responseObject);
+    void handleSubmitResponse(conn_ptr conn, int id, const Object& responseObject);
+    void newJob(conn_ptr conn, const Array& params);
+    void checkShareRate(conn_ptr conn, const Job& job);
 
-    bool m_authorized;
-    bool m_connected;
-    bool m_running = true;
+    // Only touched on m_strand
+    std::vector<pool_t> m_pools;
+    conn_ptr m_active;
+    conn_ptr m_standby;
+    int64_t m_lastSwitch = 0;
+    bool m_exitOnFailure = false;
+    // Ids 1-3 are reserved for subscribe/authorize
+    int m_nextId = 4;
+
+    std::atomic<bool> m_authorized;
+    std::atomic<bool> m_connected;
+    std::atomic<bool> m_running {true};
 
-    int    m_retries = 0;
     int    m_maxRetries;
     int m_worktimeout = 60;
 
     string m_response;
 
     Miner * p_miner;
-    boost::mutex x_current;
-    Job * p_current;
-    Job * p_previous;
-
-    bool m_stale = false;
+    // Replaced with std::atomic_store on m_strand, read with std::atomic_load
+    std::shared_ptr<const JobSnapshot> m_jobs;
 
     std::unique_ptr<std::thread> m_work;
 
-    boost::asio::io_service m_io_service;
-    tcp::socket m_socket;
+    // Only touched on m_strand
+    std::unique_ptr<std::ofstream> p_trace;
+    int64_t m_traceStart = 0;
 
-    boost::asio::streambuf m_requestBuffer;
-    boost::asio::streambuf m_responseBuffer;
+    // Shares waiting for their self-check; bounded, miners check shares
+    // themselves when it is full
+    boost::mutex x_checks;
+    boost::condition_variable m_checkCond;
+    std::deque<ShareCheck> m_checks;
+    std::unique_ptr<boost::thread_group> p_checkers;
+    int m_checkThreads = 1;
+    std::atomic<int> m_checkSample {1};
+    std::atomic<uint64_t> m_shareCount {0};
 
-    boost::asio::deadline_timer * p_worktimer;
+    boost::asio::io_service m_io_service;
+    // Serialises every handler that touches the connections and pools
+    boost::asio::io_service::strand m_strand;
+    // Keeps m_io_service.run() going while there is no pending operation
+    std::unique_ptr<boost::asio::io_service::work> p_idle;
 
-    string m_nextJobTarget;
+    boost::asio::deadline_timer m_healthtimer;
+    boost::asio::deadline_timer m_reconnecttimer;
+    boost::asio::deadline_timer m_standbytimer;
 };
 
 typedef StratumClient<ZcashMiner, ZcashJob, EquihashSolution> ZcashStratumClient;
+
+#endif // ZCASH_LIBSTRATUM_STRATUMCLIENT_H
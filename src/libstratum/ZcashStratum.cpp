@@ -9,104 +9,105 @@
 #include "clientversion.h"
 #include "crypto/equihash.h"
 #include "streams.h"
+#include "support/allocators/aligned.h"
 #include "version.h"
 
+#include "libzogminer/cpusolver.h"
 #include "libzogminer/gpusolver.h"
 
 #include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+// Nonces a miner thread takes from the shared allocator at a time: about
+// LEASE_TIME ms of work at its own solve rate, so GPUs and CPU threads
+// mining the same job draw from it in proportion to their throughput
+static const uint64_t MIN_NONCE_LEASE = 1;
+static const uint64_t MAX_NONCE_LEASE = 64;
+static const int64_t LEASE_TIME = 2000;
+// Solutions and time the Sol/s estimate needs before it is used
+static const uint64_t MIN_RATE_SOLUTIONS = 20;
+static const int64_t MIN_RATE_TIME = 10000;
+// Longest sleep between checks for stop and new work while idling
+static const int64_t IDLE_SLICE = 50;
+
+
+static uint64_t LeaseSize(double runsPerSecond)
+{
+    double size = std::ceil(runsPerSecond * LEASE_TIME / 1000);
+    return std::max(MIN_NONCE_LEASE, std::min(MAX_NONCE_LEASE, (uint64_t)size));
+}
 
+/**
+ * Idles for the rest of the duty cycle after a run that took busy ms, so
+ * that runs take intensity percent of the time. Ends early on new work,
+ * and MilliSleep() is an interruption point for stop().
+ */
+static void IdleForIntensity(const ZcashMiner* miner, uint64_t generation, int64_t busy)
+{
+    int intensity = miner->intensity();
+    if (intensity >= 100) {
+        return;
+    }
+    int64_t end = GetTimeMillis() + busy * (100 - intensity) / intensity;
+    for (int64_t now = GetTimeMillis(); now < end && !miner->hasNewWork(generation); now = GetTimeMillis()) {
+        MilliSleep(std::min(end - now, IDLE_SLICE));
+    }
+}
 
-void static ZcashMinerThread(ZcashMiner* miner, int size, int pos, GPUConfig conf)
+/**
+ * Mines on the GPU in conf, or on the CPU if conf.useGPU is false, with
+ * size the number of CPU threads sharing conf.memoryBudget. CPU threads
+ * mining next to GPUs run at the lowest priority, so the GPU threads get
+ * a core whenever they have host-side work.
+ */
+void static ZcashMinerThread(ZcashMiner* miner, int size, int pos, GPUConfig conf, bool background)
 {
     LogPrintf("ZcashMinerThread started\n");
     RenameThread("zcash-miner");
+    if (background) {
+        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    }
 
     unsigned int n = Params().EquihashN();
     unsigned int k = Params().EquihashK();
 
-    std::shared_ptr<std::mutex> m_zmt(new std::mutex);
     CBlockHeader header;
-    arith_uint256 space;
-    size_t offset;
-    arith_uint256 inc;
-    arith_uint256 target;
-    std::atomic_bool workReady {false};
-    std::atomic_bool cancelSolver {false};
+    uint64_t generation = 0;
 
     GPUSolver * solver;
+	std::unique_ptr<EquihashSolver> cpuSolver;
 	if(conf.useGPU)
-    	solver = new GPUSolver(conf.platformId, conf.selGPU);
+    	solver = new GPUSolver(conf.platformId, conf.selGPU, conf.rowsLog);
+	else
+		cpuSolver.reset(new EquihashSolver(n, k, conf.memoryBudget / size));
 
 	//TODO Free
 	uint8_t * tmp_header = (uint8_t *) calloc(ZCASH_BLOCK_HEADER_LEN, sizeof(uint8_t));
 	uint64_t nn= 0;
-
-    miner->NewJob.connect(NewJob_t::slot_type(
-        [&m_zmt, &header, &space, &offset, &inc, &target, &workReady, &cancelSolver]
-        (const ZcashJob* job) mutable {
-            std::lock_guard<std::mutex> lock{*m_zmt.get()};
-            if (job) {
-                header = job->header;
-                space = job->nonce2Space;
-                offset = job->nonce1Size * 4; // Hex length to bit length
-                inc = job->nonce2Inc;
-                target = job->serverTarget;
-                workReady.store(true);
-                if (job->clean) {
-                    cancelSolver.store(true);
-                }
-            } else {
-                workReady.store(false);
-                cancelSolver.store(true);
-            }
-        }
-    ).track_foreign(m_zmt)); // So the signal disconnects when the mining thread exits
+	// Completed solver runs per second, smoothed
+	double runRate = 0;
 
     try {
         while (true) {
             // Wait for work
-            bool expected;
-            do {
-                expected = true;
-                boost::this_thread::interruption_point();
-                MilliSleep(1000);
-            } while (!workReady.compare_exchange_weak(expected, false));
-            // TODO change atomically with workReady
-            cancelSolver.store(false);
-
-            // Calculate nonce limits
-            arith_uint256 nonce;
-            arith_uint256 nonceEnd;
-            {
-                std::lock_guard<std::mutex> lock{*m_zmt.get()};
-                arith_uint256 baseNonce = UintToArith256(header.nNonce);
-                nonce = baseNonce + ((space/size)*pos << offset);
-                nonceEnd = baseNonce + ((space/size)*(pos+1) << offset);
-            }
-
-            // Hash state
-            crypto_generichash_blake2b_state state;
-            EhInitialiseState(n, k, state);
-
-            // I = the block header minus nonce and solution.
-            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-            {
-                std::lock_guard<std::mutex> lock{*m_zmt.get()};
-                CEquihashInput I{header};
-                ss << I;
-            }
-		
-			memcpy(tmp_header, &ss[0], ss.size());
+            ZcashWorkPtr work = miner->waitForWork(generation);
+            header = work->header;
 
-            // H(I||...
-            crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
+			memcpy(tmp_header, work->input.data(), work->input.size());
+			if(!conf.useGPU)
+				cpuSolver->setMidstate(work->midstate);
 
             // Start working
+            uint64_t counter = 0;
+            uint64_t leaseEnd = 0;
             while (true) {
-                // H(I||V||...
-                crypto_generichash_blake2b_state curr_state;
-                curr_state = state;
-                auto bNonce = ArithToUint256(nonce);
+                if (counter == leaseEnd && !work->lease(LeaseSize(runRate), counter, leaseEnd)) {
+                    LogPrint("pow", "Nonce space of job %s exhausted\n", work->job);
+                    break;
+                }
+                auto bNonce = work->nonceAt(counter++);
 
 				for (size_t i = 0; i < ZCASH_NONCE_LEN; ++i)
 					tmp_header[108 + i] = bNonce.begin()[i];
@@ -116,69 +117,93 @@ void static ZcashMinerThread(ZcashMiner* miner, int size, int pos, GPUConfig con
                          bNonce.ToString());
 
                 std::function<bool(std::vector<unsigned char>)> validBlock =
-                        [&m_zmt, &header, &bNonce, &target, &miner]
+                        [&header, &bNonce, &work, &miner, pos]
                         (std::vector<unsigned char> soln) {
-                    std::lock_guard<std::mutex> lock{*m_zmt.get()};
+                    miner->foundSolution(pos);
+
                     // Write the solution to the hash and compute the result.
                     LogPrint("pow", "- Checking solution against target...");
                     header.nNonce = bNonce;
                     header.nSolution = soln;
 
-                    if (UintToArith256(header.GetHash()) > target) {
+                    arith_uint256 hash = UintToArith256(header.GetHash());
+                    if (hash > work->target) {
                         LogPrint("pow", " too large.\n");
                         return false;
                     }
+                    if (hash > work->shareTarget) {
+                        LogPrint("pow", " above the local target, withheld.\n");
+                        miner->withheldSolution();
+                        return false;
+                    }
 
                     // Found a solution
                     LogPrintf("Found solution satisfying the server target\n");
-                    EquihashSolution solution {bNonce, soln};
+                    EquihashSolution solution {bNonce, soln, work->job};
                     miner->submitSolution(solution);
 
                     // We're a pooled miner, so try all solutions
                     return false;
                 };
+                // A sample of runs has its candidates checked for losses
+                std::shared_ptr<SolutionAuditor> auditor = miner->solutionAudit();
+                bool audited = auditor && auditor->sample();
+                std::vector<std::vector<unsigned char>> candidates;
+                std::function<bool(std::vector<unsigned char>)> solverCallback = validBlock;
+                if (audited) {
+                    solverCallback = [&candidates, &validBlock](std::vector<unsigned char> soln) {
+                        candidates.push_back(soln);
+                        return validBlock(soln);
+                    };
+                }
                 std::function<bool(GPUSolverCancelCheck)> cancelledGPU =
-                        [&cancelSolver](GPUSolverCancelCheck pos) {
+                        [miner, generation](GPUSolverCancelCheck pos) {
                     boost::this_thread::interruption_point();
-                    return cancelSolver.load();
+                    return miner->isWorkCancelled(generation);
                 };
 				std::function<bool(EhSolverCancelCheck)> cancelled =
-                        [&cancelSolver](EhSolverCancelCheck pos) {
+                        [miner, generation](EhSolverCancelCheck pos) {
                     boost::this_thread::interruption_point();
-                    return cancelSolver.load();
+                    return miner->isWorkCancelled(generation);
                 };
+                int64_t nRunStart = GetTimeMillis();
                 try {
-                    // If we find a valid block, we get more work
+                    bool found;
 					if(!conf.useGPU) {
-                		if (EhOptimisedSolve(n, k, curr_state, validBlock, cancelled)) {
-		                    break;
-		                }
+                		found = cpuSolver->solve(bNonce, solverCallback, cancelled);
 					} else {
-						if (solver->run(n, k, tmp_header, ZCASH_BLOCK_HEADER_LEN, *((uint64_t *)(bNonce.begin()+sizeof(uint64_t)+4)), validBlock, cancelledGPU, curr_state)) {
-		                    break;
-		                }
+						found = solver->run(n, k, tmp_header, ZCASH_BLOCK_HEADER_LEN, *((uint64_t *)(bNonce.begin()+sizeof(uint64_t)+4)), solverCallback, cancelledGPU, work->midstate);
 					}
-                    
+                    // If we find a valid block, we get more work
+                    if (found) {
+                        break;
+                    }
+                    if (audited) {
+                        eh_HashState state = work->midstate;
+                        crypto_generichash_blake2b_update(&state, bNonce.begin(), bNonce.size());
+                        auditor->audit(conf.useGPU ? solver->geometry() : "cpu", state, candidates);
+                    }
+                } catch (EhSolverCancelledException&) {
+                    LogPrint("pow", "Equihash solver cancelled\n");
+                    break;
                 } catch (GPUSolverCancelledException&) {
                     LogPrint("pow", "Equihash solver cancelled\n");
-                    cancelSolver.store(false);
                     break;
                 }
 
+                // Leases are sized by the rate of runs including idle time
+                IdleForIntensity(miner, generation, GetTimeMillis() - nRunStart);
+                double runs = 1000.0 / std::max<int64_t>(1, GetTimeMillis() - nRunStart);
+                runRate = runRate ? 0.8 * runRate + 0.2 * runs : runs;
+
                 // Check for stop
                 boost::this_thread::interruption_point();
-                if (nonce == nonceEnd) {
-                    break;
-                }
 
                 // Check for new work
-                if (workReady.load()) {
+                if (miner->hasNewWork(generation)) {
                     LogPrint("pow", "New work received, dropping current work\n");
                     break;
                 }
-
-                // Update nonce
-                nonce += inc;
             }
         }
 
@@ -209,18 +234,59 @@ void static ZcashMinerThread(ZcashMiner* miner, int size, int pos, GPUConfig con
 
 }
 
-ZcashJob* ZcashJob::clone() const
+ZcashWork::ZcashWork(const ZcashJob& job, uint64_t generation, const ZcashWork* previous,
+                     const arith_uint256& shareTarget)
+    : job {job.job},
+      header {job.header},
+      target {job.serverTarget},
+      shareTarget {shareTarget},
+      clean {job.clean},
+      generation {generation},
+      nonce1Bits {job.nonce1Size * 4} // Hex length to bit length
 {
-    ZcashJob* ret = new ZcashJob();
-    ret->job = job;
-    ret->header = header;
-    ret->time = time;
-    ret->nonce1Size = nonce1Size;
-    ret->nonce2Space = nonce2Space;
-    ret->nonce2Inc = nonce2Inc;
-    ret->serverTarget = serverTarget;
-    ret->clean = clean;
-    return ret;
+    // I = the block header minus nonce and solution.
+    CEquihashInput I{header};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    input.assign(ss.begin(), ss.end());
+
+    // H(I||...
+    EhInitialiseState(Params().EquihashN(), Params().EquihashK(), midstate);
+    crypto_generichash_blake2b_update(&midstate, input.data(), input.size());
+
+    size_t nonce2Bits = 256 - nonce1Bits;
+    nonceCount = nonce2Bits >= 64 ? std::numeric_limits<uint64_t>::max()
+                                  : (uint64_t)1 << nonce2Bits;
+    if (previous && previous->input == input && previous->header.nNonce == header.nNonce) {
+        nextNonce = previous->nextNonce;
+    } else {
+        nextNonce = std::make_shared<std::atomic<uint64_t>>(0);
+    }
+}
+
+bool ZcashWork::lease(uint64_t count, uint64_t& begin, uint64_t& end) const
+{
+    uint64_t first = nextNonce->fetch_add(count);
+    if (first >= nonceCount) {
+        return false;
+    }
+    begin = first;
+    end = nonceCount - first < count ? nonceCount : first + count;
+    return true;
+}
+
+uint256 ZcashWork::nonceAt(uint64_t counter) const
+{
+    if (nonce1Bits % 8 == 0) {
+        // The server nonce fills whole bytes and the rest is zero, so the
+        // counter can be written straight into the little-endian nonce
+        uint256 nonce = header.nNonce;
+        for (size_t i = 0, pos = nonce1Bits / 8; i < 8 && pos < nonce.size(); i++, pos++) {
+            nonce.begin()[pos] = (counter >> (8 * i)) & 0xff;
+        }
+        return nonce;
+    }
+    return ArithToUint256(UintToArith256(header.nNonce) + (arith_uint256(counter) << nonce1Bits));
 }
 
 void ZcashJob::setTarget(std::string target)
@@ -233,7 +299,7 @@ void ZcashJob::setTarget(std::string target)
     }
 }
 
-bool ZcashJob::evalSolution(const EquihashSolution* solution)
+bool ZcashJob::evalSolution(const EquihashSolution* solution) const
 {
     unsigned int n = Params().EquihashN();
     unsigned int k = Params().EquihashK();
@@ -257,7 +323,7 @@ bool ZcashJob::evalSolution(const EquihashSolution* solution)
     return isValid;
 }
 
-std::string ZcashJob::getSubmission(const EquihashSolution* solution)
+std::string ZcashJob::getSubmission(const EquihashSolution* solution) const
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << solution->nonce;
@@ -274,12 +340,45 @@ std::string ZcashJob::getSubmission(const EquihashSolution* solution)
 }
 
 ZcashMiner::ZcashMiner(int threads, GPUConfig _conf)
-    : nThreads{threads}, minerThreads{nullptr}, conf(_conf)
+    : nThreads{threadCount(threads, _conf)}, nCPUWorkers{cpuWorkerCount(nThreads, _conf)},
+      minerThreads{nullptr}, conf(_conf)
+{
+    nGPUWorkers = conf.useGPU ? nThreads : 0;
+    std::atomic_store(&deviceSolutions, newDeviceCounters(nThreads + nCPUWorkers));
+}
+
+int ZcashMiner::threadCount(int threads, const GPUConfig& conf)
+{
+    if (threads < 0) {
+        threads = boost::thread::hardware_concurrency();
+        if (!conf.useGPU && conf.memoryBudget > 0) {
+            // Run no more threads than can keep their tables in RAM
+            size_t solverBytes = EhOptimisedSolveMemoryBytes(Params().EquihashN(), Params().EquihashK());
+            threads = std::max(1, std::min(threads, (int)(conf.memoryBudget / solverBytes)));
+            LogPrintf("Using %d miner threads to fit the memory budget of %d MiB\n",
+                      threads, conf.memoryBudget >> 20);
+        }
+    }
+    return threads;
+}
+
+int ZcashMiner::cpuWorkerCount(int gpuThreads, const GPUConfig& conf)
 {
-    if (nThreads < 0) {
-        nThreads = boost::thread::hardware_concurrency();
+    if (!conf.useGPU) {
+        return 0;
     }
+    int threads = conf.cpuThreads;
+    if (threads < 0) {
+        // Leave a core to each GPU thread for its host-side work
+        threads = std::max(0, (int)boost::thread::hardware_concurrency() - gpuThreads);
+    }
+    return threads;
+}
 
+std::shared_ptr<ZcashMiner::DeviceCountersVec> ZcashMiner::newDeviceCounters(int threads)
+{
+    // Value-initialised, so every counter starts at zero
+    return std::make_shared<DeviceCountersVec>(threads);
 }
 
 std::string ZcashMiner::userAgent()
@@ -288,27 +387,125 @@ std::string ZcashMiner::userAgent()
 }
 
 void ZcashMiner::start()
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    startThreads();
+}
+
+void ZcashMiner::stop()
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    stopThreads();
+}
+
+bool ZcashMiner::isMining() const
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    return minerThreads;
+}
+
+void ZcashMiner::startThreads()
 {
     if (minerThreads) {
-        stop();
+        stopThreads();
     }
 
-    if (nThreads == 0) {
+    if (nThreads + nCPUWorkers == 0) {
         return;
     }
 
+    std::atomic_store(&deviceSolutions, newDeviceCounters(nThreads + nCPUWorkers));
+    nMiningStart = GetTimeMillis();
+    {
+        boost::lock_guard<boost::mutex> lock(intensityMutex);
+        nIntensityStart = nMiningStart;
+        nIntensitySolutions = 0;
+    }
+
+    // The GPU threads all run a solver on the selected device, so settle on
+    // a table size that fits one for each of them before starting any
+    GPUConfig threadConf = conf;
+    int threads = nThreads;
+    if (conf.useGPU && nThreads > 0) {
+        threadConf.rowsLog = cl_zogminer::preflight(conf.platformId, conf.selGPU, conf.rowsLog, nThreads);
+        if (!threadConf.rowsLog) {
+            LogPrintf("%d GPU solvers do not fit on OpenCL device %d of platform %d, skipping it\n",
+                      nThreads, conf.selGPU, conf.platformId);
+            threads = 0;
+        }
+    }
+
     minerThreads = new boost::thread_group();
-    for (int i = 0; i < nThreads; i++) {
-        minerThreads->create_thread(boost::bind(&ZcashMinerThread, this, nThreads, i, conf));
+    for (int i = 0; i < threads; i++) {
+        minerThreads->create_thread(boost::bind(&ZcashMinerThread, this, nThreads, i, threadConf, false));
+    }
+    // CPU workers next to the GPUs come after them in the device counters
+    GPUConfig cpuConf = conf;
+    cpuConf.useGPU = false;
+    for (int i = 0; i < nCPUWorkers; i++) {
+        minerThreads->create_thread(boost::bind(&ZcashMinerThread, this, nCPUWorkers, nThreads + i, cpuConf, true));
     }
 }
 
-void ZcashMiner::stop()
+void ZcashMiner::stopThreads()
 {
     if (minerThreads) {
         minerThreads->interrupt_all();
+        // The threads must be gone before their counters or config change
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = nullptr;
+
+        boost::lock_guard<boost::mutex> lock(intensityMutex);
+        closeIntensityPeriod(GetTimeMillis());
+        nIntensityStart = 0;
+    }
+}
+
+void ZcashMiner::setDevices(int threads, const GPUConfig& _conf)
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    bool mining = minerThreads;
+    stopThreads();
+    nThreads = threadCount(threads, _conf);
+    nCPUWorkers = cpuWorkerCount(nThreads, _conf);
+    conf = _conf;
+    nGPUWorkers = conf.useGPU ? nThreads : 0;
+    if (nCPUWorkers > 0) {
+        LogPrintf("Mining with %d GPU threads and %d CPU threads\n", nThreads, nCPUWorkers);
+    } else {
+        LogPrintf("Mining with %d %s threads\n", nThreads, conf.useGPU ? "GPU" : "CPU");
+    }
+    std::atomic_store(&deviceSolutions, newDeviceCounters(nThreads + nCPUWorkers));
+    nMiningStart = 0;
+    if (mining) {
+        startThreads();
+    }
+}
+
+int ZcashMiner::threads() const
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    return nThreads;
+}
+
+int ZcashMiner::cpuWorkers() const
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    return nCPUWorkers;
+}
+
+GPUConfig ZcashMiner::config() const
+{
+    boost::lock_guard<boost::mutex> lock(threadsMutex);
+    return conf;
+}
+
+void ZcashMiner::foundSolution(int device)
+{
+    std::shared_ptr<DeviceCountersVec> counters = std::atomic_load(&deviceSolutions);
+    if (device < (int)counters->size()) {
+        (*counters)[device]++;
     }
 }
 
@@ -386,9 +583,48 @@ ZcashJob* ZcashMiner::parseJob(const Array& params)
     return ret;
 }
 
-void ZcashMiner::setJob(ZcashJob* job)
+void ZcashMiner::setJob(const ZcashJob* job)
+{
+    // Only called from the stratum thread, so the generation is ours to bump
+    uint64_t generation = nWorkGeneration + 1;
+
+    // Build the work unit once here rather than in every miner thread
+    ZcashWorkPtr work;
+    if (job) {
+        ZcashWorkPtr previous = std::atomic_load(&currentWork);
+        arith_uint256 shareTarget = localTarget(job->serverTarget);
+        if (shareTarget != job->serverTarget) {
+            LogPrint("stratum", "Mining job #%s to the local target %s\n",
+                     job->jobId(), shareTarget.GetHex());
+        }
+        // make_shared would not honour the alignment of the midstate
+        work = std::allocate_shared<ZcashWork>(aligned_allocator<ZcashWork>(),
+                                               *job, generation, previous.get(), shareTarget);
+    }
+    std::atomic_store(&currentWork, work);
+    if (!job || job->clean) {
+        nCleanGeneration = generation;
+    }
+    nWorkGeneration = generation;
+
+    // Taking the lock orders this against a miner about to sleep, so the
+    // wakeup cannot be lost
+    { boost::lock_guard<boost::mutex> lock(workMutex); }
+    workCond.notify_all();
+}
+
+ZcashWorkPtr ZcashMiner::waitForWork(uint64_t& generation)
 {
-    NewJob(job);
+    ZcashWorkPtr work = std::atomic_load(&currentWork);
+    if (!work || work->generation == generation) {
+        boost::unique_lock<boost::mutex> lock(workMutex);
+        while (!(work = std::atomic_load(&currentWork)) || work->generation == generation) {
+            // Interruption point, so stop() still ends the waiting threads
+            workCond.wait(lock);
+        }
+    }
+    generation = work->generation;
+    return work;
 }
 
 void ZcashMiner::onSolutionFound(
@@ -402,14 +638,170 @@ void ZcashMiner::submitSolution(const EquihashSolution& solution)
     solutionFoundCallback(solution);
 }
 
-void ZcashMiner::acceptedSolution(bool stale)
+static void UpdateLatency(std::atomic<int64_t>& total, std::atomic<int64_t>& max, int64_t latency)
 {
+    total += latency;
+    int64_t prev = max.load();
+    while (latency > prev && !max.compare_exchange_weak(prev, latency)) { }
 }
 
-void ZcashMiner::rejectedSolution(bool stale)
+void ZcashMiner::acceptedSolution(bool stale, int64_t latency)
 {
+    nAccepted++;
+    if (stale) {
+        nAcceptedStale++;
+    }
+    UpdateLatency(nTotalLatency, nMaxLatency, latency);
+}
+
+void ZcashMiner::rejectedSolution(bool stale, int64_t latency)
+{
+    nRejected++;
+    if (stale) {
+        nRejectedStale++;
+    }
+    UpdateLatency(nTotalLatency, nMaxLatency, latency);
 }
 
 void ZcashMiner::failedSolution()
 {
+    nFailed++;
+}
+
+ZcashShareStats ZcashMiner::shareStats() const
+{
+    ZcashShareStats stats;
+    stats.accepted = nAccepted;
+    stats.rejected = nRejected;
+    stats.acceptedStale = nAcceptedStale;
+    stats.rejectedStale = nRejectedStale;
+    stats.failed = nFailed;
+    stats.withheld = nWithheld;
+    stats.totalLatency = nTotalLatency;
+    stats.maxLatency = nMaxLatency;
+    return stats;
+}
+
+// Chance that a solution's hash is at or below target
+static double ShareProbability(const arith_uint256& target)
+{
+    return std::min(1.0, (target.getdouble() + 1) / std::ldexp(1.0, 256));
+}
+
+std::vector<ZcashDeviceStats> ZcashMiner::deviceStats(const arith_uint256& target) const
+{
+    std::shared_ptr<DeviceCountersVec> counters = std::atomic_load(&deviceSolutions);
+    std::vector<ZcashDeviceStats> ret(counters->size());
+    for (size_t i = 0; i < ret.size(); i++) {
+        ret[i].gpu = (int)i < nGPUWorkers;
+    }
+    int64_t start = nMiningStart;
+    int64_t elapsed = GetTimeMillis() - start;
+    if (!start || elapsed <= 0) {
+        return ret;
+    }
+    double probability = ShareProbability(target);
+    for (size_t i = 0; i < counters->size(); i++) {
+        ret[i].solps = (*counters)[i] * 1000.0 / elapsed;
+        ret[i].sharesPerMinute = ret[i].solps * probability * 60;
+    }
+    return ret;
+}
+
+uint64_t ZcashMiner::totalSolutions() const
+{
+    std::shared_ptr<DeviceCountersVec> counters = std::atomic_load(&deviceSolutions);
+    uint64_t solutions = 0;
+    for (const std::atomic<uint64_t>& n : *counters) {
+        solutions += n;
+    }
+    return solutions;
+}
+
+double ZcashMiner::solutionRate() const
+{
+    int64_t start = nMiningStart;
+    int64_t elapsed = GetTimeMillis() - start;
+    uint64_t solutions = totalSolutions();
+    if (!start || elapsed < MIN_RATE_TIME || solutions < MIN_RATE_SOLUTIONS) {
+        return 0;
+    }
+    return solutions * 1000.0 / elapsed;
+}
+
+arith_uint256 ZcashMiner::serverTarget() const
+{
+    ZcashWorkPtr work = std::atomic_load(&currentWork);
+    return work ? work->target : arith_uint256();
+}
+
+double ZcashMiner::expectedShareRate(const arith_uint256& target) const
+{
+    return solutionRate() * ShareProbability(target) * 60;
+}
+
+void ZcashMiner::setSolutionAudit(unsigned int sampleRate)
+{
+    std::shared_ptr<SolutionAuditor> auditor;
+    if (sampleRate > 0) {
+        auditor = std::make_shared<SolutionAuditor>(Params().EquihashN(), Params().EquihashK(), sampleRate);
+    }
+    std::atomic_store(&solutionAuditor, auditor);
+}
+
+arith_uint256 ZcashMiner::localTarget(const arith_uint256& serverTarget) const
+{
+    double maxRate = nMaxShareRate;
+    double rate = expectedShareRate(serverTarget);
+    if (maxRate <= 0 || rate <= maxRate) {
+        return serverTarget;
+    }
+    // Divide by a whole factor, so each submitted share stands for that
+    // many at the server target
+    double factor = std::ceil(rate / maxRate);
+    arith_uint256 target = serverTarget;
+    target /= (uint32_t)std::min(factor, (double)std::numeric_limits<uint32_t>::max());
+    return target;
+}
+
+void ZcashMiner::setIntensity(int percent)
+{
+    percent = std::max(1, std::min(100, percent));
+    boost::lock_guard<boost::mutex> lock(intensityMutex);
+    closeIntensityPeriod(GetTimeMillis());
+    if (percent != nIntensity) {
+        LogPrintf("Mining at %d%% intensity\n", percent);
+    }
+    nIntensity = percent;
+}
+
+void ZcashMiner::closeIntensityPeriod(int64_t now)
+{
+    if (!nIntensityStart) {
+        return;
+    }
+    uint64_t solutions = totalSolutions();
+    ZcashIntensityStats& stats = intensityTotals[nIntensity];
+    stats.intensity = nIntensity;
+    stats.solutions += solutions - nIntensitySolutions;
+    stats.time += now - nIntensityStart;
+    nIntensityStart = now;
+    nIntensitySolutions = solutions;
+}
+
+std::vector<ZcashIntensityStats> ZcashMiner::intensityStats() const
+{
+    boost::lock_guard<boost::mutex> lock(intensityMutex);
+    std::map<int, ZcashIntensityStats> totals = intensityTotals;
+    if (nIntensityStart) {
+        ZcashIntensityStats& stats = totals[nIntensity];
+        stats.intensity = nIntensity;
+        stats.solutions += totalSolutions() - nIntensitySolutions;
+        stats.time += GetTimeMillis() - nIntensityStart;
+    }
+    std::vector<ZcashIntensityStats> ret;
+    for (const std::pair<const int, ZcashIntensityStats>& entry : totals) {
+        ret.push_back(entry.second);
+    }
+    return ret;
 }
@@ -2,17 +2,24 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#ifndef ZCASH_LIBSTRATUM_ZCASHSTRATUM_H
+#define ZCASH_LIBSTRATUM_ZCASHSTRATUM_H
+
 #include "arith_uint256.h"
+#include "crypto/equihash.h"
 #include "primitives/block.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/signals2.hpp>
+#include <atomic>
 #include <boost/thread.hpp>
+#include <map>
+#include <memory>
 #include <mutex>
 
 #include "json/json_spirit_value.h"
 
+#include "libzogminer/audit.h"
 #include "libzogminer/gpuconfig.h"
 
 using namespace json_spirit;
@@ -22,11 +29,14 @@ struct EquihashSolution
 {
     uint256 nonce;
     std::vector<unsigned char> solution;
+    // Job the solution was found for
+    std::string job;
 
-    EquihashSolution(uint256 n, std::vector<unsigned char> s)
-            : nonce {n}, solution {s} { }
+    EquihashSolution(uint256 n, std::vector<unsigned char> s, std::string j)
+            : nonce {n}, solution {s}, job {j} { }
 
     std::string toString() const { return nonce.GetHex(); }
+    std::string jobId() const { return job; }
 };
 
 struct ZcashJob
@@ -40,7 +50,6 @@ struct ZcashJob
     arith_uint256 serverTarget;
     bool clean;
 
-    ZcashJob* clone() const;
     bool equals(const ZcashJob& a) const { return job == a.job; }
 
     // Access Stratum flags
@@ -52,13 +61,13 @@ struct ZcashJob
     /**
      * Checks whether the given solution satisfies this work order.
      */
-    bool evalSolution(const EquihashSolution* solution);
+    bool evalSolution(const EquihashSolution* solution) const;
 
     /**
      * Returns a comma-separated string of Stratum submission values
      * corresponding to the given solution.
      */
-    std::string getSubmission(const EquihashSolution* solution);
+    std::string getSubmission(const EquihashSolution* solution) const;
 };
 
 inline bool operator==(const ZcashJob& a, const ZcashJob& b)
@@ -66,11 +75,101 @@ inline bool operator==(const ZcashJob& a, const ZcashJob& b)
     return a.equals(b);
 }
 
-typedef boost::signals2::signal<void (const ZcashJob*)> NewJob_t;
+/**
+ * Immutable work unit built once per job and shared by all miner threads:
+ * the serialised header I, the BLAKE2b midstate H(I||..., the target and
+ * the nonce space.
+ */
+struct ZcashWork
+{
+    std::string job;
+    CBlockHeader header;
+    std::vector<unsigned char> input;
+    eh_HashState midstate;
+    arith_uint256 target;
+    // Solutions are only submitted below this, which is target or stricter
+    arith_uint256 shareTarget;
+    bool clean;
+    // Value of ZcashMiner::nWorkGeneration when this work was published
+    uint64_t generation;
+
+    // Nonces are header.nNonce + (counter << nonce1Bits) for counter below
+    // nonceCount. Counters are handed out in leases from nextNonce, so no
+    // two threads ever work on the same nonce.
+    size_t nonce1Bits;
+    uint64_t nonceCount;
+    std::shared_ptr<std::atomic<uint64_t>> nextNonce;
+
+    /**
+     * Builds the work for a job. If previous has the same header and
+     * server nonce (e.g. a job sent again after a reconnect), its nonce
+     * leases carry on where they stopped.
+     */
+    ZcashWork(const ZcashJob& job, uint64_t generation, const ZcashWork* previous,
+              const arith_uint256& shareTarget);
+
+    /** Leases up to count nonce counters [begin, end); false once exhausted */
+    bool lease(uint64_t count, uint64_t& begin, uint64_t& end) const;
+    uint256 nonceAt(uint64_t counter) const;
+};
+
+typedef std::shared_ptr<const ZcashWork> ZcashWorkPtr;
+
+/**
+ * Share accounting, updated as the pool answers each submission. Stale
+ * shares are those submitted against the previous job; they are counted in
+ * accepted or rejected as well.
+ */
+struct ZcashShareStats
+{
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t acceptedStale;
+    uint64_t rejectedStale;
+    uint64_t failed;
+    // Solutions that met the server target but not the local one, so were
+    // never submitted; accepted + rejected + failed + withheld is what the
+    // server target alone would have produced
+    uint64_t withheld;
+    // Round-trip time of answered submissions, in milliseconds
+    int64_t totalLatency;
+    int64_t maxLatency;
+};
+
+/**
+ * Solution rate of one miner thread (a CPU thread or a GPU), and the rate
+ * of shares that gives at the current server target.
+ */
+struct ZcashDeviceStats
+{
+    double solps;
+    double sharesPerMinute;
+    // GPU threads come first, then any CPU threads mining next to them
+    bool gpu;
+};
+
+/**
+ * Solutions found and time spent mining at one intensity, so that the
+ * throughput given up for a lower duty cycle can be measured.
+ */
+struct ZcashIntensityStats
+{
+    int intensity;
+    uint64_t solutions;
+    // Milliseconds the miner threads ran at this intensity
+    int64_t time;
+
+    double solps() const { return time > 0 ? solutions * 1000.0 / time : 0; }
+};
 
 class ZcashMiner
 {
+    // Guarded by threadsMutex, so that start(), stop() and setDevices() can
+    // come from different threads
+    mutable boost::mutex threadsMutex;
     int nThreads;
+    // CPU threads mining next to the GPU threads, see GPUConfig::cpuThreads
+    int nCPUWorkers;
     boost::thread_group* minerThreads;
     uint256 nonce1;
     size_t nonce1Size;
@@ -78,23 +177,125 @@ class ZcashMiner
     arith_uint256 nonce2Inc;
     std::function<bool(const EquihashSolution&)> solutionFoundCallback;
 
+    // Latest work, published by setJob() with std::atomic_store and read
+    // with std::atomic_load. Each setJob() bumps the generation; clean jobs
+    // also cancel solver runs on older generations. The mutex only serves
+    // threads sleeping in waitForWork().
+    ZcashWorkPtr currentWork;
+    boost::mutex workMutex;
+    boost::condition_variable workCond;
+    std::atomic<uint64_t> nWorkGeneration {0};
+    std::atomic<uint64_t> nCleanGeneration {0};
+
+    std::atomic<uint64_t> nAccepted {0};
+    std::atomic<uint64_t> nRejected {0};
+    std::atomic<uint64_t> nAcceptedStale {0};
+    std::atomic<uint64_t> nRejectedStale {0};
+    std::atomic<uint64_t> nFailed {0};
+    std::atomic<uint64_t> nWithheld {0};
+    std::atomic<int64_t> nTotalLatency {0};
+    std::atomic<int64_t> nMaxLatency {0};
+
+    // Solutions found by each miner thread since start(), for its Sol/s.
+    // Replaced with std::atomic_store whenever the threads are restarted.
+    typedef std::vector<std::atomic<uint64_t>> DeviceCountersVec;
+    std::shared_ptr<DeviceCountersVec> deviceSolutions;
+    std::atomic<int64_t> nMiningStart {0};
+    // Leading entries of deviceSolutions that belong to GPU threads
+    std::atomic<int> nGPUWorkers {0};
+    // Cap on the expected shares per minute, 0 = none
+    std::atomic<double> nMaxShareRate {0};
+    // Checks a sample of solver runs, or null; replaced with
+    // std::atomic_store by setSolutionAudit()
+    std::shared_ptr<SolutionAuditor> solutionAuditor;
+    // Percentage of the time the miner threads spend solving
+    std::atomic<int> nIntensity {100};
+    // Totals at each earlier intensity, and the start of the period at the
+    // current one (0 while not mining) with the solutions found before it
+    mutable boost::mutex intensityMutex;
+    std::map<int, ZcashIntensityStats> intensityTotals;
+    int64_t nIntensityStart = 0;
+    uint64_t nIntensitySolutions = 0;
+
 	GPUConfig conf;
 
-public:
-    NewJob_t NewJob;
+    static int threadCount(int threads, const GPUConfig& conf);
+    static int cpuWorkerCount(int gpuThreads, const GPUConfig& conf);
+    static std::shared_ptr<DeviceCountersVec> newDeviceCounters(int threads);
+    void startThreads();
+    void stopThreads();
+    uint64_t totalSolutions() const;
+    /** Adds the period at the current intensity to its totals; needs intensityMutex */
+    void closeIntensityPeriod(int64_t now);
 
+public:
 	ZcashMiner(int threads, GPUConfig conf);
 
     std::string userAgent();
     void start();
     void stop();
-    bool isMining() { return minerThreads; }
+    bool isMining() const;
+    /**
+     * Switch to threads miner threads (-1 = one per core) on the devices in
+     * conf, plus conf.cpuThreads CPU threads when mining on GPUs, restarting
+     * the threads if they are running.
+     */
+    void setDevices(int threads, const GPUConfig& conf);
+    int threads() const;
+    /** CPU threads mining next to the GPU threads */
+    int cpuWorkers() const;
+    GPUConfig config() const;
+    /** When the miner threads were last started, ms; 0 if never */
+    int64_t miningSince() const { return nMiningStart; }
     void setServerNonce(const Array& params);
     ZcashJob* parseJob(const Array& params);
-    void setJob(ZcashJob* job);
+    void setJob(const ZcashJob* job);
+    /**
+     * Blocks until there is work newer than the given generation, then
+     * returns it and updates generation.
+     */
+    ZcashWorkPtr waitForWork(uint64_t& generation);
+    bool hasNewWork(uint64_t generation) const { return nWorkGeneration != generation; }
+    bool isWorkCancelled(uint64_t generation) const { return nCleanGeneration > generation; }
     void onSolutionFound(const std::function<bool(const EquihashSolution&)> callback);
     void submitSolution(const EquihashSolution& solution);
-    void acceptedSolution(bool stale);
-    void rejectedSolution(bool stale);
+    void acceptedSolution(bool stale, int64_t latency);
+    void rejectedSolution(bool stale, int64_t latency);
     void failedSolution();
+    void foundSolution(int device);
+    void withheldSolution() { nWithheld++; }
+    ZcashShareStats shareStats() const;
+
+    /** Total Sol/s of the miner threads, or 0 until it can be measured */
+    double solutionRate() const;
+    /** Shares per minute the miner threads should find at target */
+    double expectedShareRate(const arith_uint256& target) const;
+    std::vector<ZcashDeviceStats> deviceStats(const arith_uint256& target) const;
+    /** Target of the current work, or 0 without work */
+    arith_uint256 serverTarget() const;
+    /**
+     * Cap the shares sent upstream to about rate per minute, by mining to a
+     * target stricter than the server's when it is too easy. 0 = no cap.
+     */
+    void setMaxShareRate(double rate) { nMaxShareRate = rate; }
+    /** The target solutions must meet to be submitted, given the server's */
+    arith_uint256 localTarget(const arith_uint256& serverTarget) const;
+    /**
+     * Check the candidates of 1 in sampleRate solver runs against the
+     * reference solver, per geometry (see SolutionAuditor). 0 = never.
+     */
+    void setSolutionAudit(unsigned int sampleRate);
+    std::shared_ptr<SolutionAuditor> solutionAudit() const { return std::atomic_load(&solutionAuditor); }
+    /**
+     * Limit the duty cycle of the miner threads to percent (1-100): after
+     * each solver run a thread idles until the run took that share of the
+     * time, lowering the power drawn by the devices. Takes effect from
+     * the next run, without restarting the threads.
+     */
+    void setIntensity(int percent);
+    int intensity() const { return nIntensity; }
+    /** Sol/s measured at each intensity mined at, lowest first */
+    std::vector<ZcashIntensityStats> intensityStats() const;
 };
+
+#endif // ZCASH_LIBSTRATUM_ZCASHSTRATUM_H
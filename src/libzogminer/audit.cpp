@@ -0,0 +1,148 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "libzogminer/audit.h"
+
+#include "support/allocators/aligned.h"
+#include "util.h"
+
+#include <set>
+
+struct SolutionAuditor::Sample
+{
+    std::string geometry;
+    eh_HashState state;
+    std::vector<std::vector<unsigned char>> candidates;
+
+    // The hash state is 64-byte aligned, which plain new does not honour
+    static void* operator new(size_t size) { return aligned_malloc(size, alignof(Sample)); }
+    static void operator delete(void* p) { aligned_free(p); }
+};
+
+SolutionAuditor::SolutionAuditor(unsigned int n, unsigned int k, unsigned int sampleRate, bool background)
+    : n {n}, k {k}, nSampleRate {sampleRate}
+{
+    if (background && sampleRate > 0) {
+        worker.reset(new boost::thread(&SolutionAuditor::auditLoop, this));
+    }
+}
+
+SolutionAuditor::~SolutionAuditor()
+{
+    if (worker) {
+        worker->interrupt();
+        worker->join();
+    }
+}
+
+bool SolutionAuditor::sample()
+{
+    return nSampleRate > 0 && nNonces++ % nSampleRate == 0;
+}
+
+void SolutionAuditor::audit(const std::string& geometry, const eh_HashState& state,
+                            const std::vector<std::vector<unsigned char>>& candidates)
+{
+    std::unique_ptr<Sample> sample(new Sample {geometry, state, candidates});
+    if (!worker) {
+        check(*sample);
+        return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (busy || pending) {
+        statsByGeometry[geometry].skipped++;
+        return;
+    }
+    pending = std::move(sample);
+    cond.notify_all();
+}
+
+void SolutionAuditor::wait()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (busy || pending) {
+        cond.wait(lock);
+    }
+}
+
+std::map<std::string, SolutionAuditStats> SolutionAuditor::stats() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return statsByGeometry;
+}
+
+void SolutionAuditor::auditLoop()
+{
+    RenameThread("zcash-audit");
+    try {
+        while (true) {
+            std::unique_ptr<Sample> sample;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!pending) {
+                    cond.wait(lock);
+                }
+                sample = std::move(pending);
+                busy = true;
+            }
+            check(*sample);
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                busy = false;
+                cond.notify_all();
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        busy = false;
+        pending.reset();
+        cond.notify_all();
+    }
+}
+
+void SolutionAuditor::check(const Sample& sample)
+{
+    std::set<std::vector<unsigned char>> reference;
+    EhBasicSolve(n, k, sample.state, [&reference](std::vector<unsigned char> soln) {
+        reference.insert(soln);
+        return false;
+    }, [](EhSolverCancelCheck pos) {
+        boost::this_thread::interruption_point();
+        return false;
+    });
+
+    SolutionAuditStats result;
+    std::set<std::vector<unsigned char>> found;
+    for (const std::vector<unsigned char>& soln : sample.candidates) {
+        bool isValid = false;
+        EhIsValidSolution(n, k, sample.state, soln, isValid);
+        if (!isValid) {
+            result.invalid++;
+        } else if (!found.insert(soln).second) {
+            result.duplicates++;
+        } else if (!reference.count(soln)) {
+            result.extra++;
+        }
+    }
+    for (const std::vector<unsigned char>& soln : reference) {
+        if (!found.count(soln)) {
+            result.missed++;
+        }
+    }
+
+    LogPrint("pow", "Solution audit (%s): %d of %d found, %d invalid, %d duplicates, %d extra\n",
+             sample.geometry, found.size(), reference.size(),
+             result.invalid, result.duplicates, result.extra);
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    SolutionAuditStats& stats = statsByGeometry[sample.geometry];
+    stats.audited++;
+    stats.reference += reference.size();
+    stats.found += found.size();
+    stats.missed += result.missed;
+    stats.invalid += result.invalid;
+    stats.duplicates += result.duplicates;
+    stats.extra += result.extra;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef __SOLUTION_AUDIT_H
+#define __SOLUTION_AUDIT_H
+
+#include "crypto/equihash.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+struct SolutionAuditStats
+{
+    /** Nonces whose solutions were checked */
+    uint64_t audited;
+    /** Sampled nonces dropped because an earlier one was still being checked */
+    uint64_t skipped;
+    /** Solutions found by the reference solver */
+    uint64_t reference;
+    /** Distinct valid solutions given by the audited solver */
+    uint64_t found;
+    /** Reference solutions the audited solver did not give */
+    uint64_t missed;
+    /** Candidates that failed EhIsValidSolution */
+    uint64_t invalid;
+    /** Candidates given more than once for the same nonce */
+    uint64_t duplicates;
+    /** Valid solutions the reference solver did not find */
+    uint64_t extra;
+
+    SolutionAuditStats() : audited {0}, skipped {0}, reference {0}, found {0},
+                           missed {0}, invalid {0}, duplicates {0}, extra {0} { }
+};
+
+/**
+ * Checks the candidates a solver gives for a sample of nonces against the
+ * complete solution set from EhBasicSolve, so that kernel geometries can be
+ * compared by how many solutions they lose and not only by their speed.
+ * Results are kept per geometry, as named by the caller.
+ *
+ * In the background mode the reference solves run on a single thread of
+ * their own, and samples arriving while it is busy are skipped. BasicSolve
+ * needs far more memory and time than the mining solvers, so production
+ * sampling rates should be low.
+ */
+class SolutionAuditor
+{
+public:
+    /** Audits 1 in sampleRate nonces; with background false, audit() blocks */
+    SolutionAuditor(unsigned int n, unsigned int k, unsigned int sampleRate, bool background = true);
+    ~SolutionAuditor();
+
+    /** Whether the caller should collect the candidates for its next nonce */
+    bool sample();
+    /** Audits the candidates given for the base state H(I||V) */
+    void audit(const std::string& geometry, const eh_HashState& state,
+               const std::vector<std::vector<unsigned char>>& candidates);
+    /** Waits until no audit is queued or running */
+    void wait();
+
+    unsigned int sampleRate() const { return nSampleRate; }
+    std::map<std::string, SolutionAuditStats> stats() const;
+
+private:
+    struct Sample;
+
+    void auditLoop();
+    void check(const Sample& sample);
+
+    unsigned int n;
+    unsigned int k;
+    unsigned int nSampleRate;
+    std::atomic<uint64_t> nNonces {0};
+
+    mutable boost::mutex cs;
+    boost::condition_variable cond;
+    std::map<std::string, SolutionAuditStats> statsByGeometry;
+    // The one sample waiting for the background thread
+    std::unique_ptr<Sample> pending;
+    bool busy = false;
+    std::unique_ptr<boost::thread> worker;
+
+    SolutionAuditor(const SolutionAuditor&) = delete;
+    SolutionAuditor& operator=(const SolutionAuditor&) = delete;
+};
+
+#endif // __SOLUTION_AUDIT_H
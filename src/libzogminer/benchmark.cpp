@@ -0,0 +1,253 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "libzogminer/benchmark.h"
+
+#include "arith_uint256.h"
+#include "libzogminer/cl_zogminer.h"
+#include "libzogminer/cpusolver.h"
+#include "libzogminer/gpusolver.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace json_spirit;
+
+// Each header of the set is solved with this many consecutive nonces
+static const size_t NONCES_PER_HEADER = 4;
+
+const std::vector<std::string> BENCHMARK_ENGINES {"optimised", "basic", "gpu", "opencl-cpu"};
+
+std::vector<BenchmarkVector> GetBenchmarkVectors(size_t count)
+{
+    std::vector<BenchmarkVector> ret;
+    for (size_t i = 0; i < count; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = ArithToUint256(arith_uint256(i / NONCES_PER_HEADER + 1));
+        header.hashMerkleRoot = ArithToUint256(~arith_uint256(i / NONCES_PER_HEADER));
+        header.nTime = 1477641360;
+        header.nBits = 0x200f0f0f;
+
+        BenchmarkVector vector;
+        vector.nonce = ArithToUint256(arith_uint256(i % NONCES_PER_HEADER + 1));
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CEquihashInput{header} << vector.nonce;
+        vector.header.assign(ss.begin(), ss.end());
+        ret.push_back(vector);
+    }
+    return ret;
+}
+
+// Checks the candidates of one run against H(I||V) outside of the timed part
+static void CheckCandidates(unsigned int n, unsigned int k, const BenchmarkVector& vector,
+                            const std::vector<std::vector<unsigned char>>& candidates,
+                            EngineBenchmark& result)
+{
+    eh_HashState state;
+    EhInitialiseState(n, k, state);
+    crypto_generichash_blake2b_update(&state, vector.header.data(), vector.header.size());
+
+    std::set<std::vector<unsigned char>> found;
+    for (const std::vector<unsigned char>& soln : candidates) {
+        bool isValid = false;
+        EhIsValidSolution(n, k, state, soln, isValid);
+        if (!isValid || !found.insert(soln).second) {
+            result.invalid++;
+        }
+    }
+    result.solutions.push_back(found);
+}
+
+static void RunGPUBenchmark(unsigned platformId, unsigned deviceId, unsigned rowsLog,
+                            unsigned int n, unsigned int k,
+                            const std::vector<BenchmarkVector>& vectors,
+                            EngineBenchmark& result)
+{
+    GPUSolver solver(platformId, deviceId, rowsLog);
+    result.geometry = solver.geometry();
+    std::function<bool(GPUSolverCancelCheck)> cancelled =
+            [](GPUSolverCancelCheck pos) { return false; };
+
+    for (size_t i = 0; i < vectors.size(); i++) {
+        // The solver hashes I itself and adds the nonce it reads from the header
+        std::vector<unsigned char> header = vectors[i].header;
+        eh_HashState state;
+        EhInitialiseState(n, k, state);
+        crypto_generichash_blake2b_update(&state, header.data(), header.size() - ZCASH_NONCE_LEN);
+
+        std::vector<std::vector<unsigned char>> candidates;
+        int64_t nStart = GetTimeMicros();
+        solver.run(n, k, header.data(), header.size(), i,
+                   [&candidates](std::vector<unsigned char> soln) {
+            candidates.push_back(soln);
+            return false;
+        }, cancelled, state);
+        result.latencies.push_back(GetTimeMicros() - nStart);
+        CheckCandidates(n, k, vectors[i], candidates, result);
+    }
+}
+
+EngineBenchmark RunEngineBenchmark(const std::string& engine,
+                                   unsigned int n, unsigned int k,
+                                   const std::vector<BenchmarkVector>& vectors,
+                                   const GPUConfig& conf)
+{
+    EngineBenchmark result;
+    result.engine = engine;
+    std::function<bool(EhSolverCancelCheck)> cancelled =
+            [](EhSolverCancelCheck pos) { return false; };
+
+    if (engine == "optimised") {
+        EquihashSolver solver(n, k, conf.memoryBudget);
+        for (const BenchmarkVector& vector : vectors) {
+            solver.setHeader(vector.header.data(), vector.header.size() - ZCASH_NONCE_LEN);
+            std::vector<std::vector<unsigned char>> candidates;
+            int64_t nStart = GetTimeMicros();
+            solver.solve(vector.nonce, [&candidates](std::vector<unsigned char> soln) {
+                candidates.push_back(soln);
+                return false;
+            }, cancelled);
+            result.latencies.push_back(GetTimeMicros() - nStart);
+            CheckCandidates(n, k, vector, candidates, result);
+        }
+        result.droppedRows = solver.stats().droppedRows;
+    } else if (engine == "basic") {
+        for (const BenchmarkVector& vector : vectors) {
+            eh_HashState state;
+            EhInitialiseState(n, k, state);
+            crypto_generichash_blake2b_update(&state, vector.header.data(), vector.header.size());
+            std::vector<std::vector<unsigned char>> candidates;
+            int64_t nStart = GetTimeMicros();
+            EhBasicSolve(n, k, state, [&candidates](std::vector<unsigned char> soln) {
+                candidates.push_back(soln);
+                return false;
+            }, cancelled);
+            result.latencies.push_back(GetTimeMicros() - nStart);
+            CheckCandidates(n, k, vector, candidates, result);
+        }
+    } else if (engine == "gpu" || engine == "opencl-cpu") {
+        if (n != 200 || k != 9) {
+            result.error = "The OpenCL solver only supports Equihash 200,9";
+            return result;
+        }
+        try {
+            if (engine == "gpu") {
+                if (conf.selGPU < 0 || (int64_t)cl_zogminer::getNumDevices(conf.platformId) <= conf.selGPU) {
+                    result.error = strprintf("No OpenCL device %d on platform %d", conf.selGPU, conf.platformId);
+                    return result;
+                }
+                RunGPUBenchmark(conf.platformId, conf.selGPU, conf.rowsLog, n, k, vectors, result);
+            } else {
+                // CPU devices are only numbered while they are allowed
+                cl_zogminer::allowCPU(true);
+                unsigned platformId, deviceId;
+                if (cl_zogminer::findDevice(CL_DEVICE_TYPE_CPU, platformId, deviceId)) {
+                    RunGPUBenchmark(platformId, deviceId, conf.rowsLog, n, k, vectors, result);
+                } else {
+                    result.error = "No OpenCL CPU runtime found";
+                }
+                cl_zogminer::allowCPU(false);
+            }
+        } catch (const std::exception& e) {
+            cl_zogminer::allowCPU(false);
+            result.error = strprintf("OpenCL error: %s", e.what());
+        }
+    } else {
+        result.error = "Unknown engine";
+    }
+    return result;
+}
+
+// Nearest-rank percentile of sorted values, in milliseconds
+static double Percentile(const std::vector<int64_t>& sorted, double p)
+{
+    size_t rank = std::max<size_t>(1, (size_t)std::ceil(p / 100 * sorted.size()));
+    return sorted[rank - 1] / 1000.0;
+}
+
+Object RunSolverBenchmark(unsigned int n, unsigned int k, size_t count,
+                          const std::vector<std::string>& engines,
+                          const GPUConfig& conf)
+{
+    std::vector<BenchmarkVector> vectors = GetBenchmarkVectors(count);
+    std::vector<EngineBenchmark> results;
+    std::vector<std::set<std::vector<unsigned char>>> reference(vectors.size());
+    for (const std::string& engine : engines) {
+        LogPrintf("Benchmarking the %s solver on %d vectors\n", engine, vectors.size());
+        results.push_back(RunEngineBenchmark(engine, n, k, vectors, conf));
+        const EngineBenchmark& result = results.back();
+        for (size_t i = 0; i < result.solutions.size(); i++) {
+            reference[i].insert(result.solutions[i].begin(), result.solutions[i].end());
+        }
+    }
+
+    Object ret;
+    ret.push_back(Pair("n", (int)n));
+    ret.push_back(Pair("k", (int)k));
+    ret.push_back(Pair("vectors", (int)vectors.size()));
+    Array referenceCounts;
+    uint64_t referenceTotal = 0;
+    for (const std::set<std::vector<unsigned char>>& solns : reference) {
+        referenceCounts.push_back((int)solns.size());
+        referenceTotal += solns.size();
+    }
+    ret.push_back(Pair("reference", referenceCounts));
+    ret.push_back(Pair("referencesolutions", referenceTotal));
+
+    Array engineReports;
+    for (const EngineBenchmark& result : results) {
+        Object report;
+        report.push_back(Pair("engine", result.engine));
+        if (!result.error.empty()) {
+            report.push_back(Pair("error", result.error));
+            engineReports.push_back(report);
+            continue;
+        }
+
+        int64_t time = 0;
+        for (int64_t latency : result.latencies) {
+            time += latency;
+        }
+        uint64_t found = 0;
+        Array counts;
+        for (const std::set<std::vector<unsigned char>>& solns : result.solutions) {
+            counts.push_back((int)solns.size());
+            found += solns.size();
+        }
+        double seconds = time / 1000000.0;
+        if (!result.geometry.empty()) {
+            report.push_back(Pair("geometry", result.geometry));
+        }
+        report.push_back(Pair("runs", (int)result.latencies.size()));
+        report.push_back(Pair("time", seconds));
+        report.push_back(Pair("solvespersec", seconds > 0 ? result.latencies.size() / seconds : 0));
+        report.push_back(Pair("solps", seconds > 0 ? found / seconds : 0));
+        report.push_back(Pair("solutions", found));
+        report.push_back(Pair("found", counts));
+        report.push_back(Pair("invalid", result.invalid));
+        report.push_back(Pair("droprate", referenceTotal ? 1.0 - (double)found / referenceTotal : 0));
+        report.push_back(Pair("droppedrows", result.droppedRows));
+
+        std::vector<int64_t> sorted = result.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        Object latency;
+        if (!sorted.empty()) {
+            latency.push_back(Pair("min", sorted.front() / 1000.0));
+            latency.push_back(Pair("p50", Percentile(sorted, 50)));
+            latency.push_back(Pair("p90", Percentile(sorted, 90)));
+            latency.push_back(Pair("p99", Percentile(sorted, 99)));
+            latency.push_back(Pair("max", sorted.back() / 1000.0));
+        }
+        report.push_back(Pair("latency", latency));
+        engineReports.push_back(report);
+    }
+    ret.push_back(Pair("engines", engineReports));
+    return ret;
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef __SOLVER_BENCHMARK_H
+#define __SOLVER_BENCHMARK_H
+
+#include "gpuconfig.h"
+#include "uint256.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+
+/** A header I and nonce V that are the same on every run and every machine */
+struct BenchmarkVector
+{
+    /** I||V, ZCASH_BLOCK_HEADER_LEN bytes */
+    std::vector<unsigned char> header;
+    /** V, small enough for the OpenCL solver, which only reads its low 64 bits */
+    uint256 nonce;
+};
+
+/** Returns the first count vectors of the fixed benchmark set */
+std::vector<BenchmarkVector> GetBenchmarkVectors(size_t count);
+
+/** Engines understood by RunEngineBenchmark(), in the order they are run */
+extern const std::vector<std::string> BENCHMARK_ENGINES;
+
+struct EngineBenchmark
+{
+    std::string engine;
+    /** Why the engine could not be run, or empty if it was */
+    std::string error;
+    /** Table geometry of the OpenCL kernels, empty for the CPU solvers */
+    std::string geometry;
+    /** Distinct valid solutions found for each vector */
+    std::vector<std::set<std::vector<unsigned char>>> solutions;
+    /** Candidates that were repeated or failed EhIsValidSolution */
+    uint64_t invalid;
+    /** Rows the optimised solver dropped because they did not fit its table */
+    uint64_t droppedRows;
+    /** Wall time of each solver run, in microseconds */
+    std::vector<int64_t> latencies;
+
+    EngineBenchmark() : invalid {0}, droppedRows {0} { }
+};
+
+/**
+ * Runs one engine over the vectors on the calling thread:
+ *   optimised   EquihashSolver, as used by the CPU miner threads
+ *   basic       EhBasicSolve
+ *   gpu         GPUSolver on the device selected in conf
+ *   opencl-cpu  GPUSolver on the first OpenCL CPU device
+ */
+EngineBenchmark RunEngineBenchmark(const std::string& engine,
+                                   unsigned int n, unsigned int k,
+                                   const std::vector<BenchmarkVector>& vectors,
+                                   const GPUConfig& conf);
+
+/**
+ * Runs the engines one after another over the first count vectors and
+ * reports Sol/s, solves/s and latency percentiles for each. The reference
+ * solution count of a vector is the number of distinct valid solutions found
+ * for it by any engine, so each engine's drop rate is measured against the
+ * others.
+ */
+json_spirit::Object RunSolverBenchmark(unsigned int n, unsigned int k, size_t count,
+                                       const std::vector<std::string>& engines,
+                                       const GPUConfig& conf);
+
+#endif // __SOLVER_BENCHMARK_H
@@ -3,13 +3,14 @@
 
 #include <cstdio>
 #include <cstdlib>
-//#include <chrono>
+#include <chrono>
 #include <fstream>
 #include <streambuf>
 #include <iostream>
 #include <queue>
 #include <vector>
 #include <random>
+#include <thread>
 //#include <atomic>
 #include "cl_zogminer.h"
 #include "kernels/cl_zogminer_kernel.h" // Created from CMake
@@ -31,7 +32,7 @@ unsigned const cl_zogminer::c_defaultLocalWorkSize = 32;
 unsigned const cl_zogminer::c_defaultGlobalWorkSizeMultiplier = 4096; // * CL_DEFAULT_LOCAL_WORK_SIZE
 unsigned const cl_zogminer::c_defaultMSPerBatch = 0;
 bool cl_zogminer::s_allowCPU = false;
-unsigned cl_zogminer::s_extraRequiredGPUMem;
+cl_ulong cl_zogminer::s_extraRequiredGPUMem;
 unsigned cl_zogminer::s_msPerBatch = cl_zogminer::c_defaultMSPerBatch;
 unsigned cl_zogminer::s_workgroupSize = cl_zogminer::c_defaultLocalWorkSize;
 unsigned cl_zogminer::s_initialGlobalWorkSize = cl_zogminer::c_defaultGlobalWorkSizeMultiplier * cl_zogminer::c_defaultLocalWorkSize;
@@ -56,6 +57,9 @@ static std::atomic_flag s_logSpin = ATOMIC_FLAG_INIT;
 // Types of OpenCL devices we are interested in
 #define CL_QUERIED_DEVICE_TYPES (CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR)
 
+// Hash table sizes the kernels support, largest first
+static const unsigned c_rowsLogs[] = { 20, 19, 18, 16 };
+
 // Inject definitions into the kernal source
 static void addDefinition(string& _source, char const* _id, unsigned _value)
 {
@@ -169,26 +173,79 @@ unsigned cl_zogminer::getNumDevices(unsigned _platformId)
 // This needs customizing apon completion of the kernel - Checks memory requirements - May not be applicable
 bool cl_zogminer::configureGPU(
 	unsigned _platformId,
+	unsigned _deviceId,
 	unsigned _localWorkSize,
-	unsigned _globalWorkSize
+	unsigned _globalWorkSize,
+	unsigned& _rowsLog
 )
 {
 	// Set the local/global work sizes
 	s_workgroupSize = _localWorkSize;
 	s_initialGlobalWorkSize = _globalWorkSize;
 
-	return searchForAllDevices(_platformId, [](cl::Device const& _device) -> bool
+	_rowsLog = preflight(_platformId, _deviceId, _rowsLog);
+	return _rowsLog != 0;
+}
+
+size_t cl_zogminer::requiredMemory(unsigned _rowsLog)
+{
+	// The buffers init() and run() create
+	return 2 * tableSize(_rowsLog) + sizeof(sols_t) + sizeof(debug_t) + sizeof(blake2b_state_t);
+}
+
+// Solvers with 2^_rowsLog rows that fit in the memory of the device, after
+// s_extraRequiredGPUMem, or 0 if a table is larger than one allocation may be
+unsigned cl_zogminer::maxInstances(cl::Device const& _device, unsigned _rowsLog)
+{
+	if (!supportsRows(_rowsLog))
+		return 0;
+	cl_ulong globalMem = _device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	cl_ulong maxAlloc = _device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	if (maxAlloc < tableSize(_rowsLog) || maxAlloc < sizeof(sols_t) || globalMem <= s_extraRequiredGPUMem)
+		return 0;
+	return (globalMem - s_extraRequiredGPUMem) / requiredMemory(_rowsLog);
+}
+
+unsigned cl_zogminer::preflight(unsigned _platformId, unsigned _deviceId, unsigned _rowsLog, unsigned _instances)
+{
+	try
+	{
+		vector<cl::Platform> platforms = getPlatforms();
+		if (_platformId >= platforms.size())
 		{
-			cl_ulong result;
-			_device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &result);
+			CL_LOG("No OpenCL platform " << _platformId << ".");
+			return 0;
+		}
+		vector<cl::Device> devices = getDevices(platforms, _platformId);
+		if (_deviceId >= devices.size())
+		{
+			CL_LOG("No OpenCL device " << _deviceId << " on platform " << _platformId << ".");
+			return 0;
+		}
+		cl::Device const& device = devices[_deviceId];
 
-				CL_LOG(
-					"Found suitable OpenCL device [" << _device.getInfo<CL_DEVICE_NAME>()
-					<< "] with " << result << " bytes of GPU memory"
-				);
-				return true;
+		for (unsigned rowsLog : c_rowsLogs)
+		{
+			if (_rowsLog && rowsLog != _rowsLog)
+				continue;
+			if (maxInstances(device, rowsLog) >= _instances)
+			{
+				CL_LOG("Using " << _instances << " solver(s) with 2^" << rowsLog << " rows on ["
+					<< device.getInfo<CL_DEVICE_NAME>() << "], " << (_instances * requiredMemory(rowsLog) >> 20)
+					<< " of " << (device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() >> 20) << " MB");
+				return rowsLog;
+			}
 		}
-	);
+		CL_LOG("Skipping [" << device.getInfo<CL_DEVICE_NAME>() << "]: " << _instances << " solver(s) with "
+			<< (_rowsLog ? "2^" + to_string(_rowsLog) + " rows" : "any table") << " do not fit in its "
+			<< (device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() >> 20) << " MB, largest allocation "
+			<< (device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() >> 20) << " MB.");
+	}
+	catch (cl::Error const& err)
+	{
+		CL_LOG("CL ERROR:" << err.what() << "(" << err.err() << ")");
+	}
+	return 0;
 }
 
 bool cl_zogminer::searchForAllDevices(function<bool(cl::Device const&)> _callback)
@@ -252,6 +309,23 @@ void cl_zogminer::doForAllDevices(unsigned _platformId, function<void(unsigned _
 	}
 }
 
+bool cl_zogminer::findDevice(cl_device_type _type, unsigned& _platformId, unsigned& _deviceId)
+{
+	vector<cl::Platform> platforms = getPlatforms();
+	for (unsigned i = 0; i < platforms.size(); ++i)
+	{
+		vector<cl::Device> devices = getDevices(platforms, i);
+		for (unsigned j = 0; j < devices.size(); ++j)
+			if (devices[j].getInfo<CL_DEVICE_TYPE>() & _type)
+			{
+				_platformId = i;
+				_deviceId = j;
+				return true;
+			}
+	}
+	return false;
+}
+
 void cl_zogminer::listDevices()
 {
 	string outString ="\nListing OpenCL devices.\nFORMAT: [platformID][deviceID] deviceName\n";
@@ -278,6 +352,19 @@ void cl_zogminer::listDevices()
 			outString += "\tCL_DEVICE_GLOBAL_MEM_SIZE: " + to_string(_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()) + "\n";
 			outString += "\tCL_DEVICE_MAX_MEM_ALLOC_SIZE: " + to_string(_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) + "\n";
 			outString += "\tCL_DEVICE_MAX_WORK_GROUP_SIZE: " + to_string(_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()) + "\n";
+			// What each table size needs, and how many solvers (miner threads) fit
+			outString += "\t-gpurows  MB/solver  solvers\n";
+			unsigned best = 0;
+			for (unsigned rowsLog : c_rowsLogs)
+			{
+				unsigned instances = maxInstances(_device, rowsLog);
+				if (instances && !best)
+					best = rowsLog;
+				char row[64];
+				snprintf(row, sizeof(row), "\t%8u  %9zu  %7u\n", rowsLog, requiredMemory(rowsLog) >> 20, instances);
+				outString += row;
+			}
+			outString += best ? "\tDefault -gpurows: " + to_string(best) + "\n" : "\tNo table fits, the device would be skipped\n";
 			++i;
 		}
 	);
@@ -291,13 +378,57 @@ void cl_zogminer::finish()
 		m_queue.finish();
 }
 
+bool cl_zogminer::supportsRows(unsigned _rowsLog)
+{
+	return slotsPerRow(_rowsLog) != 0;
+}
+
+unsigned cl_zogminer::slotsPerRow(unsigned _rowsLog)
+{
+	// OVERHEAD of the kernel for each NR_ROWS_LOG it supports
+	unsigned overhead;
+	switch (_rowsLog)
+	{
+	case 16: overhead = 3; break;
+	case 18: overhead = 3; break;
+	case 19: overhead = 5; break;
+	case 20: overhead = 9; break;
+	default: return 0;
+	}
+	return (1 << (APX_NR_ELMS_LOG - _rowsLog)) * overhead;
+}
+
+// In the target-latency mode, waits for the kernel just queued, and leaves the
+// device idle for a moment once s_msPerBatch of work has run since the last
+// pause. The driver can then schedule other contexts between kernels rather
+// than only between whole solver runs.
+void cl_zogminer::endBatch(std::chrono::steady_clock::time_point& _batchStart)
+{
+	if (!s_msPerBatch)
+		return;
+	m_queue.finish();
+	if (std::chrono::steady_clock::now() - _batchStart >= std::chrono::milliseconds(s_msPerBatch))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		_batchStart = std::chrono::steady_clock::now();
+	}
+}
+
 // Customise given kernel - This builds the kernel and creates memory buffers
 bool cl_zogminer::init(
 	unsigned _platformId,
 	unsigned _deviceId,
-	const std::vector<std::string> _kernels
+	const std::vector<std::string> _kernels,
+	unsigned _rowsLog
 )
 {
+	m_rowsLog = _rowsLog ? _rowsLog : NR_ROWS_LOG;
+	if (!supportsRows(m_rowsLog))
+	{
+		CL_LOG("Unsupported hash table size 2^" << m_rowsLog << " rows, use 16, 18, 19 or 20.");
+		return false;
+	}
+
 	// get all platforms
 	try
 	{
@@ -355,6 +486,9 @@ bool cl_zogminer::init(
 #else
 		string code(CL_MINER_KERNEL, CL_MINER_KERNEL + CL_MINER_KERNEL_SIZE);
 #endif
+		addDefinition(code, "NR_ROWS_LOG", m_rowsLog);
+		CL_LOG("Hash tables: 2^" << m_rowsLog << " rows of " << slotsPerRow(m_rowsLog) << " slots, "
+			<< (2 * tableSize(m_rowsLog) >> 20) << " MB");
 		// create miner OpenCL program
 		cl::Program::Sources sources;
 		sources.push_back({ code.c_str(), code.size() });
@@ -387,8 +521,8 @@ bool cl_zogminer::init(
 	  	buf_dbg = cl::Buffer(m_context, CL_MEM_READ_WRITE, dbg_size, NULL, NULL);
 		//TODO Dangger
 		m_queue.enqueueFillBuffer(buf_dbg, &zero, 1, 0, dbg_size, 0);
-		buf_ht[0] = cl::Buffer(m_context, CL_MEM_READ_WRITE, HT_SIZE, NULL, NULL);
-		buf_ht[1] = cl::Buffer(m_context, CL_MEM_READ_WRITE, HT_SIZE, NULL, NULL);
+		buf_ht[0] = cl::Buffer(m_context, CL_MEM_READ_WRITE, tableSize(m_rowsLog), NULL, NULL);
+		buf_ht[1] = cl::Buffer(m_context, CL_MEM_READ_WRITE, tableSize(m_rowsLog), NULL, NULL);
 		buf_sols = cl::Buffer(m_context, CL_MEM_READ_WRITE, sizeof (sols_t), NULL, NULL);
 
 		m_queue.finish();
@@ -403,8 +537,10 @@ bool cl_zogminer::init(
 }
 
 
-void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t * indices, uint32_t * n_sol, uint64_t * ptr)
+bool cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t * indices, uint32_t * n_sol, uint64_t * ptr,
+	std::function<bool()> _cancelled)
 {
+	*n_sol = 0;
 	try
 	{
 
@@ -413,7 +549,10 @@ void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t
 		uint32_t		sol_found = 0;
 		size_t      local_ws = 64;
 		size_t		global_ws;
+		size_t		nr_rows = (size_t)1 << m_rowsLog;
 		uint64_t		*nonce_ptr;
+		auto		batch_start = std::chrono::steady_clock::now();
+		cl::Event	prev_round_done;
     	assert(header_len == ZCASH_BLOCK_HEADER_LEN ||
 	    header_len == ZCASH_BLOCK_HEADER_LEN - ZCASH_NONCE_LEN);
     	nonce_ptr = (uint64_t *)(header + ZCASH_BLOCK_HEADER_LEN - ZCASH_NONCE_LEN);
@@ -431,11 +570,12 @@ void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t
 
 		for (unsigned round = 0; round < PARAM_K; round++) {
 
-			size_t      global_ws = NR_ROWS;
+			size_t      global_ws = nr_rows;
 			
 			if (round < 2) {
 				m_zogKernels[0].setArg(0, buf_ht[round % 2]);
 				m_queue.enqueueNDRangeKernel(m_zogKernels[0], cl::NullRange, cl::NDRange(global_ws), cl::NDRange(local_ws));
+				endBatch(batch_start);
 			}
 			
 			if (!round) {
@@ -445,7 +585,7 @@ void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t
 			} else {
 				m_zogKernels[1+round].setArg(0, buf_ht[(round - 1) % 2]);
 				m_zogKernels[1+round].setArg(1, buf_ht[round % 2]);
-				global_ws = NR_ROWS;
+				global_ws = nr_rows;
 			}
 			
 			m_zogKernels[1+round].setArg(2, buf_dbg);
@@ -453,14 +593,34 @@ void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t
 			if (round == PARAM_K - 1)
 				m_zogKernels[1+round].setArg(3, buf_sols);
 
-			m_queue.enqueueNDRangeKernel(m_zogKernels[1+round], cl::NullRange, cl::NDRange(global_ws), cl::NDRange(local_ws));
+			cl::Event round_done;
+			m_queue.enqueueNDRangeKernel(m_zogKernels[1+round], cl::NullRange, cl::NDRange(global_ws), cl::NDRange(local_ws), NULL, &round_done);
+			endBatch(batch_start);
+
+			// Wait for the previous round while this one is queued behind it,
+			// so the device never runs dry, and a stale run stops within two
+			// rounds rather than after all of them
+			if (_cancelled)
+			{
+				if (round)
+				{
+					m_queue.flush();
+					prev_round_done.wait();
+				}
+				if (_cancelled())
+				{
+					m_queue.finish();
+					return false;
+				}
+				prev_round_done = round_done;
+			}
 		
 		}
 		
 		m_zogKernels[10].setArg(0, buf_ht[0]);
 		m_zogKernels[10].setArg(1, buf_ht[1]);
 		m_zogKernels[10].setArg(2, buf_sols);
-		global_ws = NR_ROWS;
+		global_ws = nr_rows;
 		m_queue.enqueueNDRangeKernel(m_zogKernels[10], cl::NullRange, cl::NDRange(global_ws), cl::NDRange(local_ws)); 
 
 		
@@ -492,4 +652,5 @@ void cl_zogminer::run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t
 		CL_LOG("CL ERROR:" << get_error_string(err.err()));
 		//CL_LOG(err.what() << "(" << err.err() << ")");
 	}
+	return true;
 }
@@ -20,6 +20,7 @@
 #include "cl.hpp"
 #endif
 #include <time.h>
+#include <chrono>
 #include <functional>
 
 #include "sodium.h"
@@ -80,24 +81,57 @@ public:
 	static unsigned getNumDevices(unsigned _platformId = 0);
 	static std::string platform_info(unsigned _platformId = 0, unsigned _deviceId = 0);
 	static void listDevices();
+	/// Let CPU devices be listed and selected alongside GPUs and accelerators
+	static void allowCPU(bool _allow) { s_allowCPU = _allow; }
+	/// Finds the first device of the given type, numbered as init() numbers them
+	static bool findDevice(cl_device_type _type, unsigned& _platformId, unsigned& _deviceId);
 
-	// Currently just prints memory of the GPU
+	/// Sets the work sizes and checks that a solver fits in the memory of the
+	/// device, choosing the largest table that does if _rowsLog is 0
 	static bool configureGPU(
 		unsigned _platformId,
+		unsigned _deviceId,
 		unsigned _localWorkSize,
-		unsigned _globalWorkSize
+		unsigned _globalWorkSize,
+		unsigned& _rowsLog
 	);
-
+	/// Hash table rows, as a power of two, with which _instances solvers fit
+	/// on the device: _rowsLog if it fits, or the largest table that does if
+	/// _rowsLog is 0. Returns 0 when nothing fits.
+	static unsigned preflight(unsigned _platformId, unsigned _deviceId, unsigned _rowsLog, unsigned _instances = 1);
+	/// Bytes of device memory one solver allocates with 2^_rowsLog rows
+	static size_t requiredMemory(unsigned _rowsLog);
+	/// Device memory to leave free for other uses, e.g. a display
+	static void setExtraRequiredGPUMem(cl_ulong _bytes) { s_extraRequiredGPUMem = _bytes; }
+
+	/// Builds the kernels with 2^_rowsLog hash table rows, or NR_ROWS_LOG if 0
 	bool init(
 		unsigned _platformId,
 		unsigned _deviceId,
-		std::vector<std::string> _kernels
+		std::vector<std::string> _kernels,
+		unsigned _rowsLog = 0
 	);
 
-	void run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t * indices, uint32_t * n_sol, uint64_t * ptr);
+	/// Solves one nonce. If _cancelled is given, it is checked as each round
+	/// is queued, once the round before it has run, and run() returns false
+	/// as soon as it returns true.
+	bool run(uint8_t *header, size_t header_len, uint64_t nonce, sols_t * indices, uint32_t * n_sol, uint64_t * ptr,
+		std::function<bool()> _cancelled = nullptr);
 
 	void finish();
 
+	/// Hash table rows of the built kernels, as a power of two
+	unsigned rowsLog() const { return m_rowsLog; }
+	/// Whether the kernels can be built with 2^_rowsLog hash table rows
+	static bool supportsRows(unsigned _rowsLog);
+	/// Slots per row with 2^_rowsLog rows, as OVERHEAD in param.h sets them
+	static unsigned slotsPerRow(unsigned _rowsLog);
+	/// Bytes used by each of the two hash tables with 2^_rowsLog rows
+	static size_t tableSize(unsigned _rowsLog) { return ((size_t)1 << _rowsLog) * slotsPerRow(_rowsLog) * SLOT_LEN; }
+	/// Wait for each kernel and give the device up for a moment every _ms
+	/// of work, so that a display on the same GPU stays responsive. 0 = off
+	static void setMSPerBatch(unsigned _ms) { s_msPerBatch = _ms; }
+
 	/* -- default values -- */
 	/// Default value of the local work size. Also known as workgroup size.
 	static unsigned const c_defaultLocalWorkSize;
@@ -114,6 +148,8 @@ private:
 
 	static std::vector<cl::Device> getDevices(std::vector<cl::Platform> const& _platforms, unsigned _platformId);
 	static std::vector<cl::Platform> getPlatforms();
+	static unsigned maxInstances(cl::Device const& _device, unsigned _rowsLog);
+	void endBatch(std::chrono::steady_clock::time_point& _batchStart);
 	int compare_indices32(uint32_t* a, uint32_t* b, size_t n_current_indices) {
 		for(size_t i = 0; i < n_current_indices; ++i, ++a, ++b) {
 		    if(*a < *b) {
@@ -224,6 +260,7 @@ private:
 	sols_t	* sols;
 
 	unsigned m_globalWorkSize;
+	unsigned m_rowsLog = NR_ROWS_LOG;
 	bool m_openclOnePointOne;
 	unsigned m_deviceBits;
 
@@ -236,13 +273,13 @@ private:
 	static unsigned s_workgroupSize;
 	/// The initial global work size for the searches
 	static unsigned s_initialGlobalWorkSize;
-	/// The target milliseconds per batch for the search. If 0, then no adjustment will happen
+	/// The target milliseconds per batch for the search. If 0, then kernels are queued back to back
 	static unsigned s_msPerBatch;
 	/// Allow CPU to appear as an OpenCL device or not. Default is false
 	static bool s_allowCPU;
 	/// GPU memory required for other things, like window rendering e.t.c.
-	/// User can set it via the --cl-extragpu-mem argument.
-	static unsigned s_extraRequiredGPUMem;
+	/// User can set it via the -gpureserve argument.
+	static cl_ulong s_extraRequiredGPUMem;
 
   const char *get_error_string(cl_int error)
   {
@@ -0,0 +1,52 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cpusolver.h"
+#include "util.h"
+
+EquihashSolver::EquihashSolver(unsigned int n, unsigned int k, size_t memoryBudget)
+    : n {n}, k {k}, memory {memoryBudget}
+{
+    EhInitialiseState(n, k, midstate);
+}
+
+void EquihashSolver::setHeader(const unsigned char* header, size_t header_len)
+{
+    // H(I||...
+    EhInitialiseState(n, k, midstate);
+    crypto_generichash_blake2b_update(&midstate, header, header_len);
+}
+
+bool EquihashSolver::solve(const uint256& nonce,
+                           const std::function<bool(std::vector<unsigned char>)> validBlock,
+                           const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    // H(I||V||...
+    eh_HashState curr_state = midstate;
+    crypto_generichash_blake2b_update(&curr_state, nonce.begin(), nonce.size());
+
+    std::function<bool(std::vector<unsigned char>)> countingValidBlock =
+            [this, &validBlock](std::vector<unsigned char> soln) {
+        solverStats.solutions++;
+        return validBlock(soln);
+    };
+
+    int64_t nStart = GetTimeMicros();
+    solverStats.solves++;
+    bool ret;
+    try {
+        ret = EhOptimisedSolve(n, k, curr_state, countingValidBlock, cancelled, memory);
+    } catch (EhSolverCancelledException&) {
+        solverStats.cancelled++;
+        solverStats.solveTime += GetTimeMicros() - nStart;
+        throw;
+    }
+    solverStats.solveTime += GetTimeMicros() - nStart;
+    solverStats.droppedRows += memory.droppedRows;
+    solverStats.tableBytes = memory.peakTableBytes;
+    solverStats.leafBytes = memory.peakLeafBytes;
+    solverStats.spilled = memory.spilled;
+    solverStats.peakRSS = memory.peakRSS;
+    return ret;
+}
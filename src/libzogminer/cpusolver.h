@@ -0,0 +1,77 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef __CPU_SOLVER_H
+#define __CPU_SOLVER_H
+
+#include "crypto/equihash.h"
+#include "support/allocators/aligned.h"
+#include "uint256.h"
+
+#include <functional>
+#include <vector>
+
+struct EquihashSolverStats
+{
+    /** Nonces the solver was run on, including cancelled runs */
+    uint64_t solves;
+    /** Runs that were cancelled before finishing */
+    uint64_t cancelled;
+    /** Solutions passed to validBlock */
+    uint64_t solutions;
+    /** Time spent in the solver, in microseconds */
+    int64_t solveTime;
+    /** Rows dropped because no memory was left to grow the table, over all runs */
+    uint64_t droppedRows;
+    /** Bytes held by the solver table */
+    size_t tableBytes;
+    /** Bytes of index lists cached while recreating solutions, at their peak */
+    size_t leafBytes;
+    /** Whether the table is backed by a temporary file to fit the memory budget */
+    bool spilled;
+    /** Peak resident set size of the process after the last run */
+    size_t peakRSS;
+
+    EquihashSolverStats() : solves {0}, cancelled {0}, solutions {0}, solveTime {0},
+                            droppedRows {0}, tableBytes {0}, leafBytes {0}, spilled {false},
+                            peakRSS {0} { }
+};
+
+/**
+ * CPU Equihash solver owned by a single miner thread. It keeps the hash
+ * midstate of the current header and the solver table between nonces, so the
+ * table is only allocated and faulted in once per thread.
+ */
+class EquihashSolver
+{
+public:
+    EquihashSolver(unsigned int n, unsigned int k, size_t memoryBudget = 0);
+
+    // The midstate is 64-byte aligned, which plain new does not honour
+    static void* operator new(size_t size) { return aligned_malloc(size, alignof(EquihashSolver)); }
+    static void operator delete(void* p) { aligned_free(p); }
+
+    /** Start work on a header I, given without nonce and solution */
+    void setHeader(const unsigned char* header, size_t header_len);
+    /** Start work on a header I, given as the precomputed midstate H(I||... */
+    void setMidstate(const eh_HashState& state) { midstate = state; }
+    /** Run the solver on H(I||V) for the current header I and nonce V */
+    bool solve(const uint256& nonce,
+               const std::function<bool(std::vector<unsigned char>)> validBlock,
+               const std::function<bool(EhSolverCancelCheck)> cancelled);
+
+    const EquihashSolverStats& stats() const { return solverStats; }
+
+private:
+    unsigned int n;
+    unsigned int k;
+    eh_HashState midstate;
+    EhSolverMemory memory;
+    EquihashSolverStats solverStats;
+
+    EquihashSolver(const EquihashSolver&) = delete;
+    EquihashSolver& operator=(const EquihashSolver&) = delete;
+};
+
+#endif // __CPU_SOLVER_H
@@ -35,6 +35,17 @@ public:
 	int64_t selGPU;
 	unsigned globalWorkSize;
 	unsigned workgroupSize;
+	// Total RAM in bytes the CPU solver threads may use, or 0 for no limit
+	int64_t memoryBudget = 0;
+	// CPU solver threads to run next to the GPU threads when useGPU is set,
+	// or -1 for one per core not feeding a GPU
+	int cpuThreads = 0;
+	// Hash table rows of the OpenCL kernels as a power of two (16, 18, 19 or
+	// 20), or 0 for the kernels' default; fewer rows take less GPU memory
+	unsigned rowsLog = 0;
+	// Cancel a running solve as soon as the chain tip changes, rather than
+	// letting it finish first (node miner only)
+	bool cancelOnNewTip = true;
 
 };
 
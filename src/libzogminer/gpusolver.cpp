@@ -41,7 +41,7 @@ char *s_hexdump(const void *_a, uint32_t a_len)
 	return buf;
 }
 
-GPUSolver::GPUSolver(unsigned platformId, unsigned selGPU) {
+GPUSolver::GPUSolver(unsigned platformId, unsigned selGPU, unsigned rowsLog) {
 
 	/* Notes
 	I've added some extra parameters in this interface to assist with dev, such as
@@ -66,13 +66,14 @@ GPUSolver::GPUSolver(unsigned platformId, unsigned selGPU) {
 	if(indices == NULL)
 		std::cout << "Error allocating indices array!" << std::endl;
 
-	/* Checks each device for memory requirements and sets local/global sizes
-	TODO: Implement device logic for equihash kernel
+	/* Checks the device for memory requirements and sets local/global sizes
 	@params: unsigned platformId
+	@params: unsigned selGPU
 	@params: unsigned localWorkSizes
 	@params: unsigned globalWorkSizes
+	@params: unsigned& rowsLog - Table size, picked to fit the device if 0
 	*/
-	GPU = miner->configureGPU(platformId, local_work_size, global_work_size);
+	GPU = miner->configureGPU(platformId, selGPU, local_work_size, global_work_size, rowsLog);
 	if(!GPU)
 		std::cout << "ERROR: No suitable GPU found! No work will be performed!" << std::endl;
 
@@ -85,7 +86,7 @@ GPUSolver::GPUSolver(unsigned platformId, unsigned selGPU) {
 	*/
 	std::vector<std::string> kernels {"kernel_init_ht", "kernel_round0", "kernel_round1", "kernel_round2","kernel_round3", "kernel_round4", "kernel_round5", "kernel_round6", "kernel_round7", "kernel_round8", "kernel_sols"};
 	if(GPU)
-		initOK = miner->init(platformId, selGPU, kernels);
+		initOK = miner->init(platformId, selGPU, kernels, rowsLog);
 
 }
 
@@ -114,6 +115,13 @@ bool GPUSolver::run(unsigned int n, unsigned int k, uint8_t *header, size_t head
 
 }
 
+std::string GPUSolver::geometry() const {
+
+	unsigned rowsLog = miner->rowsLog();
+	return strprintf("rows=2^%d slots=%d", rowsLog, cl_zogminer::slotsPerRow(rowsLog));
+
+}
+
 bool GPUSolver::GPUSolve200_9(uint8_t *header, size_t header_len, uint64_t nonce,
                  	const std::function<bool(std::vector<unsigned char>)> validBlock,
 			const std::function<bool(GPUSolverCancelCheck)> cancelled,
@@ -127,7 +135,9 @@ bool GPUSolver::GPUSolve200_9(uint8_t *header, size_t header_len, uint64_t nonce
 	if(GPU && initOK) {
         auto t = std::chrono::high_resolution_clock::now();
 		uint64_t ptr;
-    	miner->run(header, header_len, nonce, indices, &n_sol, &ptr);
+    	if (!miner->run(header, header_len, nonce, indices, &n_sol, &ptr,
+    	                [&cancelled]() { return cancelled(ListGenerationGPU); }))
+			throw GPUSolverCancelledException();
 
 		uint256 nNonce = ArithToUint256(ptr);
 			crypto_generichash_blake2b_update(&base_state,
@@ -64,12 +64,15 @@ enum GPUSolverCancelCheck
 class GPUSolver {
 
 public:
-	GPUSolver(unsigned platformId, unsigned selGPU);
+	/// rowsLog sizes the kernels' hash tables, see cl_zogminer::init()
+	GPUSolver(unsigned platformId, unsigned selGPU, unsigned rowsLog = 0);
 	~GPUSolver();
         bool run(unsigned int n, unsigned int k, uint8_t *header, size_t header_len, uint64_t nonce,
 		            const std::function<bool(std::vector<unsigned char>)> validBlock,
 				const std::function<bool(GPUSolverCancelCheck)> cancelled,
 			crypto_generichash_blake2b_state base_state);
+	/// Names the table geometry the kernels were built with, e.g. for audits
+	std::string geometry() const;
 
 private:
 	cl_zogminer * miner;
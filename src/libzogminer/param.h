@@ -5,8 +5,11 @@
 // Approximate log base 2 of number of elements in hash tables
 #define APX_NR_ELMS_LOG                 (PREFIX + 1)
 // Number of rows and slots is affected by this. 20 offers the best performance
-// but occasionally misses ~1% of solutions.
+// but occasionally misses ~1% of solutions. The host may build the kernels
+// with another value, see cl_zogminer::init().
+#ifndef NR_ROWS_LOG
 #define NR_ROWS_LOG                     20
+#endif
 
 // Make hash tables OVERHEAD times larger than necessary to store the average
 // number of elements per row. The ideal value is as small as possible to
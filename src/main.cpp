@@ -15,6 +15,7 @@
 #include "checkqueue.h"
 #include "consensus/validation.h"
 #include "init.h"
+#include "joinsplitcache.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "pow.h"
@@ -61,6 +62,7 @@ bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fCheckBlockSolutions = false;
 bool fCheckpointsEnabled = true;
 bool fCoinbaseEnforcedProtectionEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
@@ -848,7 +850,7 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
     } else {
         // Ensure that zk-SNARKs verify
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, tx.joinSplitPubKey)) {
+            if (!VerifyJoinSplitCached(joinsplit, tx.joinSplitPubKey)) {
                 return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
             }
@@ -1233,6 +1235,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
     }
 
+    // Wake getblocktemplate long polls waiting for new transactions
+    cvBlockChange.notify_all();
+
     SyncWithWallets(tx, NULL);
 
     return true;
@@ -1330,7 +1335,7 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckSolution)
 {
     block.SetNull();
 
@@ -1348,7 +1353,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     }
 
     // Check the header
-    if (!(CheckEquihashSolution(&block, Params()) &&
+    if (!((!fCheckSolution || CheckEquihashSolution(&block, Params())) &&
           CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
@@ -1357,7 +1362,11 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    // The Equihash solution of a header in the block tree was checked when the
+    // header was accepted, and the block hash commits to the solution, so the
+    // check is redundant as long as the block read matches the index.
+    bool fCheckSolution = fCheckBlockSolutions || !pindex->IsValid(BLOCK_VALID_TREE);
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), fCheckSolution))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -1595,6 +1604,11 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CEquihashCheck::operator()() {
+    *pResult = CheckEquihashSolution(pheader, Params()) ? 1 : 0;
+    return true;
+}
+
 bool NonContextualCheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, const Consensus::Params& consensusParams, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
@@ -1959,6 +1973,46 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CEquihashCheck> equihashcheckqueue(16);
+
+void ThreadEquihashCheck() {
+    RenameThread("zcash-eqhcheck");
+    equihashcheckqueue.Thread();
+}
+
+void CheckHeaderSolutions(const std::vector<CBlockHeader>& headers, std::vector<signed char>& vSolution)
+{
+    vSolution.assign(headers.size(), -1);
+    if (!nScriptCheckThreads)
+        return;
+
+    // Stop at the first header that the serial pass in ProcessMessage would
+    // reject before checking its solution; the rest of the batch is dropped
+    // there anyway.
+    std::vector<CEquihashCheck> vChecks;
+    {
+        LOCK(cs_main);
+        uint256 hashPrev;
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
+            uint256 hash = header.GetHash();
+            if (i > 0 && header.hashPrevBlock != hashPrev)
+                break;
+            hashPrev = hash;
+            if (mapBlockIndex.count(hash))
+                continue;
+            CValidationState state;
+            if (!CheckBlockHeader(header, state, true, false))
+                break;
+            vChecks.push_back(CEquihashCheck(header, &vSolution[i]));
+        }
+    }
+
+    CCheckQueueControl<CEquihashCheck> control(&equihashcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2933,10 +2987,10 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW, bool fCheckSolution)
 {
     // Check Equihash solution is valid
-    if (fCheckPOW && !CheckEquihashSolution(&block, Params()))
+    if (fCheckPOW && fCheckSolution && !CheckEquihashSolution(&block, Params()))
         return state.DoS(100, error("CheckBlockHeader(): Equihash solution invalid"),
                          REJECT_INVALID, "invalid-solution");
 
@@ -3108,7 +3162,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckSolution)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -3126,7 +3180,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!CheckBlockHeader(block, state, true, fCheckSolution))
         return false;
 
     // Get prev block index
@@ -4793,6 +4847,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Check the Equihash solutions of the new headers in parallel, without
+        // holding cs_main. The headers are still accepted one by one below,
+        // skipping the solution check for those found valid; a header whose
+        // solution is invalid or was not checked is checked in full there, so
+        // it is rejected with the same DoS score as before.
+        std::vector<signed char> vSolution;
+        CheckHeaderSolutions(headers, vSolution);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -4801,13 +4863,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, &pindexLast, vSolution[n] != 1)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
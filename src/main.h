@@ -118,6 +118,7 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
+extern bool fCheckBlockSolutions;
 extern bool fCheckpointsEnabled;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
@@ -197,6 +198,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the Equihash checking thread */
+void ThreadEquihashCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -392,10 +395,43 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing one Equihash solution verification
+ * Note that this stores a reference to the block header, and writes the
+ * result (1 if valid, 0 if not) to *pResult. It always reports success to
+ * the check queue, so that the rest of the batch is still checked.
+ */
+class CEquihashCheck
+{
+private:
+    const CBlockHeader *pheader;
+    signed char *pResult;
+
+public:
+    CEquihashCheck(): pheader(0), pResult(0) {}
+    CEquihashCheck(const CBlockHeader& headerIn, signed char *pResultIn) : pheader(&headerIn), pResult(pResultIn) { }
+
+    bool operator()();
+
+    void swap(CEquihashCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pResult, check.pResult);
+    }
+};
+
+/**
+ * Check the Equihash solutions of a batch of headers received from a peer,
+ * using the -par worker threads. Only the new headers that follow on from
+ * each other and pass the cheap header checks are checked. vSolution[i] is
+ * set to 1 if the solution of headers[i] is valid, 0 if it is invalid, and -1
+ * if it was not checked (always the case with -par=1).
+ */
+void CheckHeaderSolutions(const std::vector<CBlockHeader>& headers, std::vector<signed char>& vSolution);
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckSolution = true);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
 
@@ -411,7 +447,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
 
 /** Context-independent validity checks */
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true, bool fCheckSolution = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 /** Context-dependent validity checks */
@@ -423,7 +459,7 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
 
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool fCheckSolution = true);
 
 
 
@@ -24,6 +24,7 @@
 #include <functional>
 #endif
 
+#include "libzogminer/cpusolver.h"
 #include "libzogminer/gpusolver.h"
 
 #include "sodium.h"
@@ -63,6 +64,9 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
+// Transactions that may not fit before CreateNewBlock gives up on a nearly full block
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
+
 // We want to sort transactions by priority and fee rate, so:
 typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
 class TxPriorityCompare
@@ -89,6 +93,15 @@ public:
     }
 };
 
+// Scores a mempool transaction for a block at nHeight, prioritisation included
+static TxPriority ScoreMempoolTx(const uint256& hash, const CTxMemPoolEntry& entry, unsigned int nHeight)
+{
+    double dPriority = entry.GetPriority(std::max(nHeight, entry.GetHeight()));
+    CAmount nFee = entry.GetFee();
+    mempool.ApplyDeltas(hash, dPriority, nFee);
+    return TxPriority(dPriority, CFeeRate(nFee, entry.GetTxSize()), &entry.GetTx());
+}
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -143,135 +156,152 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
+
+        // Transactions waiting for parents that are not in the block yet
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // Children whose parents are all in the block, as a priority queue
+        vector<TxPriority> vecReady;
+        // Transactions already taken from the mempool's indexes
+        set<uint256> setConsidered;
+
+        // Collect transactions into block
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
+        int nConsecutiveFailed = 0;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+        TxPriorityCompare comparer(fSortedByFee);
+
+        // The mempool keeps its transactions ordered by priority and by fee
+        // rate, so only as many of them are looked at as it takes to fill
+        // the block
+        mempool.UpdatePriorityIndex(nHeight);
+        CTxMemPoolScoreIndex::const_iterator itIndex = fSortedByFee ? mempool.setByFeeRate.begin() : mempool.setByPriority.begin();
+
+        while (true)
         {
-            const CTransaction& tx = mi->second.GetTx();
+            const CTxMemPoolScoreIndex& index = fSortedByFee ? mempool.setByFeeRate : mempool.setByPriority;
+            while (itIndex != index.end() && setConsidered.count(itIndex->second))
+                ++itIndex;
+
+            // Take the better of the next transaction in the index and the
+            // best child released by a parent that is now in the block
+            TxPriority next;
+            bool fFromIndex = false;
+            if (itIndex != index.end())
+            {
+                next = ScoreMempoolTx(itIndex->second, mempool.mapTx[itIndex->second], nHeight);
+                fFromIndex = vecReady.empty() || !comparer(next, vecReady.front());
+            }
+            if (!fFromIndex)
+            {
+                if (vecReady.empty())
+                    break;
+                next = vecReady.front();
+            }
+            double dPriority = next.get<0>();
+            CFeeRate feeRate = next.get<1>();
+            const CTransaction& tx = *(next.get<2>());
+            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+            // Prioritise by fee once past the priority size or we run out of high-priority
+            // transactions. This one is looked at again in fee rate order.
+            if (!fSortedByFee &&
+                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+            {
+                fSortedByFee = true;
+                comparer = TxPriorityCompare(fSortedByFee);
+                std::make_heap(vecReady.begin(), vecReady.end(), comparer);
+                itIndex = mempool.setByFeeRate.begin();
+                continue;
+            }
 
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
+            const uint256& hash = tx.GetHash();
+            if (fFromIndex)
+            {
+                setConsidered.insert(hash);
+            }
+            else
+            {
+                std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                vecReady.pop_back();
+            }
 
             if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
+            vector<uint256> vParentsPending;
             bool fMissingInputs = false;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                if (view.HaveCoins(txin.prevout.hash))
                     continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
 
-                dPriority += (double)nValueIn * nConf;
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                if (!mempool.mapTx.count(txin.prevout.hash))
+                {
+                    LogPrintf("ERROR: mempool transaction missing input\n");
+                    if (fDebug) assert("mempool transaction missing input" == 0);
+                    fMissingInputs = true;
+                    break;
+                }
+                vParentsPending.push_back(txin.prevout.hash);
             }
             if (fMissingInputs) continue;
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-            if (porphan)
+            if (!vParentsPending.empty())
             {
+                // Has to wait for dependencies
+                vOrphan.push_back(COrphan(&tx));
+                COrphan* porphan = &vOrphan.back();
                 porphan->dPriority = dPriority;
                 porphan->feeRate = feeRate;
+                BOOST_FOREACH(const uint256& hashParent, vParentsPending)
+                {
+                    if (porphan->setDependsOn.insert(hashParent).second)
+                        mapDependers[hashParent].push_back(porphan);
+                }
+                continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
             if (nBlockSize + nTxSize >= nBlockMaxSize)
+            {
+                // Stop once the block is nearly full and nothing more fits
+                if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000)
+                    break;
                 continue;
+            }
 
             // Legacy limits on sigOps:
             unsigned int nTxSigOps = GetLegacySigOpCount(tx);
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            {
+                if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && (unsigned int)nBlockSigOps > MAX_BLOCK_SIGOPS - 100)
+                    break;
                 continue;
+            }
 
             // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
             double dPriorityDelta = 0;
             CAmount nFeeDelta = 0;
             mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
             if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                // Everything after this pays less, so unless some of it has
+                // been prioritised none of it will be added either
+                if (nBlockSize >= nBlockMinSize && mempool.mapDeltas.empty())
+                    break;
+                continue;
             }
 
             if (!view.HaveInputs(tx))
@@ -300,6 +330,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            nConsecutiveFailed = 0;
 
             if (fPrintPriority)
             {
@@ -317,8 +348,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                         porphan->setDependsOn.erase(hash);
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            vecReady.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
+                            std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                         }
                     }
                 }
@@ -396,6 +427,27 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+static std::mutex cs_restartStats;
+static MinerRestartStats restartStats;
+
+void RecordMinerRestart(int64_t nStartLatency, int64_t nSolveLatency)
+{
+    LogPrint("pow", "ZcashMiner: solving on the new tip %.1f ms after it arrived, first solve done after %.1f ms\n",
+             nStartLatency / 1000.0, nSolveLatency / 1000.0);
+    std::lock_guard<std::mutex> lock{cs_restartStats};
+    restartStats.restarts++;
+    restartStats.totalStartLatency += nStartLatency;
+    restartStats.maxStartLatency = std::max(restartStats.maxStartLatency, nStartLatency);
+    restartStats.totalSolveLatency += nSolveLatency;
+    restartStats.maxSolveLatency = std::max(restartStats.maxSolveLatency, nSolveLatency);
+}
+
+MinerRestartStats GetMinerRestartStats()
+{
+    std::lock_guard<std::mutex> lock{cs_restartStats};
+    return restartStats;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -441,7 +493,7 @@ static bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& rese
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet, GPUConfig conf)
+void static BitcoinMiner(CWallet *pwallet, int nThreads, GPUConfig conf)
 {
     LogPrintf("ZcashMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -456,18 +508,26 @@ void static BitcoinMiner(CWallet *pwallet, GPUConfig conf)
     unsigned int k = chainparams.EquihashK();
 
     GPUSolver * solver;
+	std::unique_ptr<EquihashSolver> cpuSolver;
 	if(conf.useGPU)
-    	solver = new GPUSolver(conf.platformId, conf.selGPU);
+    	solver = new GPUSolver(conf.platformId, conf.selGPU, conf.rowsLog);
+	else
+		cpuSolver.reset(new EquihashSolver(n, k, conf.memoryBudget / nThreads));
 
 	uint8_t * tmp_header = (uint8_t *) calloc(ZCASH_BLOCK_HEADER_LEN, sizeof(uint8_t));
 	uint64_t nn= 0;
 
     std::mutex m_cs;
     bool cancelSolver = false;
-    boost::signals2::connection c = uiInterface.NotifyBlockTip.connect(
-        [&m_cs, &cancelSolver](const uint256& hashNewTip) mutable {
+    // When the tip last changed, until a template is built on it
+    int64_t nTipChanged = 0;
+    // Scoped, as the handler refers to this frame
+    boost::signals2::scoped_connection c = uiInterface.NotifyBlockTip.connect(
+        [&m_cs, &cancelSolver, &nTipChanged, &conf](const uint256& hashNewTip) mutable {
             std::lock_guard<std::mutex> lock{m_cs};
-            cancelSolver = true;
+            // Otherwise the stale solve runs to its end before the rebuild
+            cancelSolver = conf.cancelOnNewTip;
+            nTipChanged = GetTimeMicros();
         }
     );
 
@@ -488,6 +548,14 @@ void static BitcoinMiner(CWallet *pwallet, GPUConfig conf)
                 } while (true);
             }
 
+            // This template serves any tip change since the last one
+            int64_t nTipNotified;
+            {
+                std::lock_guard<std::mutex> lock{m_cs};
+                nTipNotified = nTipChanged;
+                nTipChanged = 0;
+            }
+
             //
             // Create new block
             //
@@ -523,6 +591,8 @@ void static BitcoinMiner(CWallet *pwallet, GPUConfig conf)
                 ss << I;
 
 				memcpy(tmp_header, &ss[0], ss.size());
+				if(!conf.useGPU)
+					cpuSolver->setHeader((unsigned char*)&ss[0], ss.size());
 
                 // H(I||...
                 crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
@@ -577,22 +647,32 @@ void static BitcoinMiner(CWallet *pwallet, GPUConfig conf)
                     std::lock_guard<std::mutex> lock{m_cs};
                     return cancelSolver;
                 };
+                int64_t nRunStart = GetTimeMicros();
+                bool found = false;
+                bool completed = false;
                 try {
-                    // If we find a valid block, we rebuild
                     if(!conf.useGPU) {
-                		if (EhOptimisedSolve(n, k, curr_state, validBlock, cancelled)) {
-		                    break;
-		                }
+                		found = cpuSolver->solve(pblock->nNonce, validBlock, cancelled);
 					} else {
-						if (solver->run(n, k, tmp_header, ZCASH_BLOCK_HEADER_LEN, *((uint64_t *)(pblock->nNonce.begin()+sizeof(uint64_t)+4)), validBlock, cancelledGPU, curr_state)) {
-		                    break;
-		                }
+						found = solver->run(n, k, tmp_header, ZCASH_BLOCK_HEADER_LEN, *((uint64_t *)(pblock->nNonce.begin()+sizeof(uint64_t)+4)), validBlock, cancelledGPU, curr_state);
 					}
+                    completed = true;
+                } catch (EhSolverCancelledException&) {
+                    LogPrint("pow", "Equihash solver cancelled\n");
+                    std::lock_guard<std::mutex> lock{m_cs};
+                    cancelSolver = false;
                 } catch (GPUSolverCancelledException&) {
                     LogPrint("pow", "Equihash solver cancelled\n");
                     std::lock_guard<std::mutex> lock{m_cs};
                     cancelSolver = false;
                 }
+                if (completed && nTipNotified) {
+                    RecordMinerRestart(nRunStart - nTipNotified, GetTimeMicros() - nTipNotified);
+                    nTipNotified = 0;
+                }
+                // If we find a valid block, we rebuild
+                if (found)
+                    break;
 
                 // Check for stop or if block needs to be rebuilt
                 boost::this_thread::interruption_point();
@@ -677,6 +757,12 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads, GPUConfig
             nThreads = Params().DefaultMinerThreads();
         else
             nThreads = boost::thread::hardware_concurrency();
+
+        if (!conf.useGPU && conf.memoryBudget > 0) {
+            // Run no more threads than can keep their tables in RAM
+            size_t solverBytes = EhOptimisedSolveMemoryBytes(Params().EquihashN(), Params().EquihashK());
+            nThreads = std::max(1, std::min(nThreads, (int)(conf.memoryBudget / solverBytes)));
+        }
     }
 
     if (minerThreads != NULL)
@@ -691,7 +777,7 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads, GPUConfig
 
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet, conf));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet, nThreads, conf));
 }
 
 #endif // ENABLE_WALLET
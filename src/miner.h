@@ -25,6 +25,23 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
+/**
+ * How quickly the miner threads moved to new chain tips: from NotifyBlockTip
+ * to the first solver run on a template built on the new tip starting, and
+ * completing. Latencies are in microseconds.
+ */
+struct MinerRestartStats
+{
+    uint64_t restarts;
+    int64_t totalStartLatency;
+    int64_t maxStartLatency;
+    int64_t totalSolveLatency;
+    int64_t maxSolveLatency;
+
+    MinerRestartStats() : restarts(0), totalStartLatency(0), maxStartLatency(0),
+                          totalSolveLatency(0), maxSolveLatency(0) {}
+};
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads, GPUConfig conf);
@@ -34,5 +51,8 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+/** Record a miner thread's move to a new tip */
+void RecordMinerRestart(int64_t nStartLatency, int64_t nSolveLatency);
+MinerRestartStats GetMinerRestartStats();
 
 #endif // BITCOIN_MINER_H
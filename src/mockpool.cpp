@@ -0,0 +1,147 @@
+// Copyright (c) 2016 Jack Grigg <jack@z.cash>
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "libstratum/MockPool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include "sodium.h"
+
+#include <atomic>
+#include <csignal>
+#include <iostream>
+
+static std::atomic<bool> fRequestShutdown {false};
+extern "C" void mockpool_sigint_handler(int signum) { fRequestShutdown = true; }
+
+static std::string HelpMessageMockPool()
+{
+    std::string strUsage;
+    strUsage += HelpMessageGroup(_("Options:"));
+    strUsage += HelpMessageOpt("-?", _("This help message"));
+    strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for miners on 127.0.0.1:<port> (default: %u)"), 3333));
+    strUsage += HelpMessageOpt("-nonce1=<hex>", strprintf(_("Extranonce given to miners (default: %s)"), "00000000"));
+    strUsage += HelpMessageOpt("-target=<hex>", _("Share target (default: accept any share)"));
+    strUsage += HelpMessageOpt("-validate", strprintf(_("Check shares before accepting them (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-responsedelay=<ms>", strprintf(_("Delay answers to mining.submit (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-notifyinterval=<ms>", strprintf(_("Send a new job every <ms> milliseconds, 0 = once (default: %u)"), 30000));
+    strUsage += HelpMessageOpt("-reconnectinterval=<ms>", strprintf(_("Send client.reconnect every <ms> milliseconds (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-dropinterval=<ms>", strprintf(_("Drop every client every <ms> milliseconds (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-replay=<file>", _("Replay the pool side of a trace written by zcash-miner -stratumtrace"));
+    strUsage += HelpMessageOpt("-replayspeed=<n>", strprintf(_("Replay <n> times faster than recorded (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-statsinterval=<s>", strprintf(_("Print statistics every <s> seconds (default: %u)"), 10));
+
+    strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
+    strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
+        _("If <category> is not supplied, output all debugging information.") + " " + _("<category> can be:") + " stratum.");
+    strUsage += HelpMessageOpt("-printtoconsole", _("Send trace/debug info to console instead of debug.log file"));
+    strUsage += HelpMessageOpt("-regtest", _("Validate shares for the regression test network"));
+    strUsage += HelpMessageOpt("-testnet", _("Validate shares for the test network"));
+
+    return strUsage;
+}
+
+static void PrintStats(MockStratumPool& pool)
+{
+    MockPoolStats stats = pool.stats();
+    std::cout << strprintf("clients %d, jobs %d, shares %d (accepted %d, rejected %d, stale %.1f%%)",
+                           pool.clients(), stats.notifies, stats.submits,
+                           stats.accepted, stats.rejected,
+                           stats.submits ? 100.0 * stats.stale / stats.submits : 0.0);
+    if (stats.firstShares) {
+        std::cout << strprintf(", first share after %dms avg, %dms max",
+                               stats.totalFirstShareLatency / stats.firstShares,
+                               stats.maxFirstShareLatency);
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+
+    if (mapArgs.count("-?") || mapArgs.count("-h") ||
+        mapArgs.count("-help") || mapArgs.count("-version")) {
+        std::string strUsage = _("Zcash Mock Pool") + " " +
+                               _("version") + " " + FormatFullVersion() + "\n";
+
+        if (!mapArgs.count("-version")) {
+            strUsage += "\n" + _("Usage:") + "\n" +
+                  "  zcash-mockpool [options]                  " + _("Start a local Stratum pool for testing miners") + "\n";
+
+            strUsage += "\n" + HelpMessageMockPool();
+        }
+
+        std::cout << strUsage;
+        return 1;
+    }
+
+    fDebug = !mapMultiArgs["-debug"].empty();
+    fPrintToConsole = GetBoolArg("-printtoconsole", false);
+
+    if (!SelectParamsFromCommandLine()) {
+        std::cerr << "Error: Invalid combination of -regtest and -testnet." << std::endl;
+        return 1;
+    }
+
+    if (init_and_check_sodium() == -1) {
+        return 1;
+    }
+
+    std::unique_ptr<MockStratumPool> pool;
+    try {
+        pool.reset(new MockStratumPool(GetArg("-port", 3333), GetArg("-nonce1", "00000000")));
+    } catch (const boost::system::system_error& e) {
+        std::cerr << "Error: Could not listen on port " << GetArg("-port", 3333)
+                  << ": " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Listening on 127.0.0.1:" << pool->port() << std::endl;
+
+    pool->setValidate(GetBoolArg("-validate", false));
+    pool->setResponseDelay(GetArg("-responsedelay", 0));
+    if (mapArgs.count("-target")) {
+        pool->setTarget(GetArg("-target", ""));
+    }
+
+    if (mapArgs.count("-replay")) {
+        double speed = atof(GetArg("-replayspeed", "1").c_str());
+        if (speed <= 0 || !pool->replay(GetArg("-replay", ""), speed)) {
+            std::cerr << "Error: Could not replay " << GetArg("-replay", "") << std::endl;
+            return 1;
+        }
+    } else {
+        pool->notify();
+        pool->notifyEvery(GetArg("-notifyinterval", 30000));
+    }
+
+    signal(SIGINT, mockpool_sigint_handler);
+
+    int64_t nReconnectInterval = GetArg("-reconnectinterval", 0);
+    int64_t nDropInterval = GetArg("-dropinterval", 0);
+    int64_t nStatsInterval = GetArg("-statsinterval", 10) * 1000;
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastReconnect = nStart, nLastDrop = nStart, nLastStats = nStart;
+    while (!fRequestShutdown) {
+        MilliSleep(100);
+        int64_t nNow = GetTimeMillis();
+        if (nReconnectInterval > 0 && nNow - nLastReconnect >= nReconnectInterval) {
+            pool->requestReconnect("127.0.0.1", pool->port());
+            nLastReconnect = nNow;
+        }
+        if (nDropInterval > 0 && nNow - nLastDrop >= nDropInterval) {
+            pool->dropClients();
+            nLastDrop = nNow;
+        }
+        if (nStatsInterval > 0 && nNow - nLastStats >= nStatsInterval) {
+            PrintStats(*pool);
+            nLastStats = nNow;
+        }
+    }
+
+    PrintStats(*pool);
+    return 0;
+}
@@ -16,6 +16,10 @@
 
 #include "sodium.h"
 
+#include <algorithm>
+
+#include <boost/thread.hpp>
+
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
@@ -77,7 +81,7 @@ unsigned int CalculateNextWorkRequired(arith_uint256 bnAvg,
     return bnNew.GetCompact();
 }
 
-bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
+static bool IsValidEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
 {
     unsigned int n = params.EquihashN();
     unsigned int k = params.EquihashK();
@@ -98,12 +102,50 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& param
 
     bool isValid;
     EhIsValidSolution(n, k, state, pblock->nSolution, isValid);
-    if (!isValid)
+    return isValid;
+}
+
+bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
+{
+    if (!IsValidEquihashSolution(pblock, params))
         return error("CheckEquihashSolution(): invalid solution");
 
     return true;
 }
 
+bool CheckEquihashSolutions(const std::vector<CBlockHeader>& headers, const CChainParams& params,
+                            std::vector<bool>& valid, int nThreads)
+{
+    // One byte per header, so that threads never write to the same word
+    std::vector<unsigned char> results(headers.size(), 0);
+    auto checkRange = [&headers, &params, &results](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            results[i] = IsValidEquihashSolution(&headers[i], params);
+        }
+    };
+
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, (int)headers.size()));
+    size_t chunk = (headers.size() + nThreads - 1) / nThreads;
+
+    boost::thread_group threads;
+    for (int t = 1; t < nThreads; t++) {
+        threads.create_thread(boost::bind<void>(checkRange,
+                                                std::min(t*chunk, headers.size()),
+                                                std::min((t+1)*chunk, headers.size())));
+    }
+    checkRange(0, std::min(chunk, headers.size()));
+    threads.join_all();
+
+    valid.assign(results.begin(), results.end());
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (!valid[i])
+            return error("CheckEquihashSolutions(): invalid solution in header %d", i);
+    }
+    return true;
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
 {
     bool fNegative;
@@ -9,6 +9,7 @@
 #include "consensus/params.h"
 
 #include <stdint.h>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
@@ -23,6 +24,13 @@ unsigned int CalculateNextWorkRequired(arith_uint256 bnAvg,
 
 /** Check whether the Equihash solution in a block header is valid */
 bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams&);
+/**
+ * Check the Equihash solutions of a batch of headers, spread over nThreads
+ * threads (one per core if nThreads <= 0). valid is set to the result for each
+ * header; returns true if all of them are valid.
+ */
+bool CheckEquihashSolutions(const std::vector<CBlockHeader>& headers, const CChainParams&,
+                            std::vector<bool>& valid, int nThreads = 0);
 
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
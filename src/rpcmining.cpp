@@ -14,6 +14,7 @@
 #include "miner.h"
 #include "net.h"
 #include "pow.h"
+#include "random.h"
 #include "rpcserver.h"
 #include "util.h"
 #include "validationinterface.h"
@@ -21,6 +22,8 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <limits>
+#include <list>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -273,6 +276,13 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "  \"chain\": \"xxxx\",         (string) current network name as defined in BIP70 (main, test, regtest)\n"
+            "  \"restarts\": {              (object) How quickly the miner threads moved to new chain tips\n"
+            "    \"count\": n,              (numeric) Tip changes followed by a completed solve on the new tip\n"
+            "    \"avgstartlatency\": n,    (numeric) Average ms from the tip change to solving on it\n"
+            "    \"maxstartlatency\": n,    (numeric) Longest such time, ms\n"
+            "    \"avgsolvelatency\": n,    (numeric) Average ms from the tip change to the first solve on it completing\n"
+            "    \"maxsolvelatency\": n     (numeric) Longest such time, ms\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmininginfo", "")
@@ -293,6 +303,14 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
+    MinerRestartStats restartStats = GetMinerRestartStats();
+    Object restarts;
+    restarts.push_back(Pair("count",           restartStats.restarts));
+    restarts.push_back(Pair("avgstartlatency", restartStats.restarts ? restartStats.totalStartLatency / 1000.0 / restartStats.restarts : 0));
+    restarts.push_back(Pair("maxstartlatency", restartStats.maxStartLatency / 1000.0));
+    restarts.push_back(Pair("avgsolvelatency", restartStats.restarts ? restartStats.totalSolveLatency / 1000.0 / restartStats.restarts : 0));
+    restarts.push_back(Pair("maxsolvelatency", restartStats.maxSolveLatency / 1000.0));
+    obj.push_back(Pair("restarts",         restarts));
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
 #endif
@@ -351,6 +369,69 @@ static Value BIP22ValidationResult(const CValidationState& state)
     return "valid?";
 }
 
+// What getblocktemplate hands out for its current template. The JSON of the
+// transactions is built once and shared by every caller until the template
+// changes. The transaction lists of recent templates are kept by workid, so a
+// caller can ask for only what changed since one of them. All of it is
+// guarded by cs_main.
+static Array templateTransactions;
+static std::vector<std::string> vTemplateTxHex;
+static std::string strTemplateWorkId;
+static std::list<std::pair<std::string, std::vector<uint256> > > recentTemplates;
+static const size_t MAX_RECENT_TEMPLATES = 16;
+
+// One "transactions" entry for the template's nIndex'th transaction, where
+// mapTxIndex gives the 1-based position of each one in the list it goes in
+static Object TemplateTxEntry(const CBlockTemplate& tmpl, size_t nIndex, const map<uint256, int64_t>& mapTxIndex)
+{
+    const CTransaction& tx = tmpl.block.vtx[nIndex];
+    Object entry;
+
+    entry.push_back(Pair("data", vTemplateTxHex[nIndex]));
+
+    entry.push_back(Pair("hash", tx.GetHash().GetHex()));
+
+    Array deps;
+    BOOST_FOREACH (const CTxIn &in, tx.vin)
+    {
+        map<uint256, int64_t>::const_iterator it = mapTxIndex.find(in.prevout.hash);
+        if (it != mapTxIndex.end())
+            deps.push_back(it->second);
+    }
+    entry.push_back(Pair("depends", deps));
+
+    entry.push_back(Pair("fee", tmpl.vTxFees[nIndex]));
+    entry.push_back(Pair("sigops", tmpl.vTxSigOps[nIndex]));
+    return entry;
+}
+
+// Builds the shared JSON for a new template and gives it a workid
+static void CacheTemplateTransactions(const CBlockTemplate& tmpl)
+{
+    static const uint32_t nWorkIdBase = GetRand(std::numeric_limits<uint32_t>::max());
+    static uint64_t nTemplates = 0;
+
+    const std::vector<CTransaction>& vtx = tmpl.block.vtx;
+    map<uint256, int64_t> mapTxIndex;
+    std::vector<uint256> vHashes;
+    vTemplateTxHex.assign(vtx.size(), std::string());
+    templateTransactions.clear();
+    for (size_t i = 1; i < vtx.size(); i++)
+    {
+        vTemplateTxHex[i] = EncodeHexTx(vtx[i]);
+        templateTransactions.push_back(TemplateTxEntry(tmpl, i, mapTxIndex));
+        mapTxIndex[vtx[i].GetHash()] = i;
+        vHashes.push_back(vtx[i].GetHash());
+    }
+
+    // Unique across restarts too, so a stale workid is never mistaken for
+    // one of this run's
+    strTemplateWorkId = strprintf("%08x%x", nWorkIdBase, ++nTemplates);
+    recentTemplates.push_front(std::make_pair(strTemplateWorkId, vHashes));
+    if (recentTemplates.size() > MAX_RECENT_TEMPLATES)
+        recentTemplates.pop_back();
+}
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -367,7 +448,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
-            "         ]\n"
+            "         ],\n"
+            "       \"workid\":\"xxxx\"      (string, optional) The workid of an earlier template. If the node still has it,\n"
+            "                                 only the transactions added since are sent, along with those removed\n"
             "     }\n"
             "\n"
 
@@ -406,6 +489,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) compressed target of next block\n"
             "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"workid\" : \"xxxx\",              (string) Identifies the template's transactions, for later delta requests\n"
+            "  \"deltafrom\" : \"xxxx\",           (string) Only for a delta: the workid it is relative to. The transactions are then\n"
+            "                                     those of that template, less \"removed\", followed by \"transactions\", and\n"
+            "                                     \"depends\" counts over that list\n"
+            "  \"removed\" : [ \"xxxx\", ... ]      (array of string) Only for a delta: hashes of the transactions that are no longer in the template\n"
             "}\n"
 
             "\nExamples:\n"
@@ -416,6 +504,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     LOCK(cs_main);
 
     std::string strMode = "template";
+    std::string strDeltaWorkId;
     Value lpval = Value::null;
     if (params.size() > 0)
     {
@@ -430,6 +519,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
         lpval = find_value(oparam, "longpollid");
+        const Value& workidval = find_value(oparam, "workid");
+        if (workidval.type() == str_type)
+            strDeltaWorkId = workidval.get_str();
 
         if (strMode == "proposal")
         {
@@ -475,7 +567,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     if (lpval.type() != null_type)
     {
-        // Wait to respond until either the best block changes, OR a minute has passed and there are more transactions
+        // Wait to respond until either the best block changes, OR -longpolltxdelay has passed and there are more transactions
         uint256 hashWatchedChain;
         boost::system_time checktxtime;
         unsigned int nTransactionsUpdatedLastLP;
@@ -495,21 +587,26 @@ Value getblocktemplate(const Array& params, bool fHelp)
             nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
         }
 
-        // Release the wallet and main lock while waiting
+        // Release the wallet and main lock while waiting. New tips and new
+        // mempool transactions both notify cvBlockChange, so the wait ends as
+        // soon as there is something to send.
         LEAVE_CRITICAL_SECTION(cs_main);
         {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+            checktxtime = boost::get_system_time() + boost::posix_time::seconds(GetArg("-longpolltxdelay", 60));
 
             boost::unique_lock<boost::mutex> lock(csBestBlock);
             while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
             {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
-                {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
-                        break;
-                    checktxtime += boost::posix_time::seconds(10);
-                }
+                if (boost::get_system_time() >= checktxtime &&
+                    mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                    break;
+                // Notifications are sent without csBestBlock held, so look
+                // again every second in case one came before this wait, and
+                // at checktxtime itself
+                boost::system_time waittime = boost::get_system_time() + boost::posix_time::seconds(1);
+                if (checktxtime > boost::get_system_time())
+                    waittime = std::min(checktxtime, waittime);
+                cvBlockChange.timed_wait(lock, waittime);
             }
         }
         ENTER_CRITICAL_SECTION(cs_main);
@@ -545,6 +642,8 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
+        CacheTemplateTransactions(*pblocktemplate);
+
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
     }
@@ -554,38 +653,46 @@ Value getblocktemplate(const Array& params, bool fHelp)
     UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
     pblock->nNonce = uint256();
 
-    static const Array aCaps = boost::assign::list_of("proposal");
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
+    static const Array aCaps = boost::assign::list_of("proposal")("delta");
 
-        Object entry;
+    // Only what changed since a template the caller still has, if we do too
+    std::list<std::pair<std::string, std::vector<uint256> > >::const_iterator itBase = recentTemplates.begin();
+    while (itBase != recentTemplates.end() && itBase->first != strDeltaWorkId)
+        ++itBase;
+    bool fDelta = !strDeltaWorkId.empty() && itBase != recentTemplates.end();
 
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
+    Array removed;
+    Array delta;
+    if (fDelta)
+    {
+        set<uint256> setTemplate;
+        BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
+            setTemplate.insert(tx.GetHash());
+
+        // The caller's list keeps the transactions still in the template, in
+        // their order, and the new ones follow
+        map<uint256, int64_t> mapTxIndex;
+        set<uint256> setBase;
+        BOOST_FOREACH (const uint256& hash, itBase->second)
         {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
+            setBase.insert(hash);
+            if (setTemplate.count(hash))
+            {
+                int64_t nIndex = mapTxIndex.size() + 1;
+                mapTxIndex[hash] = nIndex;
+            }
+            else
+                removed.push_back(hash.GetHex());
+        }
+        for (size_t i = 1; i < pblock->vtx.size(); i++)
+        {
+            const uint256& hash = pblock->vtx[i].GetHash();
+            if (setBase.count(hash))
+                continue;
+            delta.push_back(TemplateTxEntry(*pblocktemplate, i, mapTxIndex));
+            int64_t nIndex = mapTxIndex.size() + 1;
+            mapTxIndex[hash] = nIndex;
         }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
     }
 
     Object aux;
@@ -605,7 +712,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("capabilities", aCaps));
     result.push_back(Pair("version", pblock->nVersion));
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("transactions", fDelta ? delta : templateTransactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
     result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
@@ -618,6 +725,12 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", pblock->GetBlockTime()));
     result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("workid", strTemplateWorkId));
+    if (fDelta)
+    {
+        result.push_back(Pair("deltafrom", strDeltaWorkId));
+        result.push_back(Pair("removed", removed));
+    }
 
     return result;
 }
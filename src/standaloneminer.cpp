@@ -25,6 +25,7 @@
 #include "arith_uint256.h"
 #include "chainparams.h"
 #include "crypto/equihash.h"
+#include "libstratum/MinerApi.h"
 #include "libstratum/StratumClient.h"
 #include "primitives/block.h"
 #include "serialize.h"
@@ -33,6 +34,8 @@
 #include "utiltime.h"
 #include "version.h"
 
+#include "libzogminer/benchmark.h"
+#include "libzogminer/cpusolver.h"
 #include "libzogminer/gpusolver.h"
 #include "libzogminer/gpuconfig.h"
 #include "libzogminer/cl_zogminer.h"
@@ -40,7 +43,13 @@
 #include "sodium.h"
 
 #include <csignal>
+#include <fstream>
 #include <iostream>
+#include <memory>
+
+#include <boost/algorithm/string.hpp>
+
+#include "json/json_spirit_writer_template.h"
 
 static uint64_t rdtsc(void) {
 #ifdef _MSC_VER
@@ -65,13 +74,36 @@ std::string HelpMessageMiner()
     string strUsage;
     strUsage += HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("This help message"));
+    strUsage += HelpMessageOpt("-equihashmem=<n>", strprintf(_("Limit the RAM used by the CPU solver threads to <n> MiB, backing larger tables with temporary files (0 = no limit, default: %u)"), 0));
 
     strUsage += HelpMessageGroup(_("Mining pool options:"));
-    strUsage += HelpMessageOpt("-stratum=<url>", _("Mine on the Stratum server at <url>"));
+    strUsage += HelpMessageOpt("-stratum=<url>", _("Mine on the Stratum server at <url>. Can be specified multiple times, in order of priority; "
+                                                   "the next pool is kept connected as a standby"));
     strUsage += HelpMessageOpt("-user=<user>",
                                strprintf(_("Username for Stratum server (default: %u)"), "x"));
     strUsage += HelpMessageOpt("-password=<pw>",
                                strprintf(_("Password for Stratum server (default: %u)"), "x"));
+    strUsage += HelpMessageOpt("-sharecheck=<n>",
+                               strprintf(_("Check 1 in <n> shares against their job before submitting them, 0 = never (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-sharecheckthreads=<n>",
+                               strprintf(_("Number of threads checking shares (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-maxsharerate=<n>", strprintf(_("Submit about <n> shares per minute at most, mining to a stricter target than the pool's "
+                                                                "and asking it to raise its difficulty when needed, 0 = no limit (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-worktimeout=<s>", strprintf(_("Drop the connection to a Stratum server that sends no new work for <s> seconds, 0 = never (default: %u)"), 180));
+    strUsage += HelpMessageOpt("-stratumtrace=<file>", _("Append the messages exchanged with the Stratum server to <file>, for replaying with zcash-mockpool"));
+
+    strUsage += HelpMessageGroup(_("Monitoring options:"));
+    strUsage += HelpMessageOpt("-api", strprintf(_("Report the miner's state as JSON over HTTP on 127.0.0.1 (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-apiport=<port>", strprintf(_("Listen for API requests on <port> (default: %u)"), 4028));
+    strUsage += HelpMessageOpt("-apicontrol", strprintf(_("Allow API calls that change devices, pools and limits (default: %u)"), 0));
+
+    strUsage += HelpMessageOpt("-solutionaudit=<n>", strprintf(_("Check the solutions of 1 in <n> solver runs against the reference solver in the background, "
+                                                                 "reporting missed, invalid and duplicate solutions; needs several GiB of RAM, 0 = never (default: %u)"), 0));
+
+    strUsage += HelpMessageGroup(_("Benchmark options:"));
+    strUsage += HelpMessageOpt("-benchmark=<n>", strprintf(_("Solve the first <n> of a fixed set of headers and nonces with each solver and print the results as JSON (default: %u)"), 8));
+    strUsage += HelpMessageOpt("-benchmarkengines=<list>", strprintf(_("Comma-separated solvers to benchmark (default: %s)"), "optimised,basic,gpu,opencl-cpu"));
+    strUsage += HelpMessageOpt("-benchmarkfile=<file>", _("Write the benchmark results to <file> instead of standard output"));
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
     string debugCategories = "cycles, pow, stratum"; // Don't translate these
@@ -84,7 +116,13 @@ std::string HelpMessageMiner()
 	strUsage += HelpMessageOpt("-G", _("GPU mine"));
 	strUsage += HelpMessageOpt("-P=<platformid>", _("Select OpenCL platform (default: 0)"));
 	strUsage += HelpMessageOpt("-S=<deviceid>", _("Select GPU device (default: 0)"));
-	strUsage += HelpMessageOpt("-listdevices", _("List available OpenCL devices"));
+	strUsage += HelpMessageOpt("-cputhreads=<n>", strprintf(_("With -G, also mine with <n> low-priority CPU solver threads (-1 = one per core not feeding a GPU, default: %u)"), 0));
+	strUsage += HelpMessageOpt("-intensity=<n>", strprintf(_("Solve <n> percent of the time and idle for the rest, to keep the devices within a power or temperature budget (1-100, default: %u)"), 100));
+	strUsage += HelpMessageOpt("-gpurows=<n>", _("Build the OpenCL kernels with 2^<n> hash table rows, 16, 18, 19 or 20; fewer rows need less GPU memory but lose more solutions "
+	                                             "(default: the largest that fits the device)"));
+	strUsage += HelpMessageOpt("-gpureserve=<n>", strprintf(_("Leave <n> MiB of GPU memory free for other uses when sizing the hash tables (default: %u)"), 0));
+	strUsage += HelpMessageOpt("-gpulatency=<ms>", strprintf(_("Keep a display on the GPU responsive by pausing it after every <ms> of kernel work, at some cost in Sol/s (0 = off, default: %u)"), 0));
+	strUsage += HelpMessageOpt("-listdevices", _("List available OpenCL devices and the hash table sizes that fit them"));
 
     return strUsage;
 }
@@ -107,8 +145,11 @@ void test_mine(int n, int k, uint32_t d, GPUConfig conf)
     pblock.nBits = d;
     arith_uint256 hashTarget = arith_uint256().SetCompact(d);
 	GPUSolver * solver;
+	std::unique_ptr<EquihashSolver> cpuSolver;
 	if(conf.useGPU)
-    	solver = new GPUSolver(conf.platformId, conf.selGPU);
+    	solver = new GPUSolver(conf.platformId, conf.selGPU, conf.rowsLog);
+	else
+		cpuSolver.reset(new EquihashSolver(n, k, conf.memoryBudget));
 
 	uint64_t nn= 0;
 	//TODO Free
@@ -127,6 +168,8 @@ void test_mine(int n, int k, uint32_t d, GPUConfig conf)
 		
 		//std::cout << "ss size: "<< ss.size() << std::endl;
 		memcpy(header, &ss[0], ss.size());
+		if(!conf.useGPU)
+			cpuSolver->setHeader((unsigned char*)&ss[0], ss.size());
         // H(I||...
         crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
 
@@ -182,7 +225,7 @@ void test_mine(int n, int k, uint32_t d, GPUConfig conf)
                 uint64_t solve_start = rdtsc();
 				bool foundBlock;
 				if(!conf.useGPU)
-                	foundBlock = EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
+                	foundBlock = cpuSolver->solve(pblock.nNonce, validBlock, cancelled);
 				else
 					foundBlock = solver->run(n, k, header, ZCASH_BLOCK_HEADER_LEN - ZCASH_NONCE_LEN, nn++, validBlock, cancelledGPU, curr_state);
                     uint64_t solve_end = rdtsc();
@@ -210,6 +253,57 @@ void test_mine(int n, int k, uint32_t d, GPUConfig conf)
 
 }
 
+static bool ParseStratumURL(const std::string& stratum, std::string& host, std::string& port)
+{
+    if (stratum.compare(0, 14, "stratum+tcp://") != 0) {
+        std::cerr << "Error: -stratum must be a stratum+tcp:// URL." << std::endl;
+        return false;
+    }
+
+    std::string stratumServer = stratum.substr(14);
+    size_t delim = stratumServer.find(':');
+    if (delim != std::string::npos) {
+        host = stratumServer.substr(0, delim);
+        port = stratumServer.substr(delim+1);
+    }
+    if (host.empty() || port.empty()) {
+        std::cerr << "Error: -stratum must contain a host and port." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static int RunBenchmark(const GPUConfig& conf)
+{
+    int count = GetArg("-benchmark", 0);
+    if (count <= 0) {
+        count = 8;
+    }
+    std::vector<std::string> engines;
+    std::string list = GetArg("-benchmarkengines", "");
+    if (list.empty()) {
+        engines = BENCHMARK_ENGINES;
+    } else {
+        boost::split(engines, list, boost::is_any_of(","));
+    }
+
+    // Kernel build messages go to standard output, so the results can be sent elsewhere
+    json_spirit::Object report = RunSolverBenchmark(Params().EquihashN(), Params().EquihashK(),
+                                                    count, engines, conf);
+    std::string results = json_spirit::write_string(json_spirit::Value(report), true) + "\n";
+    if (mapArgs.count("-benchmarkfile")) {
+        std::ofstream file(GetArg("-benchmarkfile", ""));
+        file << results;
+        if (!file) {
+            std::cerr << "Error: Could not write " << GetArg("-benchmarkfile", "") << std::endl;
+            return 1;
+        }
+    } else {
+        std::cout << results;
+    }
+    return 0;
+}
+
 static ZcashStratumClient* scSig;
 extern "C" void stratum_sigint_handler(int signum) {if (scSig) scSig->disconnect();}
 
@@ -236,6 +330,7 @@ int main(int argc, char* argv[])
         return 1;
     }
 	
+	cl_zogminer::setExtraRequiredGPUMem((uint64_t)std::max<int64_t>(0, GetArg("-gpureserve", 0)) << 20);
 	if(GetBoolArg("-listdevices", false)) {
 		//Generic Things
 
@@ -251,6 +346,14 @@ int main(int argc, char* argv[])
 	conf.useGPU = GetBoolArg("-G", false);
 	conf.selGPU = GetArg("-S", 0);
 	conf.platformId = GetArg("-P", 0);
+	conf.memoryBudget = GetArg("-equihashmem", 0) << 20;
+	conf.cpuThreads = GetArg("-cputhreads", 0);
+	conf.rowsLog = GetArg("-gpurows", 0);
+	if (conf.rowsLog && !cl_zogminer::supportsRows(conf.rowsLog)) {
+		std::cerr << "Error: -gpurows must be 16, 18, 19 or 20." << std::endl;
+		return 1;
+	}
+	cl_zogminer::setMSPerBatch(std::max<int64_t>(0, GetArg("-gpulatency", 0)));
 	//std::cout << GPU << " " << selGPU << std::endl;
 
     // Zcash debugging
@@ -272,41 +375,62 @@ int main(int argc, char* argv[])
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Zcash Miner version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);		
 
+    if (mapArgs.count("-benchmark")) {
+        return RunBenchmark(conf);
+    }
+
     // Start the mining operation
 	
 
     std::string stratum = GetArg("-stratum", "");
     if (!stratum.empty() || GetBoolArg("-stratum", false)) {
-        if (stratum.compare(0, 14, "stratum+tcp://") != 0) {
-            std::cerr << "Error: -stratum must be a stratum+tcp:// URL." << std::endl;
-            return false;
-        }
-
-        std::string host;
-        std::string port;
-        std::string stratumServer = stratum.substr(14);
-        size_t delim = stratumServer.find(':');
-        if (delim != std::string::npos) {
-            host = stratumServer.substr(0, delim);
-            port = stratumServer.substr(delim+1);
+        std::vector<std::string> pools = mapMultiArgs["-stratum"];
+        if (pools.empty()) {
+            pools.push_back(stratum);
         }
-        if (host.empty() || port.empty()) {
-            std::cerr << "Error: -stratum must contain a host and port." << std::endl;
-            return false;
+        std::vector<std::string> hosts(pools.size());
+        std::vector<std::string> ports(pools.size());
+        for (size_t i = 0; i < pools.size(); i++) {
+            if (!ParseStratumURL(pools[i], hosts[i], ports[i])) {
+                return false;
+            }
         }
 
         ZcashMiner miner(GetArg("-genproclimit", 1), conf);
+        miner.setMaxShareRate(atof(GetArg("-maxsharerate", "0").c_str()));
+        miner.setSolutionAudit(std::max<int64_t>(0, GetArg("-solutionaudit", 0)));
+        miner.setIntensity(GetArg("-intensity", 100));
         ZcashStratumClient sc {
-            &miner, host, port,
+            &miner, hosts[0], ports[0],
             GetArg("-user", "x"),
             GetArg("-password", "x"),
-            0, 0
+            0, (int)std::max<int64_t>(0, GetArg("-worktimeout", 180))
         };
+        for (size_t i = 1; i < pools.size(); i++) {
+            sc.addPool(hosts[i], ports[i], GetArg("-user", "x"), GetArg("-password", "x"));
+        }
+        sc.setShareCheck(GetArg("-sharecheckthreads", 1), GetArg("-sharecheck", 1));
+        if (mapArgs.count("-stratumtrace")) {
+            sc.setTrace(GetArg("-stratumtrace", ""));
+        }
 
         miner.onSolutionFound([&](const EquihashSolution& solution) {
             return sc.submit(&solution);
         });
 
+        std::unique_ptr<MinerApiServer> api;
+        if (GetBoolArg("-api", false) || mapArgs.count("-apiport")) {
+            try {
+                api.reset(new MinerApiServer(&miner, &sc, GetArg("-apiport", 4028),
+                                             GetBoolArg("-apicontrol", false)));
+            } catch (const boost::system::system_error& e) {
+                std::cerr << "Error: Could not start the API on port " << GetArg("-apiport", 4028)
+                          << ": " << e.what() << std::endl;
+                sc.disconnect();
+                return 1;
+            }
+        }
+
         scSig = &sc;
         signal(SIGINT, stratum_sigint_handler);
 
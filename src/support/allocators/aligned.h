@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
+#define BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+/**
+ * Allocate size bytes aligned to align, which must be a power of two.
+ * Before C++17, new and std::allocator only align to alignof(max_align_t),
+ * which is less than types such as eh_HashState are declared with.
+ */
+inline void* aligned_malloc(size_t size, size_t align)
+{
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+#ifdef WIN32
+    void* p = _aligned_malloc(size, align);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, align, size) != 0)
+        p = nullptr;
+#endif
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+inline void aligned_free(void* p)
+{
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/** Allocator honouring alignof(T), e.g. for std::allocate_shared */
+template <typename T>
+struct aligned_allocator {
+    typedef T value_type;
+
+    aligned_allocator() noexcept {}
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(aligned_malloc(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        aligned_free(p);
+    }
+
+    template <typename U>
+    struct rebind {
+        typedef aligned_allocator<U> other;
+    };
+};
+
+template <typename T, typename U>
+bool operator==(const aligned_allocator<T>&, const aligned_allocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const aligned_allocator<T>&, const aligned_allocator<U>&) { return false; }
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
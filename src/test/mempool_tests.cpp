@@ -101,4 +101,47 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolMiningIndexTest)
+{
+    // Test that the indexes CreateNewBlock reads follow the pool
+    CTxMemPool testPool(CFeeRate(0));
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.n = i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+        // Fees rise and priorities fall along the array
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000LL * (i + 1), 0, 30.0 - 10.0 * i, 1));
+    }
+    BOOST_CHECK_EQUAL(testPool.setByFeeRate.size(), 3);
+    BOOST_CHECK(testPool.setByFeeRate.begin()->second == tx[2].GetHash());
+    BOOST_CHECK(testPool.setByPriority.begin()->second == tx[0].GetHash());
+
+    // Prioritisation moves a transaction in both indexes
+    testPool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), -100.0, 10000LL);
+    BOOST_CHECK(testPool.setByFeeRate.begin()->second == tx[0].GetHash());
+    BOOST_CHECK(testPool.setByPriority.rbegin()->second == tx[0].GetHash());
+    testPool.ClearPrioritisation(tx[0].GetHash());
+    BOOST_CHECK(testPool.setByFeeRate.rbegin()->second == tx[0].GetHash());
+    BOOST_CHECK(testPool.setByPriority.begin()->second == tx[0].GetHash());
+
+    // Rescoring for a later block keeps every transaction
+    testPool.UpdatePriorityIndex(100);
+    BOOST_CHECK_EQUAL(testPool.setByPriority.size(), 3);
+
+    std::list<CTransaction> removed;
+    testPool.remove(tx[2], removed);
+    BOOST_CHECK_EQUAL(testPool.setByFeeRate.size(), 2);
+    BOOST_CHECK_EQUAL(testPool.setByPriority.size(), 2);
+    BOOST_CHECK(testPool.setByFeeRate.begin()->second == tx[1].GetHash());
+
+    testPool.clear();
+    BOOST_CHECK(testPool.setByFeeRate.empty());
+    BOOST_CHECK(testPool.setByPriority.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
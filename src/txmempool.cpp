@@ -48,7 +48,7 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nPriorityHeight(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -95,7 +95,11 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
+    std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+    if (it != mapTx.end())
+        removeFromMiningIndex(hash, it->second);
     mapTx[hash] = entry;
+    addToMiningIndex(hash, entry);
     const CTransaction& tx = mapTx[hash].GetTx();
     for (unsigned int i = 0; i < tx.vin.size(); i++)
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
@@ -155,6 +159,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             }
 
             removed.push_back(tx);
+            removeFromMiningIndex(hash, mapTx[hash]);
             totalTxSize -= mapTx[hash].GetTxSize();
             mapTx.erase(hash);
             nTransactionsUpdated++;
@@ -267,6 +272,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+    // Rescore for the next block now, rather than in the first template for it
+    UpdatePriorityIndex(nBlockHeight + 1);
 }
 
 void CTxMemPool::clear()
@@ -274,10 +281,56 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByPriority.clear();
+    setByFeeRate.clear();
     totalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
+double CTxMemPool::GetMiningPriority(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    // Entries that arrived after the index was last scored have not aged yet
+    return entry.GetPriority(std::max(nPriorityHeight, entry.GetHeight())) + dPriorityDelta;
+}
+
+double CTxMemPool::GetMiningFeeRate(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    return (double)(entry.GetFee() + nFeeDelta) / entry.GetTxSize();
+}
+
+// The scores are recomputed rather than stored, so every change to what they
+// depend on - the deltas and nPriorityHeight - must take the entry out of the
+// index first and put it back afterwards
+
+void CTxMemPool::addToMiningIndex(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    setByPriority.insert(std::make_pair(GetMiningPriority(hash, entry), hash));
+    setByFeeRate.insert(std::make_pair(GetMiningFeeRate(hash, entry), hash));
+}
+
+void CTxMemPool::removeFromMiningIndex(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    setByPriority.erase(std::make_pair(GetMiningPriority(hash, entry), hash));
+    setByFeeRate.erase(std::make_pair(GetMiningFeeRate(hash, entry), hash));
+}
+
+void CTxMemPool::UpdatePriorityIndex(unsigned int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    setByPriority.clear();
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++)
+        setByPriority.insert(std::make_pair(GetMiningPriority(it->first, it->second), it->first));
+}
+
 void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 {
     if (!fSanityCheck)
@@ -379,6 +432,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
 
     assert(totalTxSize == checkTotal);
+    assert(setByPriority.size() == mapTx.size());
+    assert(setByFeeRate.size() == mapTx.size());
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -450,9 +505,14 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
 {
     {
         LOCK(cs);
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
+            removeFromMiningIndex(hash, it->second);
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        if (it != mapTx.end())
+            addToMiningIndex(hash, it->second);
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -471,7 +531,12 @@ void CTxMemPool::ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount
 void CTxMemPool::ClearPrioritisation(const uint256 hash)
 {
     LOCK(cs);
+    std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+    if (it != mapTx.end())
+        removeFromMiningIndex(hash, it->second);
     mapDeltas.erase(hash);
+    if (it != mapTx.end())
+        addToMiningIndex(hash, it->second);
 }
 
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
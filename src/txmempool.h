@@ -6,7 +6,9 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <functional>
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -62,6 +64,9 @@ public:
 
 class CBlockPolicyEstimator;
 
+/** Mempool transactions by a mining score, best first, with ties broken by txid */
+typedef std::set<std::pair<double, uint256>, std::greater<std::pair<double, uint256> > > CTxMemPoolScoreIndex;
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -93,6 +98,12 @@ private:
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    unsigned int nPriorityHeight; //! block height the priorities in setByPriority are for
+
+    double GetMiningPriority(const uint256& hash, const CTxMemPoolEntry& entry);
+    double GetMiningFeeRate(const uint256& hash, const CTxMemPoolEntry& entry);
+    void addToMiningIndex(const uint256& hash, const CTxMemPoolEntry& entry);
+    void removeFromMiningIndex(const uint256& hash, const CTxMemPoolEntry& entry);
 
 public:
     mutable CCriticalSection cs;
@@ -100,6 +111,15 @@ public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, const CTransaction*> mapNullifiers;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    /**
+     * The candidates CreateNewBlock takes transactions from: every mempool
+     * transaction by priority at nPriorityHeight and by fee rate in satoshis
+     * per byte, prioritisation included. They are kept up to date as
+     * transactions come and go, so a template only looks at as many
+     * transactions as it takes to fill a block.
+     */
+    CTxMemPoolScoreIndex setByPriority;
+    CTxMemPoolScoreIndex setByFeeRate;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
@@ -121,6 +141,8 @@ public:
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
+    /** Rescores setByPriority for a block at nHeight, if it is not already */
+    void UpdatePriorityIndex(unsigned int nHeight);
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
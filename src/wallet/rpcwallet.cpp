@@ -2400,6 +2400,12 @@ Value zc_benchmark(const json_spirit::Array& params, bool fHelp)
             "Runs a benchmark of the selected type samplecount times,\n"
             "returning the running times of each sample.\n"
             "\n"
+            "restartequihash and restartequihashgpu time how long the CPU or GPU\n"
+            "solver takes to complete a solve on a new chain tip that arrives at a\n"
+            "random point in a solve. An optional third argument, true by default,\n"
+            "cancels the stale solve as -minerrestart=cancel does; false lets it\n"
+            "finish first.\n"
+            "\n"
             "Output: [\n"
             "  {\n"
             "    \"runningtime\": runningtime\n"
@@ -2453,6 +2459,9 @@ Value zc_benchmark(const json_spirit::Array& params, bool fHelp)
                 std::vector<double> vals = benchmark_solve_equihash_threaded(nThreads);
                 sample_times.insert(sample_times.end(), vals.begin(), vals.end());
             }
+        } else if (benchmarktype == "restartequihash" || benchmarktype == "restartequihashgpu") {
+            bool cancel = params.size() < 3 || params[2].get_bool();
+            sample_times.push_back(benchmark_restart_equihash(benchmarktype == "restartequihashgpu", cancel));
         } else if (benchmarktype == "verifyequihash") {
             sample_times.push_back(benchmark_verify_equihash());
         } else if (benchmarktype == "validatelargetx") {
@@ -1,8 +1,10 @@
+#include <atomic>
 #include <future>
 #include <thread>
 #include <unistd.h>
 #include <boost/filesystem.hpp>
 
+#include "arith_uint256.h"
 #include "coins.h"
 #include "util.h"
 #include "init.h"
@@ -14,6 +16,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pow.h"
+#include "random.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
@@ -24,6 +27,9 @@
 #include "zcash/Zcash.h"
 #include "zcash/IncrementalMerkleTree.hpp"
 
+#include "libzogminer/cpusolver.h"
+#include "libzogminer/gpusolver.h"
+
 using namespace libzcash;
 
 void timer_start(timeval &tv_start)
@@ -150,6 +156,104 @@ std::vector<double> benchmark_solve_equihash_threaded(int nThreads)
     return ret;
 }
 
+// Solves with the engine of BitcoinMiner on header I of block and the
+// nonce, giving up if cancelled
+static void solve_equihash_nonce(EquihashSolver* cpuSolver, GPUSolver* gpuSolver,
+                                 unsigned int n, unsigned int k,
+                                 const CBlock& block, const uint256& nonce,
+                                 std::function<bool()> cancelled)
+{
+    CEquihashInput I{block};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    std::function<bool(std::vector<unsigned char>)> validBlock =
+            [](std::vector<unsigned char> soln) { return false; };
+
+    if (cpuSolver) {
+        cpuSolver->setHeader((unsigned char*)&ss[0], ss.size());
+        cpuSolver->solve(nonce, validBlock, [&cancelled](EhSolverCancelCheck pos) {
+            return cancelled();
+        });
+    } else {
+        crypto_generichash_blake2b_state state;
+        EhInitialiseState(n, k, state);
+        crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
+        std::vector<unsigned char> header(ss.begin(), ss.end());
+        header.insert(header.end(), nonce.begin(), nonce.end());
+        gpuSolver->run(n, k, header.data(), header.size(),
+                       *((uint64_t *)(nonce.begin()+sizeof(uint64_t)+4)),
+                       validBlock, [&cancelled](GPUSolverCancelCheck pos) {
+            return cancelled();
+        }, state);
+    }
+}
+
+double benchmark_restart_equihash(bool useGPU, bool cancel)
+{
+    unsigned int n = Params(CBaseChainParams::MAIN).EquihashN();
+    unsigned int k = Params(CBaseChainParams::MAIN).EquihashK();
+
+    // Blocks on the old tip and on the new one
+    CBlock blocks[2];
+    blocks[1].hashPrevBlock = ArithToUint256(arith_uint256(1));
+
+    std::unique_ptr<EquihashSolver> cpuSolver;
+    std::unique_ptr<GPUSolver> gpuSolver;
+    if (useGPU) {
+        gpuSolver.reset(new GPUSolver(0, GetArg("-deviceid", 0)));
+    } else {
+        cpuSolver.reset(new EquihashSolver(n, k, GetArg("-equihashmem", 0) << 20));
+    }
+
+    // Solves on the old tip until the tip changes, then on the new tip until
+    // one solve there completes, cancelling the stale solve if asked to, as
+    // BitcoinMiner does
+    std::atomic<bool> tipChanged {false};
+    std::atomic<int> runsStarted {0};
+    std::atomic<int64_t> secondRunStart {0};
+    std::atomic<int64_t> firstRunStart {0};
+    int64_t solvedOnNewTip = 0;
+    std::thread miner([&]() {
+        arith_uint256 nonce;
+        while (true) {
+            bool onNewTip = tipChanged;
+            int64_t now = GetTimeMicros();
+            int runs = ++runsStarted;
+            if (runs == 1) {
+                firstRunStart = now;
+            } else if (runs == 2) {
+                secondRunStart = now;
+            }
+            try {
+                solve_equihash_nonce(cpuSolver.get(), gpuSolver.get(), n, k,
+                                     blocks[onNewTip], ArithToUint256(nonce),
+                                     [&tipChanged, onNewTip, cancel]() {
+                    return cancel && !onNewTip && tipChanged;
+                });
+                if (onNewTip) {
+                    solvedOnNewTip = GetTimeMicros();
+                    return;
+                }
+            } catch (EhSolverCancelledException&) {
+            } catch (GPUSolverCancelledException&) {
+            }
+            nonce++;
+        }
+    });
+
+    // Change the tip at a random point in a solve, once the length of one
+    // is known
+    while (runsStarted < 2) {
+        MilliSleep(1);
+    }
+    int64_t runTime = std::max<int64_t>(1, secondRunStart - firstRunStart);
+    std::this_thread::sleep_for(std::chrono::microseconds(GetRand(runTime)));
+    int64_t tipTime = GetTimeMicros();
+    tipChanged = true;
+    miner.join();
+    return (solvedOnNewTip - tipTime) / 1000000.0;
+}
+
 double benchmark_verify_equihash()
 {
     CChainParams params = Params(CBaseChainParams::MAIN);
@@ -9,6 +9,7 @@ extern double benchmark_parameter_loading();
 extern double benchmark_create_joinsplit();
 extern double benchmark_solve_equihash();
 extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
+extern double benchmark_restart_equihash(bool useGPU, bool cancel);
 extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
 extern double benchmark_verify_equihash();
 extern double benchmark_large_tx();